@@ -0,0 +1,10 @@
+#!/usr/bin/bash
+# Assemble the synthetic benchmark cartridges. Run from the repository root.
+set -ex
+for cart in bench/carts/*/
+do
+    mkdir -p $cart/build
+    as-z80 -march=z80+full -ignore-undocumented-instructions $cart/game.s -o $cart/build/game.o
+    ld-z80 -b elf32-z80 -A z80 $cart/build/game.o -T bench/carts/link.ld -o $cart/build/game.elf
+    objcopy-z80 --only-section=.text -O binary $cart/build/game.elf $cart/build/game.bin
+done
@@ -0,0 +1,37 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: the CPU never idles, multiplying numbers with shifts and adds as fast as it can with interrupts off
+RESULT_ADDR = 8 * 1024
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    di
+    jr multiply_loop
+
+.section .text
+multiply_loop:
+    ld de, 1
+.multiply:
+    ; hl = de * e, one bit of e at a time
+    ld hl, 0
+    ld a, e
+    ld b, 8
+.multiply_bit:
+    add hl, hl
+    add a, a
+    jr nc, 1f
+    add hl, de
+1:
+    djnz .multiply_bit
+    ld (RESULT_ADDR), hl
+    inc de
+    jr .multiply
@@ -0,0 +1,23 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: a game that does almost nothing, halting until each interrupt and counting frames
+FRAME_ADDR = 8 * 1024
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ld hl, FRAME_ADDR
+    inc (hl)
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    im 1
+    ei
+.spin:
+    halt
+    jr .spin
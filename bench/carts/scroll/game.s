@@ -0,0 +1,63 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: a checkerboard tile map scrolled diagonally by a pixel every frame with the two scroll registers
+SPRITE_ENTRY_SIZE = 4
+SPRITE_ENTRIES_NUM = 64
+SPRITE_TABLE_ADDR = 48 * 1024
+TILE_TABLE_ADDR = SPRITE_TABLE_ADDR + SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE
+TILE_MAP_NUM_X = 32
+TILE_MAP_NUM_Y = 32
+REG_SCROLL_X = TILE_TABLE_ADDR + TILE_MAP_NUM_X * TILE_MAP_NUM_Y * 2
+REG_SCROLL_Y = REG_SCROLL_X + 1
+PPU_DEFS_ADDR = 16 * 1024
+SPRITE_0_ADDR = PPU_DEFS_ADDR + 0 * 64
+SPRITE_1_ADDR = PPU_DEFS_ADDR + 1 * 64
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ld hl, REG_SCROLL_X
+    inc (hl)
+    ld hl, REG_SCROLL_Y
+    inc (hl)
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    jr setup_background
+
+.section .text
+setup_background:
+    ; Alternate the two defs along each row of the map, starting each row with the other one
+    ld hl, TILE_TABLE_ADDR
+    ld c, TILE_MAP_NUM_Y
+.fill_row:
+    ld b, TILE_MAP_NUM_X
+.fill_tile:
+    ld a, b
+    xor c
+    and 1
+    jr z, 1f
+    ld (hl), SPRITE_1_ADDR & 0xFF
+    inc hl
+    ld (hl), SPRITE_1_ADDR >> 8
+    jr 2f
+1:
+    ld (hl), SPRITE_0_ADDR & 0xFF
+    inc hl
+    ld (hl), SPRITE_0_ADDR >> 8
+2:
+    inc hl
+    djnz .fill_tile
+    dec c
+    jr nz, .fill_row
+
+    im 1
+    ei
+.spin:
+    halt
+    jr .spin
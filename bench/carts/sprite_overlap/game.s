@@ -0,0 +1,58 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: every tile drawn and all 64 sprites stacked on the same spot, so every sprite is drawn over the others
+SPRITE_ENTRY_SIZE = 4
+SPRITE_ENTRIES_NUM = 64
+SPRITE_TABLE_ADDR = 48 * 1024
+TILE_TABLE_ADDR = SPRITE_TABLE_ADDR + SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE
+TILE_MAP_ENTRIES = 32 * 32
+PPU_DEFS_ADDR = 16 * 1024
+SPRITE_0_ADDR = PPU_DEFS_ADDR + 0 * 64
+SPRITE_1_ADDR = PPU_DEFS_ADDR + 1 * 64
+SPRITE_X = 96
+SPRITE_Y = 72
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    jr setup_background
+
+.section .text
+setup_background:
+    ; Fill the whole tile map, which is bigger than the display
+    ld hl, TILE_TABLE_ADDR
+    ld bc, TILE_MAP_ENTRIES
+.fill_tile:
+    ld (hl), SPRITE_1_ADDR & 0xFF
+    inc hl
+    ld (hl), SPRITE_1_ADDR >> 8
+    inc hl
+    dec bc
+    ld a, b
+    or c
+    jr nz, .fill_tile
+
+    ld ix, SPRITE_TABLE_ADDR
+    ld de, SPRITE_ENTRY_SIZE
+    ld b, SPRITE_ENTRIES_NUM
+.setup_sprite:
+    ld (ix), SPRITE_X
+    ld (ix+1), SPRITE_Y
+    ld (ix+2), SPRITE_0_ADDR & 0xFF
+    ld (ix+3), SPRITE_0_ADDR >> 8
+    add ix, de
+    djnz .setup_sprite
+
+    im 1
+    ei
+.spin:
+    halt
+    jr .spin
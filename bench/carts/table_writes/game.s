@@ -0,0 +1,66 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: the CPU rewrites the whole sprite table and tile map in a loop without waiting for the PPU
+SPRITE_ENTRY_SIZE = 4
+SPRITE_ENTRIES_NUM = 64
+SPRITE_TABLE_ADDR = 48 * 1024
+TILE_TABLE_ADDR = SPRITE_TABLE_ADDR + SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE
+TILE_MAP_ENTRIES = 32 * 32
+PPU_DEFS_ADDR = 16 * 1024
+SPRITE_0_ADDR = PPU_DEFS_ADDR + 0 * 64
+SPRITE_1_ADDR = PPU_DEFS_ADDR + 1 * 64
+PASS_ADDR = 8 * 1024
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    di
+    jr write_tables
+
+.section .text
+write_tables:
+    ld a, (PASS_ADDR)
+    inc a
+    ld (PASS_ADDR), a
+
+    ; Sprites in a diagonal line that shifts right each pass
+    ld ix, SPRITE_TABLE_ADDR
+    ld de, SPRITE_ENTRY_SIZE
+    ld b, SPRITE_ENTRIES_NUM
+.write_sprite:
+    and 127
+    ld (ix), a
+    ld (ix+1), b
+    ld (ix+2), SPRITE_0_ADDR & 0xFF
+    ld (ix+3), SPRITE_0_ADDR >> 8
+    add ix, de
+    add a, 3
+    djnz .write_sprite
+
+    ; Tiles alternate between two definitions on each pass
+    ld hl, TILE_TABLE_ADDR
+    ld de, SPRITE_0_ADDR
+    ld a, (PASS_ADDR)
+    and 1
+    jr z, 1f
+    ld de, SPRITE_1_ADDR
+1:
+    ld bc, TILE_MAP_ENTRIES
+.write_tile:
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
+    dec bc
+    ld a, b
+    or c
+    jr nz, .write_tile
+    jr write_tables
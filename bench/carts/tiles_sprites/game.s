@@ -0,0 +1,84 @@
+; vim: ft=z80 tabstop=4 shiftwidth=4:
+; Benchmark: every tile drawn and all 64 sprites active, each moved one pixel every frame
+SPRITE_ENTRY_SIZE = 4
+SPRITE_ENTRIES_NUM = 64
+SPRITE_TABLE_ADDR = 48 * 1024
+TILE_TABLE_ADDR = SPRITE_TABLE_ADDR + SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE
+TILE_MAP_ENTRIES = 32 * 32
+PPU_DEFS_ADDR = 16 * 1024
+SPRITE_0_ADDR = PPU_DEFS_ADDR + 0 * 64
+SPRITE_1_ADDR = PPU_DEFS_ADDR + 1 * 64
+; Sprites wrap back to the left before they'd run off the right of the display
+SPRITE_MAX_X = 192
+
+.section .intHandler
+.global _intHandler
+_intHandler:
+    ld ix, SPRITE_TABLE_ADDR
+    ld de, SPRITE_ENTRY_SIZE
+    ld b, SPRITE_ENTRIES_NUM
+.move_sprite:
+    ld a, (ix)
+    inc a
+    cp SPRITE_MAX_X
+    jr c, 1f
+    xor a
+1:
+    ld (ix), a
+    add ix, de
+    djnz .move_sprite
+    ei
+    reti
+
+.section .start
+.global _start
+.extern _stack_end
+_start:
+    ld ix, _stack_end
+    ld sp, ix
+    jr setup_background
+
+.section .text
+setup_background:
+    ; Fill the whole tile map, which is bigger than the display
+    ld hl, TILE_TABLE_ADDR
+    ld bc, TILE_MAP_ENTRIES
+.fill_tile:
+    ld (hl), SPRITE_1_ADDR & 0xFF
+    inc hl
+    ld (hl), SPRITE_1_ADDR >> 8
+    inc hl
+    dec bc
+    ld a, b
+    or c
+    jr nz, .fill_tile
+
+    ; Spread the sprites over an 8x8 grid
+    ld ix, SPRITE_TABLE_ADDR
+    ld de, SPRITE_ENTRY_SIZE
+    ld c, 0 ; y
+    ld h, 8
+.sprite_row:
+    ld l, 0 ; x
+    ld b, 8
+.sprite_column:
+    ld (ix), l
+    ld (ix+1), c
+    ld (ix+2), SPRITE_0_ADDR & 0xFF
+    ld (ix+3), SPRITE_0_ADDR >> 8
+    add ix, de
+    ld a, l
+    add a, 24
+    ld l, a
+    djnz .sprite_column
+    ld a, c
+    add a, 18
+    ld c, a
+    dec h
+    jr nz, .sprite_row
+
+    im 1
+    ei
+.spin:
+    halt
+    jr .spin
@@ -0,0 +1,42 @@
+// Micro-benchmark for the pixel map to ARGB row converters. Reports Mpixels/s for each converter the host supports and
+// checks that they all agree with the scalar one.
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/consts.h"
+#include "../src/palette.h"
+
+#define ITERATIONS 2000
+#define PIXELS_NUM (DISPLAY_PIXELS_X * DISPLAY_PIXELS_Y)
+
+static uint8_t pixels[PIXELS_NUM];
+static uint32_t expected[PIXELS_NUM];
+static uint32_t out[PIXELS_NUM];
+
+int main(int argc, char** argv) {
+    unsigned iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : ITERATIONS;
+    paletteInit();
+    srand(1);
+    for (unsigned i = 0; i < PIXELS_NUM; i++) pixels[i] = rand() & (PALETTE_COLOURS_NUM - 1);
+
+    RowConverterImpl impls[8];
+    unsigned count = paletteConverters(impls, 8);
+    for (unsigned y = 0; y < DISPLAY_PIXELS_Y; y++) impls[0].convert(&pixels[y * DISPLAY_PIXELS_X], &expected[y * DISPLAY_PIXELS_X], DISPLAY_PIXELS_X);
+
+    int result = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned n = 0; n < iterations; n++) {
+            for (unsigned y = 0; y < DISPLAY_PIXELS_Y; y++) impls[i].convert(&pixels[y * DISPLAY_PIXELS_X], &out[y * DISPLAY_PIXELS_X], DISPLAY_PIXELS_X);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        bool matches = memcmp(out, expected, sizeof(out)) == 0;
+        printf("%-8s %8.1f Mpixels/s%s\n", impls[i].name, (double)PIXELS_NUM * iterations / seconds / 1e6, matches ? "" : " (MISMATCH)");
+        if (!matches) result = 1;
+    }
+    return result;
+}
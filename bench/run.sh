@@ -0,0 +1,43 @@
+#!/usr/bin/bash
+# Run each synthetic cartridge headless for a fixed number of frames and collect the results as a JSON array, one cartridge
+# per line. Build the emulator with build.sh and the cartridges with bench/build.sh first, and run from the repository root.
+#
+# usage: bench/run.sh [frames] [output json] [baseline json]
+# Extra emulator options, e.g. --hle or --no-idle-skip, can be given in BENCH_ARGS.
+set -e
+frames=${1:-600}
+out=${2:-build/bench.json}
+baseline=$3
+carts="tiles_sprites sprite_overlap cpu_arith table_writes idle_halt scroll"
+
+field() {
+    sed -n "s/.*\"$2\": \([^,}]*\).*/\1/p" <<< "$1"
+}
+
+mkdir -p build/bench
+echo "[" > $out
+separator=""
+printf "%-16s %10s %10s %10s %12s %10s %8s\n" cartridge frames/s "PPU MHz" "CPU MHz" ns/instr "RSS KB" baseline
+for cart in $carts
+do
+    build/main.out build/ppu.bin n bench/carts/$cart/cartridge.txt bench/carts/$cart/build/game.bin --headless --frames $frames \
+        --bench-json build/bench/$cart.json $BENCH_ARGS > build/bench/$cart.log
+    result=$(sed "s/^{/{\"cartridge\": \"$cart\", /" build/bench/$cart.json)
+    printf "%s%s" "$separator" "$result" >> $out
+    separator=$',\n'
+
+    fps=$(field "$result" frames_per_second)
+    change="-"
+    if [ -n "$baseline" ]
+    then
+        baseFps=$(field "$(grep "\"cartridge\": \"$cart\"" $baseline)" frames_per_second)
+        if [ -n "$baseFps" ]
+        then
+            change=$(awk "BEGIN { printf \"%+.1f%%\", ($fps / $baseFps - 1) * 100 }")
+        fi
+    fi
+    printf "%-16s %10s %10s %10s %12s %10s %8s\n" $cart $fps $(field "$result" ppu_mhz) $(field "$result" cpu_mhz) \
+        $(field "$result" ns_per_instruction) $(field "$result" peak_rss_kb) $change
+done
+printf "\n]\n" >> $out
+echo "Wrote $out"
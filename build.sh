@@ -3,7 +3,6 @@ set -ex
 mkdir -p build
 opt=$1
 debug=$2
-clang -O3 -g0 -o build/main.out -lz80 -lSDL2 src/main.c
 #clang-z80 --target=z80-none-elf -nostdinc $opt -g0 -S -o build/ppu.s src/ppu.c
 if [ "$debug" = "y" ]
 then
@@ -14,3 +13,9 @@ as-z80 -march=z80+full -ignore-undocumented-instructions src/ppu.s -o build/ppu.
 ld-z80 -b elf32-z80 $opt -A z80 build/ppu.o -T src/link.ld -o build/ppu.elf
 # Dump the machine code to a binary file to load in to PPU ROM
 objcopy-z80 --only-section=.text -O binary build/ppu.elf build/ppu.bin
+# The native renderer only stands in for this exact PPU ROM, which it recognises by its CRC32 (taken from the gzip trailer)
+stock_crc=$(gzip -c build/ppu.bin | tail -c8 | od -An -tx4 -N4 | tr -d ' ')
+clang -O3 -g0 -DSTOCK_PPU_ROM_CRC=0x$stock_crc -o build/main.out -lz80 -lSDL2 -lpthread src/main.c src/machine.c src/blockcache.c src/input.c src/counters.c src/pacing.c src/trace.c src/palette.c src/profiler.c src/snapshot.c src/delta.c src/capture.c
+clang -O3 -g0 -o build/palette_bench.out bench/palette.c src/palette.c
+clang -O3 -g0 -o build/trace.out tools/trace.c
+clang -O3 -g0 -o build/capture.out -lpthread tools/capture.c src/capture.c src/delta.c src/palette.c
@@ -3,18 +3,34 @@ SPRITE_ENTRY_SIZE = 4
 SPRITE_ENTRIES_NUM = 64
 SPRITE_TABLE_ADDR = 48 * 1024
 TILE_TABLE_ADDR = SPRITE_TABLE_ADDR + SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE
+TILE_MAP_ENTRIES = 32 * 32
+REG_SPRITE_COUNT = TILE_TABLE_ADDR + TILE_MAP_ENTRIES * 2 + 2
 PPU_DEFS_ADDR = 16 * 1024
 SPRITE_0_ADDR = PPU_DEFS_ADDR + 0 * 64
 SPRITE_2_ADDR = PPU_DEFS_ADDR + 2 * 64
+CONTROLLER_PORT = 0
+CONTROLLER_UP_BIT = 0
+CONTROLLER_DOWN_BIT = 1
 
 .section .intHandler
 .global _intHandler
 _intHandler:
+    ; Move the sprite up and down with the controller, which is latched once a frame
+    push af
+    ld ix, SPRITE_TABLE_ADDR
+    in a, (CONTROLLER_PORT)
+    bit CONTROLLER_UP_BIT, a
+    jr z, .notUp
+    dec (ix+1) ; y
+.notUp:
+    bit CONTROLLER_DOWN_BIT, a
+    jr z, .notDown
+    inc (ix+1)
+.notDown:
+    pop af
     inc b
     jp nz, .ret
-    ld ix, SPRITE_TABLE_ADDR
     ld (ix), c ; x
-    ld (ix+1), 0 ; y
     ld (ix+2), SPRITE_0_ADDR & 0xFF ; sprite addr low
     ld (ix+3), SPRITE_0_ADDR >> 8 ; sprite addr high
     inc c
@@ -32,15 +48,21 @@ _start:
 
 .section .text
 setup_background:
-    ld ix, TILE_TABLE_ADDR
-    ld bc, 2
-    .rep 19
-        .rep 25
-            ld (ix), SPRITE_2_ADDR & 0xFF
-            ld (ix+1), SPRITE_2_ADDR >> 8
-            add ix, bc
-        .endr
-    .endr
+    ; Fill the whole tile map, which is bigger than the display
+    ld hl, TILE_TABLE_ADDR
+    ld bc, TILE_MAP_ENTRIES
+.fill_tile:
+    ld (hl), SPRITE_2_ADDR & 0xFF
+    inc hl
+    ld (hl), SPRITE_2_ADDR >> 8
+    inc hl
+    dec bc
+    ld a, b
+    or c
+    jr nz, .fill_tile
+    ; Only the first sprite entry is used
+    ld a, 1
+    ld (REG_SPRITE_COUNT), a
     ld b, 0
     ld c, 0
     im 1
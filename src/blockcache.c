@@ -0,0 +1,902 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockcache.h"
+#include "machine.h"
+
+// A page that keeps being written after blocks are decoded from it is mixing code and data, so it's left to libz80
+#define MAX_PAGE_FAULTS 8
+// Pushes and calls write two bytes
+#define MAX_BLOCK_WRITES (BLOCK_MAX_OPS * 2)
+
+typedef struct BlockExec BlockExec;
+typedef struct BlockOp BlockOp;
+typedef void (*BlockOpHandler)(BlockExec* x, const BlockOp* op);
+
+// One decoded instruction. Registers are resolved to their offset in the Z80Context, so an index register simply stands in for
+// HL, and relative branches to their target.
+struct BlockOp {
+    BlockOpHandler run;
+    // Address of the following instruction
+    ushort next;
+    // Immediate word or branch target
+    ushort nn;
+    byte n;
+    byte r;
+    byte r2;
+    signed char d;
+    byte cc;
+    byte tstates;
+    // Extra T-states when a conditional branch is taken
+    byte taken;
+    byte rInc;
+};
+
+typedef struct {
+    ushort start;
+    byte firstPage;
+    byte lastPage;
+    unsigned count;
+    BlockOp ops[BLOCK_MAX_OPS];
+} Block;
+
+typedef struct {
+    ushort address;
+    byte value;
+    bool io;
+} BusWrite;
+
+typedef struct {
+    BusWrite writes[MAX_BLOCK_WRITES];
+    unsigned count;
+} WriteLog;
+
+struct BlockExec {
+    Z80Context* ctx;
+    byte** readPages;
+    // While checking, the writes of the decoded run are held here instead of reaching the bus
+    WriteLog* log;
+};
+
+struct BlockCache {
+    const char* name;
+    Z80Context* ctx;
+    byte** readPages;
+    byte** writePages;
+    bool check;
+    bool cacheable[PAGE_COUNT];
+    // Write pages taken away from pages that hold blocks
+    bool protectedPage[PAGE_COUNT];
+    byte* savedWritePages[PAGE_COUNT];
+    byte faults[PAGE_COUNT];
+    // The block being run, which a write fault mustn't free from under it
+    Block* current;
+    bool currentDropped;
+    WriteLog expected;
+    WriteLog actual;
+    Z80DataOut memWrite;
+    Z80DataOut ioWrite;
+    BlockCacheStats stats;
+    // By start address. NULL hasn't been decoded yet and noBlock can't be.
+    Block* blocks[ADDRESS_SPACE_SIZE];
+};
+
+static Block noBlock;
+
+#define REG8(x, off) (*((byte*)(x)->ctx + (off)))
+#define REG16(x, off) (*(ushort*)((byte*)(x)->ctx + (off)))
+#define CTX_OFFSET(field) ((byte)offsetof(Z80Context, field))
+#define OFF_A CTX_OFFSET(R1.br.A)
+#define OFF_F CTX_OFFSET(R1.br.F)
+#define OFF_B CTX_OFFSET(R1.br.B)
+#define OFF_L CTX_OFFSET(R1.br.L)
+#define OFF_BC CTX_OFFSET(R1.wr.BC)
+#define OFF_DE CTX_OFFSET(R1.wr.DE)
+#define OFF_HL CTX_OFFSET(R1.wr.HL)
+#define OFF_SP CTX_OFFSET(R1.wr.SP)
+
+_Static_assert(offsetof(Z80Context, R1) + sizeof(Z80Regs) < 256, "registers must be addressable by a byte offset");
+
+// Register operands in the order the opcodes encode them. (HL) has no register so is left as 0.
+static const byte reg8Offsets[8] = {
+    CTX_OFFSET(R1.br.B), CTX_OFFSET(R1.br.C), CTX_OFFSET(R1.br.D), CTX_OFFSET(R1.br.E),
+    CTX_OFFSET(R1.br.H), CTX_OFFSET(R1.br.L), 0, CTX_OFFSET(R1.br.A)
+};
+static const byte reg16Offsets[4] = { CTX_OFFSET(R1.wr.BC), CTX_OFFSET(R1.wr.DE), CTX_OFFSET(R1.wr.HL), CTX_OFFSET(R1.wr.SP) };
+static const byte stackRegOffsets[4] = { CTX_OFFSET(R1.wr.BC), CTX_OFFSET(R1.wr.DE), CTX_OFFSET(R1.wr.HL), CTX_OFFSET(R1.wr.AF) };
+// Flag tested by each pair of conditions, the odd one of which is taken when it's set
+static const byte condFlags[4] = { F_Z, F_C, F_PV, F_S };
+
+static inline byte busRead(BlockExec* x, ushort address) {
+    if (x->log) {
+        for (unsigned i = x->log->count; i > 0; i--) {
+            BusWrite* w = &x->log->writes[i - 1];
+            if (!w->io && w->address == address) return w->value;
+        }
+    }
+    return x->readPages[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+static inline void busWrite(BlockExec* x, ushort address, byte value) {
+    if (x->log) x->log->writes[x->log->count++] = (BusWrite){ .address = address, .value = value, .io = false };
+    else x->ctx->memWrite(x->ctx->memParam, address, value);
+}
+
+static inline void ioWrite(BlockExec* x, ushort port, byte value) {
+    if (x->log) x->log->writes[x->log->count++] = (BusWrite){ .address = port, .value = value, .io = true };
+    else x->ctx->ioWrite(x->ctx->ioParam, port, value);
+}
+
+static inline bool condition(BlockExec* x, byte cc) {
+    return ((REG8(x, OFF_F) & condFlags[cc >> 1]) != 0) == (cc & 1);
+}
+
+static inline byte parityFlag(byte v) {
+    return __builtin_parity(v) ? 0 : F_PV;
+}
+
+// S, Z and the undocumented bits 3 and 5 of an 8-bit result
+static inline byte szFlags(byte v) {
+    return (v & (F_S | F_5 | F_3)) | (v ? 0 : F_Z);
+}
+
+static inline void push(BlockExec* x, ushort value) {
+    ushort sp = REG16(x, OFF_SP);
+    busWrite(x, --sp, value >> 8);
+    busWrite(x, --sp, value & 0xFF);
+    REG16(x, OFF_SP) = sp;
+}
+
+static inline ushort pop(BlockExec* x) {
+    ushort sp = REG16(x, OFF_SP);
+    ushort value = busRead(x, sp) | (busRead(x, sp + 1) << 8);
+    REG16(x, OFF_SP) = sp + 2;
+    return value;
+}
+
+static void opNop(BlockExec* x, const BlockOp* op) {
+}
+
+static void opLd8(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = REG8(x, op->r2);
+}
+
+static void opLd8Imm(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = op->n;
+}
+
+// Loads through a register pair, plus a displacement for the index registers
+static void opLd8FromPair(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = busRead(x, REG16(x, op->r2) + op->d);
+}
+
+static void opLd8ToPair(BlockExec* x, const BlockOp* op) {
+    busWrite(x, REG16(x, op->r2) + op->d, REG8(x, op->r));
+}
+
+static void opLdImmToPair(BlockExec* x, const BlockOp* op) {
+    busWrite(x, REG16(x, op->r2) + op->d, op->n);
+}
+
+static void opLd8FromAbs(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = busRead(x, op->nn);
+}
+
+static void opLd8ToAbs(BlockExec* x, const BlockOp* op) {
+    busWrite(x, op->nn, REG8(x, op->r));
+}
+
+static void opLd16(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r) = REG16(x, op->r2);
+}
+
+static void opLd16Imm(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r) = op->nn;
+}
+
+static void opLd16FromAbs(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r) = busRead(x, op->nn) | (busRead(x, op->nn + 1) << 8);
+}
+
+static void opLd16ToAbs(BlockExec* x, const BlockOp* op) {
+    ushort value = REG16(x, op->r);
+    busWrite(x, op->nn, value & 0xFF);
+    busWrite(x, op->nn + 1, value >> 8);
+}
+
+static void opInc16(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r)++;
+}
+
+static void opDec16(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r)--;
+}
+
+static inline byte inc8(BlockExec* x, byte v) {
+    byte r = v + 1;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & F_C) | szFlags(r) | ((r & 0xF) == 0 ? F_H : 0) | (v == 0x7F ? F_PV : 0);
+    return r;
+}
+
+static inline byte dec8(BlockExec* x, byte v) {
+    byte r = v - 1;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & F_C) | F_N | szFlags(r) | ((v & 0xF) == 0 ? F_H : 0) | (v == 0x80 ? F_PV : 0);
+    return r;
+}
+
+static void opInc8(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = inc8(x, REG8(x, op->r));
+}
+
+static void opDec8(BlockExec* x, const BlockOp* op) {
+    REG8(x, op->r) = dec8(x, REG8(x, op->r));
+}
+
+static void opInc8Mem(BlockExec* x, const BlockOp* op) {
+    ushort address = REG16(x, op->r2) + op->d;
+    busWrite(x, address, inc8(x, busRead(x, address)));
+}
+
+static void opDec8Mem(BlockExec* x, const BlockOp* op) {
+    ushort address = REG16(x, op->r2) + op->d;
+    busWrite(x, address, dec8(x, busRead(x, address)));
+}
+
+static void opAdd16(BlockExec* x, const BlockOp* op) {
+    unsigned a = REG16(x, op->r);
+    unsigned b = REG16(x, op->r2);
+    unsigned r = a + b;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_PV)) | ((r >> 8) & (F_5 | F_3)) | (((a ^ b ^ r) >> 8) & F_H) | ((r >> 16) & F_C);
+    REG16(x, op->r) = r;
+}
+
+static void opAdc16(BlockExec* x, const BlockOp* op) {
+    unsigned a = REG16(x, OFF_HL);
+    unsigned b = REG16(x, op->r2);
+    unsigned r = a + b + (REG8(x, OFF_F) & F_C);
+    REG8(x, OFF_F) = ((r >> 8) & (F_S | F_5 | F_3)) | ((r & 0xFFFF) ? 0 : F_Z) | (((a ^ b ^ r) >> 8) & F_H) |
+                     ((~(a ^ b) & (a ^ r) & 0x8000) ? F_PV : 0) | ((r >> 16) & F_C);
+    REG16(x, OFF_HL) = r;
+}
+
+static void opSbc16(BlockExec* x, const BlockOp* op) {
+    unsigned a = REG16(x, OFF_HL);
+    unsigned b = REG16(x, op->r2);
+    unsigned r = a - b - (REG8(x, OFF_F) & F_C);
+    REG8(x, OFF_F) = ((r >> 8) & (F_S | F_5 | F_3)) | ((r & 0xFFFF) ? 0 : F_Z) | F_N | (((a ^ b ^ r) >> 8) & F_H) |
+                     (((a ^ b) & (a ^ r) & 0x8000) ? F_PV : 0) | ((r >> 16) & F_C);
+    REG16(x, OFF_HL) = r;
+}
+
+static inline void add8(BlockExec* x, byte v, unsigned carry) {
+    byte a = REG8(x, OFF_A);
+    unsigned r = a + v + carry;
+    REG8(x, OFF_F) = szFlags(r) | ((a ^ v ^ r) & F_H) | ((~(a ^ v) & (a ^ r) & 0x80) ? F_PV : 0) | ((r >> 8) & F_C);
+    REG8(x, OFF_A) = r;
+}
+
+static inline byte sub8(BlockExec* x, byte v, unsigned carry) {
+    byte a = REG8(x, OFF_A);
+    unsigned r = a - v - carry;
+    REG8(x, OFF_F) = szFlags(r) | F_N | ((a ^ v ^ r) & F_H) | (((a ^ v) & (a ^ r) & 0x80) ? F_PV : 0) | ((r >> 8) & F_C);
+    return r;
+}
+
+static inline void aluAdd(BlockExec* x, byte v) { add8(x, v, 0); }
+static inline void aluAdc(BlockExec* x, byte v) { add8(x, v, REG8(x, OFF_F) & F_C); }
+static inline void aluSub(BlockExec* x, byte v) { REG8(x, OFF_A) = sub8(x, v, 0); }
+static inline void aluSbc(BlockExec* x, byte v) { REG8(x, OFF_A) = sub8(x, v, REG8(x, OFF_F) & F_C); }
+static inline void aluAnd(BlockExec* x, byte v) { byte r = REG8(x, OFF_A) &= v; REG8(x, OFF_F) = szFlags(r) | F_H | parityFlag(r); }
+static inline void aluXor(BlockExec* x, byte v) { byte r = REG8(x, OFF_A) ^= v; REG8(x, OFF_F) = szFlags(r) | parityFlag(r); }
+static inline void aluOr(BlockExec* x, byte v) { byte r = REG8(x, OFF_A) |= v; REG8(x, OFF_F) = szFlags(r) | parityFlag(r); }
+// Compare takes bits 3 and 5 from the operand rather than the result
+static inline void aluCp(BlockExec* x, byte v) { sub8(x, v, 0); REG8(x, OFF_F) = (REG8(x, OFF_F) & ~(F_5 | F_3)) | (v & (F_5 | F_3)); }
+
+// Each arithmetic operation on a register, an immediate and memory through a register pair
+#define ALU_HANDLERS(name, alu) \
+    static void name##Reg(BlockExec* x, const BlockOp* op) { alu(x, REG8(x, op->r)); } \
+    static void name##Imm(BlockExec* x, const BlockOp* op) { alu(x, op->n); } \
+    static void name##Mem(BlockExec* x, const BlockOp* op) { alu(x, busRead(x, REG16(x, op->r2) + op->d)); }
+
+ALU_HANDLERS(opAdd, aluAdd)
+ALU_HANDLERS(opAdc, aluAdc)
+ALU_HANDLERS(opSub, aluSub)
+ALU_HANDLERS(opSbc, aluSbc)
+ALU_HANDLERS(opAnd, aluAnd)
+ALU_HANDLERS(opXor, aluXor)
+ALU_HANDLERS(opOr, aluOr)
+ALU_HANDLERS(opCp, aluCp)
+
+// In opcode order, by source: register, immediate, memory
+static const BlockOpHandler aluHandlers[8][3] = {
+    { opAddReg, opAddImm, opAddMem }, { opAdcReg, opAdcImm, opAdcMem }, { opSubReg, opSubImm, opSubMem }, { opSbcReg, opSbcImm, opSbcMem },
+    { opAndReg, opAndImm, opAndMem }, { opXorReg, opXorImm, opXorMem }, { opOrReg, opOrImm, opOrMem }, { opCpReg, opCpImm, opCpMem }
+};
+
+static void opRlca(BlockExec* x, const BlockOp* op) {
+    byte a = REG8(x, OFF_A);
+    a = (a << 1) | (a >> 7);
+    REG8(x, OFF_A) = a;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_PV)) | (a & (F_5 | F_3 | F_C));
+}
+
+static void opRrca(BlockExec* x, const BlockOp* op) {
+    byte a = REG8(x, OFF_A);
+    byte carry = a & 1;
+    a = (a >> 1) | (a << 7);
+    REG8(x, OFF_A) = a;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_PV)) | (a & (F_5 | F_3)) | carry;
+}
+
+static void opRla(BlockExec* x, const BlockOp* op) {
+    byte a = REG8(x, OFF_A);
+    byte carry = a >> 7;
+    a = (a << 1) | (REG8(x, OFF_F) & F_C);
+    REG8(x, OFF_A) = a;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_PV)) | (a & (F_5 | F_3)) | carry;
+}
+
+static void opRra(BlockExec* x, const BlockOp* op) {
+    byte a = REG8(x, OFF_A);
+    byte carry = a & 1;
+    a = (a >> 1) | ((REG8(x, OFF_F) & F_C) << 7);
+    REG8(x, OFF_A) = a;
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_PV)) | (a & (F_5 | F_3)) | carry;
+}
+
+static void opExDeHl(BlockExec* x, const BlockOp* op) {
+    ushort de = x->ctx->R1.wr.DE;
+    x->ctx->R1.wr.DE = x->ctx->R1.wr.HL;
+    x->ctx->R1.wr.HL = de;
+}
+
+static void opExx(BlockExec* x, const BlockOp* op) {
+    Z80Regs* r1 = &x->ctx->R1;
+    Z80Regs* r2 = &x->ctx->R2;
+    ushort bc = r1->wr.BC, de = r1->wr.DE, hl = r1->wr.HL;
+    r1->wr.BC = r2->wr.BC;
+    r1->wr.DE = r2->wr.DE;
+    r1->wr.HL = r2->wr.HL;
+    r2->wr.BC = bc;
+    r2->wr.DE = de;
+    r2->wr.HL = hl;
+}
+
+static void opExAf(BlockExec* x, const BlockOp* op) {
+    ushort af = x->ctx->R1.wr.AF;
+    x->ctx->R1.wr.AF = x->ctx->R2.wr.AF;
+    x->ctx->R2.wr.AF = af;
+}
+
+static void opJp(BlockExec* x, const BlockOp* op) {
+    x->ctx->PC = op->nn;
+}
+
+static void opJpCond(BlockExec* x, const BlockOp* op) {
+    if (condition(x, op->cc)) x->ctx->PC = op->nn;
+}
+
+static void opJpPair(BlockExec* x, const BlockOp* op) {
+    x->ctx->PC = REG16(x, op->r);
+}
+
+static void opJrCond(BlockExec* x, const BlockOp* op) {
+    if (!condition(x, op->cc)) return;
+    x->ctx->PC = op->nn;
+    x->ctx->tstates += op->taken;
+}
+
+static void opDjnz(BlockExec* x, const BlockOp* op) {
+    if (--REG8(x, OFF_B) == 0) return;
+    x->ctx->PC = op->nn;
+    x->ctx->tstates += op->taken;
+}
+
+static void opCall(BlockExec* x, const BlockOp* op) {
+    push(x, op->next);
+    x->ctx->PC = op->nn;
+}
+
+static void opCallCond(BlockExec* x, const BlockOp* op) {
+    if (!condition(x, op->cc)) return;
+    push(x, op->next);
+    x->ctx->PC = op->nn;
+    x->ctx->tstates += op->taken;
+}
+
+static void opRet(BlockExec* x, const BlockOp* op) {
+    x->ctx->PC = pop(x);
+}
+
+static void opRetCond(BlockExec* x, const BlockOp* op) {
+    if (!condition(x, op->cc)) return;
+    x->ctx->PC = pop(x);
+    x->ctx->tstates += op->taken;
+}
+
+static void opPush(BlockExec* x, const BlockOp* op) {
+    push(x, REG16(x, op->r));
+}
+
+static void opPop(BlockExec* x, const BlockOp* op) {
+    REG16(x, op->r) = pop(x);
+}
+
+static void opOutImm(BlockExec* x, const BlockOp* op) {
+    byte a = REG8(x, OFF_A);
+    ioWrite(x, (a << 8) | op->n, a);
+}
+
+static void opOutC(BlockExec* x, const BlockOp* op) {
+    ioWrite(x, REG16(x, OFF_BC), REG8(x, op->r));
+}
+
+static void opOutC0(BlockExec* x, const BlockOp* op) {
+    ioWrite(x, REG16(x, OFF_BC), 0);
+}
+
+static void opLdi(BlockExec* x, const BlockOp* op) {
+    byte v = busRead(x, REG16(x, OFF_HL)++);
+    busWrite(x, REG16(x, OFF_DE)++, v);
+    ushort bc = --REG16(x, OFF_BC);
+    byte n = v + REG8(x, OFF_A);
+    REG8(x, OFF_F) = (REG8(x, OFF_F) & (F_S | F_Z | F_C)) | (n & F_3) | ((n << 4) & F_5) | (bc ? F_PV : 0);
+}
+
+// B is decremented before it goes out on the top half of the port address
+static void opOuti(BlockExec* x, const BlockOp* op) {
+    byte v = busRead(x, REG16(x, OFF_HL));
+    byte b = --REG8(x, OFF_B);
+    ioWrite(x, REG16(x, OFF_BC), v);
+    REG16(x, OFF_HL)++;
+    unsigned k = v + REG8(x, OFF_L);
+    REG8(x, OFF_F) = szFlags(b) | (v & 0x80 ? F_N : 0) | (k > 0xFF ? F_H | F_C : 0) | parityFlag((k & 7) ^ b);
+}
+
+static inline byte fetch(BlockCache* cache, ushort address) {
+    return cache->readPages[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+static inline ushort fetchWord(BlockCache* cache, ushort address) {
+    return fetch(cache, address) | (fetch(cache, address + 1) << 8);
+}
+
+static inline void setOp(BlockOp* op, BlockOpHandler run, byte length, byte tstates) {
+    op->run = run;
+    op->next += length;
+    op->tstates = tstates;
+}
+
+// Decode an instruction prefixed by DD or FD, with index the offset of IX or IY. Only the documented forms are handled.
+static bool decodeIndexed(BlockCache* cache, ushort pc, BlockOp* op, byte index, bool* ends) {
+    byte opc = fetch(cache, pc + 1);
+    byte y = (opc >> 3) & 7;
+    byte z = opc & 7;
+    op->rInc = 2;
+    op->r2 = index;
+    op->d = (signed char)fetch(cache, pc + 2);
+    switch (opc) {
+        case 0x21: op->r = index; op->nn = fetchWord(cache, pc + 2); setOp(op, opLd16Imm, 4, 14); return true;
+        case 0x22: op->r = index; op->nn = fetchWord(cache, pc + 2); setOp(op, opLd16ToAbs, 4, 20); return true;
+        case 0x2A: op->r = index; op->nn = fetchWord(cache, pc + 2); setOp(op, opLd16FromAbs, 4, 20); return true;
+        case 0x23: op->r = index; setOp(op, opInc16, 2, 10); return true;
+        case 0x2B: op->r = index; setOp(op, opDec16, 2, 10); return true;
+        case 0x09: case 0x19: case 0x29: case 0x39:
+            op->r = index;
+            op->r2 = opc == 0x29 ? index : reg16Offsets[opc >> 4];
+            setOp(op, opAdd16, 2, 15);
+            return true;
+        case 0x34: setOp(op, opInc8Mem, 3, 23); return true;
+        case 0x35: setOp(op, opDec8Mem, 3, 23); return true;
+        case 0x36: op->n = fetch(cache, pc + 3); setOp(op, opLdImmToPair, 4, 19); return true;
+        case 0xE1: op->r = index; setOp(op, opPop, 2, 14); return true;
+        case 0xE5: op->r = index; setOp(op, opPush, 2, 15); return true;
+        case 0xE9: op->r = index; setOp(op, opJpPair, 2, 8); *ends = true; return true;
+        case 0xF9: op->r = OFF_SP; op->r2 = index; setOp(op, opLd16, 2, 10); return true;
+    }
+    if (opc >= 0x40 && opc < 0x80 && opc != 0x76) {
+        // ld r,(ix+d) and ld (ix+d),r use the real H and L, and the other forms are undocumented
+        if (z == 6) {
+            op->r = reg8Offsets[y];
+            setOp(op, opLd8FromPair, 3, 19);
+            return true;
+        }
+        if (y == 6) {
+            op->r = reg8Offsets[z];
+            setOp(op, opLd8ToPair, 3, 19);
+            return true;
+        }
+        return false;
+    }
+    if (opc >= 0x80 && opc < 0xC0 && z == 6) {
+        setOp(op, aluHandlers[y][2], 3, 19);
+        return true;
+    }
+    return false;
+}
+
+static bool decodeExtended(BlockCache* cache, ushort pc, BlockOp* op) {
+    byte opc = fetch(cache, pc + 1);
+    byte y = (opc >> 3) & 7;
+    op->rInc = 2;
+    // A core without I/O leaves its port writes to libz80
+    if ((opc == 0xA3 || (opc & 0xC7) == 0x41) && !cache->ctx->ioWrite) return false;
+    switch (opc) {
+        case 0xA0: setOp(op, opLdi, 2, 16); return true;
+        case 0xA3: setOp(op, opOuti, 2, 16); return true;
+        case 0x71: setOp(op, opOutC0, 2, 12); return true;
+        case 0x41: case 0x49: case 0x51: case 0x59: case 0x61: case 0x69: case 0x79:
+            op->r = reg8Offsets[y];
+            setOp(op, opOutC, 2, 12);
+            return true;
+        case 0x42: case 0x52: case 0x62: case 0x72: op->r2 = reg16Offsets[y >> 1]; setOp(op, opSbc16, 2, 15); return true;
+        case 0x4A: case 0x5A: case 0x6A: case 0x7A: op->r2 = reg16Offsets[y >> 1]; setOp(op, opAdc16, 2, 15); return true;
+        case 0x43: case 0x53: case 0x73:
+            op->r = reg16Offsets[y >> 1];
+            op->nn = fetchWord(cache, pc + 2);
+            setOp(op, opLd16ToAbs, 4, 20);
+            return true;
+        case 0x4B: case 0x5B: case 0x7B:
+            op->r = reg16Offsets[y >> 1];
+            op->nn = fetchWord(cache, pc + 2);
+            setOp(op, opLd16FromAbs, 4, 20);
+            return true;
+    }
+    return false;
+}
+
+// Decode the instruction at pc into op. Returns false if it has no handler, and sets ends after an instruction that can branch.
+static bool decodeOp(BlockCache* cache, ushort pc, BlockOp* op, bool* ends) {
+    byte opc = fetch(cache, pc);
+    byte y = (opc >> 3) & 7;
+    byte z = opc & 7;
+    *op = (BlockOp){ .next = pc, .rInc = 1 };
+    if (opc == 0xDD || opc == 0xFD) return decodeIndexed(cache, pc, op, opc == 0xDD ? CTX_OFFSET(R1.wr.IX) : CTX_OFFSET(R1.wr.IY), ends);
+    if (opc == 0xED) return decodeExtended(cache, pc, op);
+    if (opc >= 0x40 && opc < 0x80) {
+        if (opc == 0x76) return false;
+        op->r2 = OFF_HL;
+        if (z == 6) {
+            op->r = reg8Offsets[y];
+            setOp(op, opLd8FromPair, 1, 7);
+        } else if (y == 6) {
+            op->r = reg8Offsets[z];
+            setOp(op, opLd8ToPair, 1, 7);
+        } else {
+            op->r = reg8Offsets[y];
+            op->r2 = reg8Offsets[z];
+            setOp(op, opLd8, 1, 4);
+        }
+        return true;
+    }
+    if (opc >= 0x80 && opc < 0xC0) {
+        op->r = reg8Offsets[z];
+        op->r2 = OFF_HL;
+        if (z == 6) setOp(op, aluHandlers[y][2], 1, 7);
+        else setOp(op, aluHandlers[y][0], 1, 4);
+        return true;
+    }
+    if (opc < 0x40) {
+        switch (z) {
+            case 4:
+            case 5:
+                op->r = reg8Offsets[y];
+                op->r2 = OFF_HL;
+                if (y == 6) setOp(op, z == 4 ? opInc8Mem : opDec8Mem, 1, 11);
+                else setOp(op, z == 4 ? opInc8 : opDec8, 1, 4);
+                return true;
+            case 6:
+                op->r = reg8Offsets[y];
+                op->r2 = OFF_HL;
+                op->n = fetch(cache, pc + 1);
+                if (y == 6) setOp(op, opLdImmToPair, 2, 10);
+                else setOp(op, opLd8Imm, 2, 7);
+                return true;
+        }
+    }
+    if ((opc & 0xC7) == 0xC6) {
+        op->n = fetch(cache, pc + 1);
+        setOp(op, aluHandlers[y][1], 2, 7);
+        return true;
+    }
+    if ((opc & 0xC7) == 0xC2) {
+        op->cc = y;
+        op->nn = fetchWord(cache, pc + 1);
+        setOp(op, opJpCond, 3, 10);
+        *ends = true;
+        return true;
+    }
+    if ((opc & 0xC7) == 0xC4) {
+        op->cc = y;
+        op->nn = fetchWord(cache, pc + 1);
+        op->taken = 7;
+        setOp(op, opCallCond, 3, 10);
+        *ends = true;
+        return true;
+    }
+    if ((opc & 0xC7) == 0xC0) {
+        op->cc = y;
+        op->taken = 6;
+        setOp(op, opRetCond, 1, 5);
+        *ends = true;
+        return true;
+    }
+    if ((opc & 0xCF) == 0xC5) {
+        op->r = stackRegOffsets[y >> 1];
+        setOp(op, opPush, 1, 11);
+        return true;
+    }
+    if ((opc & 0xCF) == 0xC1) {
+        op->r = stackRegOffsets[y >> 1];
+        setOp(op, opPop, 1, 10);
+        return true;
+    }
+    switch (opc) {
+        case 0x00: setOp(op, opNop, 1, 4); return true;
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            op->r = reg16Offsets[opc >> 4];
+            op->nn = fetchWord(cache, pc + 1);
+            setOp(op, opLd16Imm, 3, 10);
+            return true;
+        case 0x03: case 0x13: case 0x23: case 0x33: op->r = reg16Offsets[opc >> 4]; setOp(op, opInc16, 1, 6); return true;
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B: op->r = reg16Offsets[opc >> 4]; setOp(op, opDec16, 1, 6); return true;
+        case 0x09: case 0x19: case 0x29: case 0x39: op->r = OFF_HL; op->r2 = reg16Offsets[opc >> 4]; setOp(op, opAdd16, 1, 11); return true;
+        case 0x02: case 0x12: op->r = OFF_A; op->r2 = reg16Offsets[opc >> 4]; setOp(op, opLd8ToPair, 1, 7); return true;
+        case 0x0A: case 0x1A: op->r = OFF_A; op->r2 = reg16Offsets[opc >> 4]; setOp(op, opLd8FromPair, 1, 7); return true;
+        case 0x22: op->r = OFF_HL; op->nn = fetchWord(cache, pc + 1); setOp(op, opLd16ToAbs, 3, 16); return true;
+        case 0x2A: op->r = OFF_HL; op->nn = fetchWord(cache, pc + 1); setOp(op, opLd16FromAbs, 3, 16); return true;
+        case 0x32: op->r = OFF_A; op->nn = fetchWord(cache, pc + 1); setOp(op, opLd8ToAbs, 3, 13); return true;
+        case 0x3A: op->r = OFF_A; op->nn = fetchWord(cache, pc + 1); setOp(op, opLd8FromAbs, 3, 13); return true;
+        case 0x07: setOp(op, opRlca, 1, 4); return true;
+        case 0x0F: setOp(op, opRrca, 1, 4); return true;
+        case 0x17: setOp(op, opRla, 1, 4); return true;
+        case 0x1F: setOp(op, opRra, 1, 4); return true;
+        case 0x08: setOp(op, opExAf, 1, 4); return true;
+        case 0xD9: setOp(op, opExx, 1, 4); return true;
+        case 0xEB: setOp(op, opExDeHl, 1, 4); return true;
+        case 0xF9: op->r = OFF_SP; op->r2 = OFF_HL; setOp(op, opLd16, 1, 6); return true;
+        case 0xD3:
+            if (!cache->ctx->ioWrite) return false;
+            op->n = fetch(cache, pc + 1);
+            setOp(op, opOutImm, 2, 11);
+            return true;
+        case 0x10:
+            op->nn = pc + 2 + (signed char)fetch(cache, pc + 1);
+            op->taken = 5;
+            setOp(op, opDjnz, 2, 8);
+            *ends = true;
+            return true;
+        case 0x18:
+            op->nn = pc + 2 + (signed char)fetch(cache, pc + 1);
+            setOp(op, opJp, 2, 12);
+            *ends = true;
+            return true;
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            op->cc = y - 4;
+            op->nn = pc + 2 + (signed char)fetch(cache, pc + 1);
+            op->taken = 5;
+            setOp(op, opJrCond, 2, 7);
+            *ends = true;
+            return true;
+        case 0xC3: op->nn = fetchWord(cache, pc + 1); setOp(op, opJp, 3, 10); *ends = true; return true;
+        case 0xCD: op->nn = fetchWord(cache, pc + 1); setOp(op, opCall, 3, 17); *ends = true; return true;
+        case 0xC9: setOp(op, opRet, 1, 10); *ends = true; return true;
+        case 0xE9: op->r = OFF_HL; setOp(op, opJpPair, 1, 4); *ends = true; return true;
+    }
+    return false;
+}
+
+// Take away the write page of a page a block was decoded from, so writes to it come to blockCacheWriteFault. Only RAM, whose
+// writes land in the memory that's read, needs it. ROM pages keep the write trap or slow path they already have, as writes
+// can't change them.
+static void protectPage(BlockCache* cache, unsigned page) {
+    if (cache->protectedPage[page] || !cache->writePages[page] || cache->writePages[page] != cache->readPages[page]) return;
+    cache->savedWritePages[page] = cache->writePages[page];
+    cache->writePages[page] = NULL;
+    cache->protectedPage[page] = true;
+}
+
+static Block* decodeBlock(BlockCache* cache, ushort start) {
+    Block* block = malloc(sizeof(Block));
+    if (!block) return &noBlock;
+    block->start = start;
+    block->count = 0;
+    ushort pc = start;
+    bool ends = false;
+    while (!ends && block->count < BLOCK_MAX_OPS) {
+        BlockOp* op = &block->ops[block->count];
+        if (!decodeOp(cache, pc, op, &ends)) break;
+        ushort last = op->next - 1;
+        // Every byte has to come from a page the cache watches
+        if (!cache->cacheable[pc >> PAGE_SHIFT] || !cache->cacheable[last >> PAGE_SHIFT] || last < pc) break;
+        block->count++;
+        pc = op->next;
+    }
+    if (block->count == 0) {
+        free(block);
+        return &noBlock;
+    }
+    block->firstPage = start >> PAGE_SHIFT;
+    block->lastPage = (ushort)(block->ops[block->count - 1].next - 1) >> PAGE_SHIFT;
+    protectPage(cache, block->firstPage);
+    protectPage(cache, block->lastPage);
+    cache->stats.blocksDecoded++;
+    return block;
+}
+
+static void dropBlock(BlockCache* cache, Block* block) {
+    cache->blocks[block->start] = NULL;
+    if (block == cache->current) cache->currentDropped = true;
+    else free(block);
+}
+
+static unsigned runOps(BlockExec* x, BlockCache* cache, Block* block, unsigned long long budget) {
+    Z80Context* ctx = x->ctx;
+    unsigned i = 0;
+    while (i < block->count) {
+        const BlockOp* op = &block->ops[i++];
+        ctx->PC = op->next;
+        ctx->R = (ctx->R & 0x80) | ((ctx->R + op->rInc) & 0x7F);
+        ctx->tstates += op->tstates;
+        op->run(x, op);
+        // A write to the block's own memory drops it, and the rest of it may no longer be what's there
+        if (ctx->tstates >= budget || cache->currentDropped) break;
+    }
+    return i;
+}
+
+// The libz80 writes of a checked run are captured by swapping the core's callbacks, which only get the machine as their param
+static _Thread_local BlockCache* capturing;
+
+static void captureMemWrite(size_t param, ushort address, byte data) {
+    WriteLog* log = &capturing->actual;
+    if (log->count < MAX_BLOCK_WRITES) log->writes[log->count++] = (BusWrite){ .address = address, .value = data, .io = false };
+    capturing->memWrite(param, address, data);
+}
+
+static void captureIOWrite(size_t param, ushort port, byte data) {
+    WriteLog* log = &capturing->actual;
+    if (log->count < MAX_BLOCK_WRITES) log->writes[log->count++] = (BusWrite){ .address = port, .value = data, .io = true };
+    capturing->ioWrite(param, port, data);
+}
+
+// Whether every write in one log is in the other, in any order
+static bool writesMatch(WriteLog* a, WriteLog* b) {
+    if (a->count != b->count) return false;
+    for (unsigned i = 0; i < a->count; i++) {
+        bool found = false;
+        for (unsigned j = 0; j < b->count && !found; j++) found = memcmp(&a->writes[i], &b->writes[j], sizeof(BusWrite)) == 0;
+        if (!found) return false;
+    }
+    return true;
+}
+
+static bool sameCore(Z80Context* a, Z80Context* b, bool ioWritten) {
+    // I/O writes can stall the core, which the held back run never sees
+    return memcmp(&a->R1, &b->R1, sizeof(Z80Regs)) == 0 && memcmp(&a->R2, &b->R2, sizeof(Z80Regs)) == 0 && a->PC == b->PC &&
+           a->R == b->R && a->I == b->I && a->IFF1 == b->IFF1 && a->IFF2 == b->IFF2 && a->IM == b->IM && a->halted == b->halted &&
+           (ioWritten || a->tstates == b->tstates);
+}
+
+// Run the block on a copy of the core with its writes held back, then run the same instructions through libz80 and compare
+static unsigned checkBlock(BlockCache* cache, Block* block, unsigned long long budget) {
+    Z80Context* ctx = cache->ctx;
+    Z80Context copy = *ctx;
+    cache->expected.count = 0;
+    BlockExec x = { .ctx = &copy, .readPages = cache->readPages, .log = &cache->expected };
+    unsigned count = runOps(&x, cache, block, budget);
+
+    cache->actual.count = 0;
+    cache->memWrite = ctx->memWrite;
+    cache->ioWrite = ctx->ioWrite;
+    capturing = cache;
+    ctx->memWrite = captureMemWrite;
+    if (ctx->ioWrite) ctx->ioWrite = captureIOWrite;
+    for (unsigned i = 0; i < count; i++) Z80Execute(ctx);
+    ctx->memWrite = cache->memWrite;
+    ctx->ioWrite = cache->ioWrite;
+    capturing = NULL;
+
+    bool ioWritten = false;
+    for (unsigned i = 0; i < cache->expected.count; i++) ioWritten |= cache->expected.writes[i].io;
+    cache->stats.checkedBlocks++;
+    if (!sameCore(&copy, ctx, ioWritten) || !writesMatch(&cache->expected, &cache->actual)) {
+        cache->stats.mismatchedBlocks++;
+        printf("%s block cache mismatch in the block at %x after %u instructions: PC %x/%x AF %x/%x BC %x/%x DE %x/%x HL %x/%x "
+               "SP %x/%x, %u/%u T-states, %u/%u writes\n", cache->name, block->start, count, copy.PC, ctx->PC, copy.R1.wr.AF,
+               ctx->R1.wr.AF, copy.R1.wr.BC, ctx->R1.wr.BC, copy.R1.wr.DE, ctx->R1.wr.DE, copy.R1.wr.HL, ctx->R1.wr.HL,
+               copy.R1.wr.SP, ctx->R1.wr.SP, copy.tstates, ctx->tstates, cache->expected.count, cache->actual.count);
+        // Leave it to libz80 from now on
+        if (cache->blocks[block->start] == block) {
+            dropBlock(cache, block);
+            cache->blocks[block->start] = &noBlock;
+        }
+    }
+    return count;
+}
+
+unsigned blockCacheRun(BlockCache* cache, unsigned long long budget) {
+    Z80Context* ctx = cache->ctx;
+    // Anything libz80 does between instructions is left to it
+    if (ctx->halted || ctx->nmi_req || ctx->defer_int || (ctx->int_req && ctx->IFF1)) return 0;
+    Block* block = cache->blocks[ctx->PC];
+    if (!block) {
+        if (!cache->cacheable[ctx->PC >> PAGE_SHIFT]) return 0;
+        block = cache->blocks[ctx->PC] = decodeBlock(cache, ctx->PC);
+    }
+    if (block == &noBlock) return 0;
+    cache->current = block;
+    cache->currentDropped = false;
+    unsigned count;
+    if (cache->check) count = checkBlock(cache, block, budget);
+    else {
+        BlockExec x = { .ctx = ctx, .readPages = cache->readPages, .log = NULL };
+        count = runOps(&x, cache, block, budget);
+    }
+    cache->current = NULL;
+    if (cache->currentDropped) free(block);
+    cache->stats.blockRuns++;
+    cache->stats.instructions += count;
+    return count;
+}
+
+bool blockCacheWriteFault(BlockCache* cache, ushort address) {
+    unsigned page = address >> PAGE_SHIFT;
+    if (!cache->protectedPage[page]) return false;
+    // Blocks are shorter than a page, so only those starting here or on the page before can reach into it
+    unsigned start = page > 0 ? (page - 1) << PAGE_SHIFT : 0;
+    unsigned end = (page + 1) << PAGE_SHIFT;
+    for (unsigned addr = start; addr < end; addr++) {
+        Block* block = cache->blocks[addr];
+        if (block == &noBlock) {
+            if (addr >> PAGE_SHIFT == page) cache->blocks[addr] = NULL;
+        } else if (block && (block->firstPage == page || block->lastPage == page)) {
+            dropBlock(cache, block);
+            cache->stats.invalidations++;
+        }
+    }
+    cache->writePages[page] = cache->savedWritePages[page];
+    cache->protectedPage[page] = false;
+    if (++cache->faults[page] >= MAX_PAGE_FAULTS) cache->cacheable[page] = false;
+    return true;
+}
+
+void blockCacheFlush(BlockCache* cache) {
+    for (unsigned addr = 0; addr < ADDRESS_SPACE_SIZE; addr++) {
+        if (cache->blocks[addr] && cache->blocks[addr] != &noBlock) dropBlock(cache, cache->blocks[addr]);
+        cache->blocks[addr] = NULL;
+    }
+    for (unsigned page = 0; page < PAGE_COUNT; page++) {
+        if (!cache->protectedPage[page]) continue;
+        cache->writePages[page] = cache->savedWritePages[page];
+        cache->protectedPage[page] = false;
+    }
+}
+
+BlockCache* blockCacheCreate(const char* name, Z80Context* ctx, byte** readPages, byte** writePages) {
+    BlockCache* cache = calloc(1, sizeof(BlockCache));
+    if (!cache) return NULL;
+    cache->name = name;
+    cache->ctx = ctx;
+    cache->readPages = readPages;
+    cache->writePages = writePages;
+    return cache;
+}
+
+void blockCacheDestroy(BlockCache* cache) {
+    blockCacheFlush(cache);
+    free(cache);
+}
+
+void blockCacheSetCacheable(BlockCache* cache, unsigned page, bool cacheable) {
+    cache->cacheable[page] = cacheable;
+}
+
+void blockCacheSetCheck(BlockCache* cache, bool check) {
+    cache->check = check;
+}
+
+const BlockCacheStats* blockCacheStats(BlockCache* cache) {
+    return &cache->stats;
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <z80.h>
+#include <stdbool.h>
+
+// Longest run of instructions decoded into one block
+#define BLOCK_MAX_OPS 32
+
+typedef struct BlockCache BlockCache;
+
+typedef struct {
+    unsigned long long blocksDecoded;
+    unsigned long long blockRuns;
+    // Instructions run from blocks rather than by libz80
+    unsigned long long instructions;
+    // Blocks dropped because the memory they were decoded from was written
+    unsigned long long invalidations;
+    unsigned long long checkedBlocks;
+    unsigned long long mismatchedBlocks;
+} BlockCacheStats;
+
+// Basic blocks of one core decoded once into handlers with their operands and T-states resolved. Only instructions with a
+// handler are decoded, and a block ends at the first one without, which is left to libz80. readPages and writePages are the
+// core's page tables, which must stay in place for the life of the cache.
+BlockCache* blockCacheCreate(const char* name, Z80Context* ctx, byte** readPages, byte** writePages);
+void blockCacheDestroy(BlockCache* cache);
+// Allow blocks to be decoded from a page. While a writable page holds blocks its write page is taken away, so the first write
+// to it comes down the core's slow path and must be passed to blockCacheWriteFault.
+void blockCacheSetCacheable(BlockCache* cache, unsigned page, bool cacheable);
+// Compare every block against libz80 running the same instructions, which is what actually runs while checking
+void blockCacheSetCheck(BlockCache* cache, bool check);
+// Run the block at the core's PC, stopping after the first instruction that takes the core's tstates to budget. Returns the
+// number of instructions run, or 0 if the next instruction has to go to libz80.
+unsigned blockCacheRun(BlockCache* cache, unsigned long long budget);
+// Drop the blocks decoded from the page of a write that found no write page and give the page back its write page. Returns
+// false if the page wasn't one the cache had taken.
+bool blockCacheWriteFault(BlockCache* cache, ushort address);
+// Drop every block, for when memory has been replaced behind the core's back
+void blockCacheFlush(BlockCache* cache);
+const BlockCacheStats* blockCacheStats(BlockCache* cache);
+
+#endif
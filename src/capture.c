@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "delta.h"
+
+struct CaptureWriter {
+    FILE* file;
+    size_t frameSize;
+    unsigned buffers;
+    uint8_t* pool;
+    uint32_t* poolFrames;
+    // The emulation thread fills the slot at head and the writer thread empties the one at tail, so each counter only has one
+    // writer. The semaphore counts queued frames, plus one more when closing.
+    _Atomic unsigned long long head;
+    _Atomic unsigned long long tail;
+    sem_t queued;
+    pthread_t thread;
+    unsigned long long dropped;
+    // Only used by the writer thread until it's been joined
+    uint8_t* previous;
+    uint8_t* encoded;
+    CaptureIndexEntry* index;
+    size_t indexCapacity;
+    uint64_t offset;
+    bool failed;
+    CaptureStats stats;
+};
+
+static bool writeRecord(CaptureWriter* capture, uint32_t frame, const uint8_t* pixels) {
+    if (capture->stats.captured == capture->indexCapacity) {
+        size_t capacity = capture->indexCapacity ? capture->indexCapacity * 2 : 1024;
+        CaptureIndexEntry* grown = realloc(capture->index, capacity * sizeof(CaptureIndexEntry));
+        if (!grown) return false;
+        capture->index = grown;
+        capture->indexCapacity = capacity;
+    }
+    bool keyframe = capture->stats.captured % CAPTURE_KEYFRAME_INTERVAL == 0;
+    CaptureRecordHeader header = { .frame = frame, .flags = keyframe ? CAPTURE_KEYFRAME : 0 };
+    header.encodedLen = deltaEncode(keyframe ? NULL : capture->previous, pixels, capture->frameSize, capture->encoded);
+    capture->index[capture->stats.captured] = (CaptureIndexEntry){ .frame = frame, .flags = header.flags, .offset = capture->offset };
+    memcpy(capture->previous, pixels, capture->frameSize);
+    capture->stats.captured++;
+    if (keyframe) capture->stats.keyframes++;
+    capture->offset += sizeof(header) + header.encodedLen;
+    return fwrite(&header, sizeof(header), 1, capture->file) == 1 &&
+           fwrite(capture->encoded, 1, header.encodedLen, capture->file) == header.encodedLen;
+}
+
+static void* captureWriterThread(void* arg) {
+    CaptureWriter* capture = arg;
+    while (true) {
+        while (sem_wait(&capture->queued) != 0 && errno == EINTR);
+        unsigned long long tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+        // Every frame is posted before the close, so an empty queue means everything has been written
+        if (tail == atomic_load_explicit(&capture->head, memory_order_acquire)) break;
+        unsigned slot = tail % capture->buffers;
+        // After a failed write the frames are still taken so the emulation thread sees the buffers come free
+        if (!capture->failed && !writeRecord(capture, capture->poolFrames[slot], &capture->pool[slot * capture->frameSize])) {
+            capture->failed = true;
+        }
+        atomic_store_explicit(&capture->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void captureFree(CaptureWriter* capture) {
+    free(capture->pool);
+    free(capture->poolFrames);
+    free(capture->previous);
+    free(capture->encoded);
+    free(capture->index);
+    free(capture);
+}
+
+CaptureWriter* captureOpen(const char* path, unsigned width, unsigned height, unsigned buffers) {
+    CaptureWriter* capture = calloc(1, sizeof(CaptureWriter));
+    if (!capture) return NULL;
+    capture->frameSize = (size_t)width * height;
+    capture->buffers = buffers > 0 ? buffers : 1;
+    capture->pool = malloc(capture->buffers * capture->frameSize);
+    capture->poolFrames = calloc(capture->buffers, sizeof(uint32_t));
+    capture->previous = malloc(capture->frameSize);
+    capture->encoded = malloc(DELTA_BOUND(capture->frameSize));
+    if (!capture->pool || !capture->poolFrames || !capture->previous || !capture->encoded) {
+        printf("Couldn't allocate %u capture buffers\n", capture->buffers);
+        captureFree(capture);
+        return NULL;
+    }
+    // Touch every buffer now so capturing never faults pages in on the emulation thread
+    memset(capture->pool, 0, capture->buffers * capture->frameSize);
+
+    if (!(capture->file = fopen(path, "wb"))) {
+        printf("Couldn't open %s\n", path);
+        captureFree(capture);
+        return NULL;
+    }
+    CaptureFileHeader header = { .version = CAPTURE_FILE_VERSION, .width = width, .height = height, .keyframeInterval = CAPTURE_KEYFRAME_INTERVAL };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    capture->offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1 || sem_init(&capture->queued, 0, 0) != 0) {
+        printf("Couldn't start capturing to %s\n", path);
+        fclose(capture->file);
+        captureFree(capture);
+        return NULL;
+    }
+    if (pthread_create(&capture->thread, NULL, captureWriterThread, capture) != 0) {
+        printf("Couldn't start the capture writer thread\n");
+        sem_destroy(&capture->queued);
+        fclose(capture->file);
+        captureFree(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+void captureFrame(CaptureWriter* capture, uint32_t frame, const uint8_t* pixels) {
+    unsigned long long head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&capture->tail, memory_order_acquire) == capture->buffers) {
+        capture->dropped++;
+        return;
+    }
+    unsigned slot = head % capture->buffers;
+    memcpy(&capture->pool[slot * capture->frameSize], pixels, capture->frameSize);
+    capture->poolFrames[slot] = frame;
+    atomic_store_explicit(&capture->head, head + 1, memory_order_release);
+    sem_post(&capture->queued);
+}
+
+bool captureClose(CaptureWriter* capture, CaptureStats* stats) {
+    sem_post(&capture->queued);
+    pthread_join(capture->thread, NULL);
+    sem_destroy(&capture->queued);
+
+    CaptureFooter footer = { .indexOffset = capture->offset, .entries = capture->stats.captured };
+    memcpy(footer.magic, CAPTURE_FOOTER_MAGIC, sizeof(footer.magic));
+    bool ok = !capture->failed && fwrite(capture->index, sizeof(CaptureIndexEntry), footer.entries, capture->file) == footer.entries &&
+              fwrite(&footer, sizeof(footer), 1, capture->file) == 1;
+    ok = fclose(capture->file) == 0 && ok;
+    if (stats) {
+        *stats = capture->stats;
+        stats->dropped = capture->dropped;
+        stats->bytes = capture->offset + footer.entries * sizeof(CaptureIndexEntry) + sizeof(footer);
+    }
+    captureFree(capture);
+    return ok;
+}
+
+// Walk the records of a capture that was never closed, and keep every one that's all there
+static bool rebuildIndex(CaptureReader* reader, long fileLen) {
+    size_t frameSize = (size_t)reader->header.width * reader->header.height;
+    size_t capacity = 0;
+    uint64_t offset = sizeof(CaptureFileHeader);
+    CaptureRecordHeader record;
+    while (fseek(reader->file, offset, SEEK_SET) == 0 && fread(&record, sizeof(record), 1, reader->file) == 1) {
+        if (record.encodedLen > DELTA_BOUND(frameSize) || offset + sizeof(record) + record.encodedLen > (uint64_t)fileLen) break;
+        if (reader->entries == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            CaptureIndexEntry* grown = realloc(reader->index, capacity * sizeof(CaptureIndexEntry));
+            if (!grown) return false;
+            reader->index = grown;
+        }
+        reader->index[reader->entries++] = (CaptureIndexEntry){ .frame = record.frame, .flags = record.flags, .offset = offset };
+        offset += sizeof(record) + record.encodedLen;
+    }
+    return true;
+}
+
+bool captureReaderOpen(CaptureReader* reader, const char* path) {
+    *reader = (CaptureReader){ 0 };
+    if (!(reader->file = fopen(path, "rb"))) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    CaptureFooter footer;
+    long fileLen = -1;
+    if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+        memcmp(reader->header.magic, CAPTURE_MAGIC, sizeof(reader->header.magic)) != 0 || reader->header.version != CAPTURE_FILE_VERSION) {
+        printf("%s isn't a capture file\n", path);
+        captureReaderClose(reader);
+        return false;
+    }
+    if (fseek(reader->file, 0, SEEK_END) == 0) fileLen = ftell(reader->file);
+    size_t frameSize = (size_t)reader->header.width * reader->header.height;
+    reader->encoded = malloc(DELTA_BOUND(frameSize));
+    bool ok = reader->encoded != NULL && fileLen >= 0;
+    if (ok && fileLen >= (long)(sizeof(CaptureFileHeader) + sizeof(footer)) && fseek(reader->file, fileLen - sizeof(footer), SEEK_SET) == 0 &&
+        fread(&footer, sizeof(footer), 1, reader->file) == 1 && memcmp(footer.magic, CAPTURE_FOOTER_MAGIC, sizeof(footer.magic)) == 0 &&
+        footer.indexOffset + (uint64_t)footer.entries * sizeof(CaptureIndexEntry) + sizeof(footer) == (uint64_t)fileLen) {
+        reader->index = malloc(footer.entries * sizeof(CaptureIndexEntry) + 1);
+        reader->entries = footer.entries;
+        reader->indexed = true;
+        ok = reader->index && fseek(reader->file, footer.indexOffset, SEEK_SET) == 0 &&
+             fread(reader->index, sizeof(CaptureIndexEntry), footer.entries, reader->file) == footer.entries;
+    } else if (ok) ok = rebuildIndex(reader, fileLen);
+    if (!ok) {
+        printf("Couldn't read the index of %s\n", path);
+        captureReaderClose(reader);
+    }
+    return ok;
+}
+
+bool captureReadFrame(CaptureReader* reader, uint32_t entry, uint8_t* pixels) {
+    if (entry >= reader->entries) return false;
+    size_t frameSize = (size_t)reader->header.width * reader->header.height;
+    uint32_t first = entry;
+    while (first > 0 && !(reader->index[first].flags & CAPTURE_KEYFRAME)) first--;
+    memset(pixels, 0, frameSize);
+    for (uint32_t i = first; i <= entry; i++) {
+        CaptureRecordHeader record;
+        if (fseek(reader->file, reader->index[i].offset, SEEK_SET) != 0 || fread(&record, sizeof(record), 1, reader->file) != 1 ||
+            record.encodedLen > DELTA_BOUND(frameSize) || fread(reader->encoded, 1, record.encodedLen, reader->file) != record.encodedLen ||
+            !deltaApply(reader->encoded, record.encodedLen, pixels, frameSize)) {
+            printf("Record of frame %u is truncated or corrupt\n", reader->index[i].frame);
+            return false;
+        }
+    }
+    return true;
+}
+
+void captureReaderClose(CaptureReader* reader) {
+    if (reader->file) fclose(reader->file);
+    free(reader->index);
+    free(reader->encoded);
+    *reader = (CaptureReader){ 0 };
+}
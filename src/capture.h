@@ -0,0 +1,85 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "C2FC"
+#define CAPTURE_FOOTER_MAGIC "C2FI"
+#define CAPTURE_FILE_VERSION 1
+// Frames the pool holds when no count is given, just under 1MB of display sized frames
+#define CAPTURE_DEFAULT_BUFFERS 32
+// Every this many records is encoded against zeros instead of the previous frame, so extracting a frame only has to apply
+// the deltas since the keyframe before it
+#define CAPTURE_KEYFRAME_INTERVAL 64
+
+// Capture files are this header, a record for each captured frame, then an index of the records and the footer. The frame
+// size is in the header so readers don't depend on the display size they were built with.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t keyframeInterval;
+} CaptureFileHeader;
+
+// Record flags
+#define CAPTURE_KEYFRAME 0x01
+
+// Each record is this header followed by the frame encoded by deltaEncode, against zeros for a keyframe and against the
+// previous record's frame otherwise
+typedef struct {
+    uint32_t frame;
+    uint32_t flags;
+    uint32_t encodedLen;
+} CaptureRecordHeader;
+
+typedef struct {
+    uint32_t frame;
+    uint32_t flags;
+    // Where the record's header starts
+    uint64_t offset;
+} CaptureIndexEntry;
+
+// The last bytes of a finished capture. A file without one, e.g. after a crash, can still be read by walking the records.
+typedef struct {
+    uint64_t indexOffset;
+    uint32_t entries;
+    char magic[4];
+} CaptureFooter;
+
+typedef struct {
+    unsigned long long captured;
+    // Frames that arrived while every buffer was still waiting to be written
+    unsigned long long dropped;
+    unsigned long long keyframes;
+    unsigned long long bytes;
+} CaptureStats;
+
+typedef struct CaptureWriter CaptureWriter;
+
+// Create a capture file and start its writer thread with a pool of buffers for frames of width x height bytes
+CaptureWriter* captureOpen(const char* path, unsigned width, unsigned height, unsigned buffers);
+// Copy a frame into the pool for the writer thread to encode and write. This never waits on the writer: if every buffer is
+// still queued the frame is dropped and counted instead.
+void captureFrame(CaptureWriter* capture, uint32_t frame, const uint8_t* pixels);
+// Write everything still queued, then the index, and close. Returns false if anything couldn't be written.
+bool captureClose(CaptureWriter* capture, CaptureStats* stats);
+
+typedef struct {
+    FILE* file;
+    CaptureFileHeader header;
+    CaptureIndexEntry* index;
+    uint32_t entries;
+    // False when the file had no index and it was rebuilt from the records
+    bool indexed;
+    uint8_t* encoded;
+} CaptureReader;
+
+bool captureReaderOpen(CaptureReader* reader, const char* path);
+// Decode the frame of an index entry into pixels, which must hold width x height bytes
+bool captureReadFrame(CaptureReader* reader, uint32_t entry, uint8_t* pixels);
+void captureReaderClose(CaptureReader* reader);
+
+#endif
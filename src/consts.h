@@ -5,6 +5,14 @@
 #define SPRITE_ENTRIES_NUM 64
 #define DISPLAY_PIXELS_X (25 * 8)
 #define DISPLAY_PIXELS_Y (19 * 8)
+#define TILES_NUM_X 25
+#define TILES_NUM_Y 19
+// The tile map is bigger than the display and wraps around at its edges. Each row of it is TILE_MAP_NUM_X def addresses.
+#define TILE_MAP_NUM_X 32
+#define TILE_MAP_NUM_Y 32
+#define TILE_ENTRY_SIZE 2
+#define TILE_MAP_ROW_SIZE (TILE_MAP_NUM_X * TILE_ENTRY_SIZE)
+#define TILE_MAP_SIZE (TILE_MAP_ROW_SIZE * TILE_MAP_NUM_Y)
 
 #define SPRITE_DEF_NUM 255
 #define SPRITE_DEF_PIXELS_X 8
@@ -20,10 +28,28 @@
 
 #define SPRITE_TABLE_ADDR (8 * 1024)
 #define TILE_TABLE_ADDR (SPRITE_TABLE_ADDR + (SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE))
-#define PPU_REGS_ADDR (TILE_TABLE_ADDR + (SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE))
+#define PPU_REGS_ADDR (TILE_TABLE_ADDR + TILE_MAP_SIZE)
+// The pixel of the tile map shown at the top left of the display. The map is 256 pixels square, so scrolling past an edge
+// wraps around with the registers. They're in the table RAM, so the CPU writes them in its window onto the tables and with
+// double buffering they flip with the tiles.
+#define REG_SCROLL_X (PPU_REGS_ADDR + 0)
+#define REG_SCROLL_Y (PPU_REGS_ADDR + 1)
+// The PPU only evaluates this many entries from the start of the sprite table, so games that keep their sprites at the start
+// don't pay for the rest. 0, which the table RAM starts as, evaluates all SPRITE_ENTRIES_NUM, as do counts bigger than that.
+#define REG_SPRITE_COUNT (PPU_REGS_ADDR + 2)
 #define SPRITE_DEFS_ADDR (16 * 1024)
 #define PIXEL_MAP_ADDR ((unsigned long)32 * 1024)
 #define CPU_SPRITE_TABLE_ADDR (48 * 1024)
+// The CPU's registers take the last page of its window onto the tables
+#define CPU_REGS_ADDR (CPU_SPRITE_TABLE_ADDR + 8 * 1024 - 256)
+
+// With double buffered tables (a "tables,double" line in the mem map) the CPU writes a back bank while the PPU renders the
+// front one. Writing TABLE_FLIP here swaps them at the start of the PPU's next render pass, and with TABLE_FLIP_COPY as well
+// the new back bank starts as a copy of the new front one for games that only update what changed. Reads 1 while a flip is
+// pending. Writes are ignored when the tables aren't double buffered.
+#define REG_TABLE_FLIP (CPU_REGS_ADDR + 0)
+#define TABLE_FLIP 1
+#define TABLE_FLIP_COPY 2
 
 #define ANIM_SPRITE_OFFSET(ANIM_METADATA) (ANIM_METADATA & 0xb111)
 #define ANIM_PALETTE_OFFSET(ANIM_METADATA) ((ANIM_METADATA & 0xb11000000) >> 6)
@@ -31,3 +57,36 @@
 #define ANIM_Y_OFFSET(ANIM_POS_OFFSETS) ((ANIM_POS_OFFSETS & 0xb11110000) >> 4)
 
 #define PPU_CPU_INT_PORT 0
+
+// The CPU reads the controller from this port. It's latched at the start of every VBLANK, so it stays the same for a frame.
+#define CPU_CONTROLLER_PORT 0
+// Controller button bits, set while the button is held
+#define CONTROLLER_UP 0x01
+#define CONTROLLER_DOWN 0x02
+#define CONTROLLER_LEFT 0x04
+#define CONTROLLER_RIGHT 0x08
+#define CONTROLLER_A 0x10
+#define CONTROLLER_B 0x20
+#define CONTROLLER_START 0x40
+#define CONTROLLER_SELECT 0x80
+
+// The PPU's DMA engine copies a block of height rows of width bytes. Source rows follow on from each other and destination
+// rows are stride bytes apart. Writing the start port copies the block and stalls the PPU for PPU_DMA_SETUP_TSTATES plus one
+// T-state per byte. Afterwards the source points just past the block and the destination at the top right of it, so a row of
+// blocks only needs a new source for each block. The source and destination registers can be read back.
+#define PPU_DMA_SRC_LO_PORT 1
+#define PPU_DMA_SRC_HI_PORT 2
+#define PPU_DMA_DST_LO_PORT 3
+#define PPU_DMA_DST_HI_PORT 4
+#define PPU_DMA_WIDTH_PORT 5
+#define PPU_DMA_HEIGHT_PORT 6
+#define PPU_DMA_STRIDE_LO_PORT 7
+#define PPU_DMA_STRIDE_HI_PORT 8
+// The value written is a set of PPU_DMA_ flags
+#define PPU_DMA_START_PORT 9
+// When set, source rows are this many bytes apart instead of following on from each other, so a copy can take the left or
+// right part of a block. The source then ends up this many bytes per row past where it started.
+#define PPU_DMA_SRC_STRIDE_PORT 10
+// Leave the destination alone where the source is colour 0
+#define PPU_DMA_TRANSPARENT 1
+#define PPU_DMA_SETUP_TSTATES 16
@@ -0,0 +1,130 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "counters.h"
+
+#define UNIX_SOCKET_PREFIX "unix:"
+
+const char* busRegionNames[BUS_REGION_COUNT] = {
+    "ppu_code_rom", "ppu_tables", "ppu_def_rom", "pixel_map", "ppu_ram", "cpu_rom", "cpu_ram", "cpu_tables", "cpu_regs", "cpu_unmapped"
+};
+
+struct CountersExport {
+    FILE* file;
+    CountersFormat format;
+    unsigned interval;
+    FrameCounters total;
+    unsigned lastFrame;
+};
+
+static FILE* connectUnixSocket(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        printf("Couldn't connect to %s\n", path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    // A reader going away should end the export, not the emulator
+    signal(SIGPIPE, SIG_IGN);
+    FILE* file = fdopen(fd, "w");
+    if (!file) close(fd);
+    return file;
+}
+
+CountersExport* countersOpen(const char* target, CountersFormat format, unsigned interval) {
+    CountersExport* export = calloc(1, sizeof(CountersExport));
+    if (!export) return NULL;
+    export->format = format;
+    export->interval = interval > 0 ? interval : 1;
+    if (strncmp(target, UNIX_SOCKET_PREFIX, strlen(UNIX_SOCKET_PREFIX)) == 0) {
+        export->file = connectUnixSocket(target + strlen(UNIX_SOCKET_PREFIX));
+        // Lines go out as they're written so a live reader sees every interval
+        if (export->file) setvbuf(export->file, NULL, _IOLBF, 0);
+    } else if (!(export->file = fopen(target, "w"))) printf("Couldn't open %s\n", target);
+    if (!export->file) {
+        free(export);
+        return NULL;
+    }
+    if (format == COUNTERS_CSV) {
+        fprintf(export->file, "frame,frames,host_ns,ppu_instructions,cpu_instructions,ppu_tstates,cpu_tstates,ppu_ints,ppu_nmis,cpu_ints,"
+                              "ppu_io_writes,dma_bytes,sprites_evaluated,sprites_drawn");
+        for (unsigned i = 0; i < BUS_REGION_COUNT; i++) fprintf(export->file, ",reads_%s", busRegionNames[i]);
+        for (unsigned i = 0; i < BUS_REGION_COUNT; i++) fprintf(export->file, ",writes_%s", busRegionNames[i]);
+        fprintf(export->file, "\n");
+    }
+    return export;
+}
+
+static void writeCSV(FILE* file, unsigned frame, FrameCounters* c) {
+    fprintf(file, "%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu", frame, c->frames, c->hostNs, c->ppuInstructions,
+            c->cpuInstructions, c->ppuTStates, c->cpuTStates, c->ppuInts, c->ppuNMIs, c->cpuInts, c->ppuIOWrites, c->dmaBytes,
+            c->spritesEvaluated, c->spritesDrawn);
+    for (unsigned i = 0; i < BUS_REGION_COUNT; i++) fprintf(file, ",%llu", c->reads[i]);
+    for (unsigned i = 0; i < BUS_REGION_COUNT; i++) fprintf(file, ",%llu", c->writes[i]);
+    fprintf(file, "\n");
+}
+
+static void writeJSONRegions(FILE* file, const char* name, unsigned long long* counts) {
+    fprintf(file, ",\"%s\":{", name);
+    for (unsigned i = 0; i < BUS_REGION_COUNT; i++) fprintf(file, "%s\"%s\":%llu", i ? "," : "", busRegionNames[i], counts[i]);
+    fprintf(file, "}");
+}
+
+static void writeJSONL(FILE* file, unsigned frame, FrameCounters* c) {
+    fprintf(file,
+            "{\"frame\":%u,\"frames\":%u,\"host_ns\":%llu,\"ppu_instructions\":%llu,\"cpu_instructions\":%llu,\"ppu_tstates\":%llu,"
+            "\"cpu_tstates\":%llu,\"ppu_ints\":%llu,\"ppu_nmis\":%llu,\"cpu_ints\":%llu,\"ppu_io_writes\":%llu,\"dma_bytes\":%llu,"
+            "\"sprites_evaluated\":%llu,\"sprites_drawn\":%llu",
+            frame, c->frames, c->hostNs, c->ppuInstructions, c->cpuInstructions, c->ppuTStates, c->cpuTStates, c->ppuInts, c->ppuNMIs,
+            c->cpuInts, c->ppuIOWrites, c->dmaBytes, c->spritesEvaluated, c->spritesDrawn);
+    writeJSONRegions(file, "reads", c->reads);
+    writeJSONRegions(file, "writes", c->writes);
+    fprintf(file, "}\n");
+}
+
+static void flushInterval(CountersExport* export) {
+    if (export->total.frames == 0) return;
+    if (export->format == COUNTERS_CSV) writeCSV(export->file, export->lastFrame, &export->total);
+    else writeJSONL(export->file, export->lastFrame, &export->total);
+    export->total = (FrameCounters){ 0 };
+}
+
+void countersAddFrame(CountersExport* export, unsigned frame, const FrameCounters* counters) {
+    FrameCounters* total = &export->total;
+    total->frames += counters->frames;
+    total->ppuInstructions += counters->ppuInstructions;
+    total->cpuInstructions += counters->cpuInstructions;
+    total->ppuTStates += counters->ppuTStates;
+    total->cpuTStates += counters->cpuTStates;
+    for (unsigned i = 0; i < BUS_REGION_COUNT; i++) {
+        total->reads[i] += counters->reads[i];
+        total->writes[i] += counters->writes[i];
+    }
+    total->ppuIOWrites += counters->ppuIOWrites;
+    total->dmaBytes += counters->dmaBytes;
+    total->ppuInts += counters->ppuInts;
+    total->ppuNMIs += counters->ppuNMIs;
+    total->cpuInts += counters->cpuInts;
+    total->spritesEvaluated += counters->spritesEvaluated;
+    total->spritesDrawn += counters->spritesDrawn;
+    total->hostNs += counters->hostNs;
+    export->lastFrame = frame;
+    if (total->frames >= export->interval) flushInterval(export);
+}
+
+bool countersClose(CountersExport* export) {
+    flushInterval(export);
+    bool ok = !ferror(export->file);
+    ok = fclose(export->file) == 0 && ok;
+    free(export);
+    return ok;
+}
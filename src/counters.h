@@ -0,0 +1,55 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Where a bus access landed. Each core's address space is split by page, so the table RAM shows up once per core.
+typedef enum {
+    BUS_PPU_CODE_ROM,
+    BUS_PPU_TABLES,
+    BUS_PPU_DEF_ROM,
+    BUS_PIXEL_MAP,
+    BUS_PPU_RAM,
+    BUS_CPU_ROM,
+    BUS_CPU_RAM,
+    BUS_CPU_TABLES,
+    BUS_CPU_REGS,
+    BUS_CPU_UNMAPPED,
+    BUS_REGION_COUNT
+} BusRegion;
+
+extern const char* busRegionNames[BUS_REGION_COUNT];
+
+// What the machine did over one or more frames
+typedef struct {
+    unsigned frames;
+    unsigned long long ppuInstructions;
+    unsigned long long cpuInstructions;
+    unsigned long long ppuTStates;
+    unsigned long long cpuTStates;
+    unsigned long long reads[BUS_REGION_COUNT];
+    unsigned long long writes[BUS_REGION_COUNT];
+    unsigned long long ppuIOWrites;
+    unsigned long long dmaBytes;
+    unsigned long long ppuInts;
+    unsigned long long ppuNMIs;
+    unsigned long long cpuInts;
+    // Sprite table entries the PPU evaluated and sprites it drew
+    unsigned long long spritesEvaluated;
+    unsigned long long spritesDrawn;
+    // Host time spent emulating
+    unsigned long long hostNs;
+} FrameCounters;
+
+typedef enum { COUNTERS_CSV, COUNTERS_JSONL } CountersFormat;
+
+typedef struct CountersExport CountersExport;
+
+// Open a file, or with a "unix:" prefix connect to a listening Unix socket, and write a line for every interval frames
+CountersExport* countersOpen(const char* target, CountersFormat format, unsigned interval);
+void countersAddFrame(CountersExport* export, unsigned frame, const FrameCounters* counters);
+// Write whatever is left of the last interval and close
+bool countersClose(CountersExport* export);
+
+#endif
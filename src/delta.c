@@ -0,0 +1,69 @@
+#include "delta.h"
+
+// Unchanged runs shorter than this are cheaper to store as literals
+#define DELTA_MIN_RUN 4
+
+static size_t writeVarint(uint8_t* out, size_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+static bool readVarint(const uint8_t* in, size_t inLen, size_t* pos, size_t* value) {
+    *value = 0;
+    for (unsigned shift = 0; *pos < inLen && shift < 64; shift += 7) {
+        uint8_t b = in[(*pos)++];
+        *value |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint8_t deltaAt(const uint8_t* prev, const uint8_t* cur, size_t i) {
+    return prev ? prev[i] ^ cur[i] : cur[i];
+}
+
+size_t deltaEncode(const uint8_t* prev, const uint8_t* cur, size_t len, uint8_t* out) {
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t runStart = i;
+        while (i < len && deltaAt(prev, cur, i) == 0) i++;
+        size_t run = i - runStart;
+
+        // Extend the literal until there's an unchanged run worth breaking for
+        size_t litStart = i;
+        size_t zeros = 0;
+        while (i < len) {
+            if (deltaAt(prev, cur, i) == 0) {
+                if (++zeros == DELTA_MIN_RUN) break;
+            } else zeros = 0;
+            i++;
+        }
+        if (zeros == DELTA_MIN_RUN) i -= DELTA_MIN_RUN - 1;
+        else i -= zeros;
+        size_t litLen = i - litStart;
+
+        n += writeVarint(out + n, run);
+        n += writeVarint(out + n, litLen);
+        for (size_t j = litStart; j < i; j++) out[n++] = deltaAt(prev, cur, j);
+    }
+    return n;
+}
+
+bool deltaApply(const uint8_t* in, size_t inLen, uint8_t* buf, size_t len) {
+    size_t pos = 0;
+    size_t i = 0;
+    while (pos < inLen) {
+        size_t run, litLen;
+        if (!readVarint(in, inLen, &pos, &run) || !readVarint(in, inLen, &pos, &litLen)) return false;
+        if (run > len - i || litLen > len - i - run || litLen > inLen - pos) return false;
+        i += run;
+        for (size_t j = 0; j < litLen; j++) buf[i++] ^= in[pos++];
+    }
+    return true;
+}
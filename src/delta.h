@@ -0,0 +1,18 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest encoding deltaEncode can produce for len bytes
+#define DELTA_BOUND(len) ((len) + (len) / 2 + 32)
+
+// Encode the XOR of two buffers as runs of unchanged bytes and literal changed bytes. prev may be NULL to encode cur against
+// zeros. Returns the encoded length.
+size_t deltaEncode(const uint8_t* prev, const uint8_t* cur, size_t len, uint8_t* out);
+// XOR an encoded delta into buf. As XOR is its own inverse this turns prev into cur and cur back into prev. Returns false if the
+// encoding is corrupt or doesn't match len.
+bool deltaApply(const uint8_t* in, size_t inLen, uint8_t* buf, size_t len);
+
+#endif
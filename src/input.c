@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+
+#define RUN_SIZE 3
+
+static bool writeRun(InputRecorder* recorder) {
+    uint8_t run[RUN_SIZE] = { recorder->state, recorder->runLength & 0xFF, recorder->runLength >> 8 };
+    recorder->header.runs++;
+    return fwrite(run, RUN_SIZE, 1, recorder->file) == 1;
+}
+
+bool inputRecordOpen(InputRecorder* recorder, const char* path, uint32_t startFrame) {
+    *recorder = (InputRecorder){ .header = { .version = INPUT_FILE_VERSION, .startFrame = startFrame } };
+    memcpy(recorder->header.magic, INPUT_MAGIC, sizeof(recorder->header.magic));
+    if (!(recorder->file = fopen(path, "wb"))) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    // The header is written again with the totals on close
+    return fwrite(&recorder->header, sizeof(recorder->header), 1, recorder->file) == 1;
+}
+
+void inputRecord(InputRecorder* recorder, uint8_t state) {
+    if (recorder->runLength > 0 && (state != recorder->state || recorder->runLength == UINT16_MAX)) {
+        writeRun(recorder);
+        recorder->runLength = 0;
+    }
+    recorder->state = state;
+    recorder->runLength++;
+    recorder->header.frames++;
+}
+
+bool inputRecordClose(InputRecorder* recorder) {
+    bool ok = recorder->runLength == 0 || writeRun(recorder);
+    ok = fseek(recorder->file, 0, SEEK_SET) == 0 && fwrite(&recorder->header, sizeof(recorder->header), 1, recorder->file) == 1 && ok;
+    return fclose(recorder->file) == 0 && ok;
+}
+
+bool inputReplayOpen(InputReplay* replay, const char* path) {
+    *replay = (InputReplay){ 0 };
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    bool ok = fread(&replay->header, sizeof(replay->header), 1, file) == 1 &&
+              memcmp(replay->header.magic, INPUT_MAGIC, sizeof(replay->header.magic)) == 0 && replay->header.version == INPUT_FILE_VERSION;
+    if (!ok) printf("%s isn't a version %d input recording\n", path, INPUT_FILE_VERSION);
+    else {
+        replay->runCount = replay->header.runs;
+        replay->runs = malloc(replay->runCount * RUN_SIZE + 1);
+        ok = replay->runs && fread(replay->runs, RUN_SIZE, replay->runCount, file) == replay->runCount;
+        if (!ok) printf("%s is truncated\n", path);
+    }
+    fclose(file);
+    if (!ok) inputReplayClose(replay);
+    return ok;
+}
+
+uint8_t inputReplayNext(InputReplay* replay) {
+    while (replay->run < replay->runCount) {
+        uint8_t* run = &replay->runs[replay->run * RUN_SIZE];
+        if (replay->usedOfRun < (run[1] | (run[2] << 8))) {
+            replay->usedOfRun++;
+            return run[0];
+        }
+        replay->run++;
+        replay->usedOfRun = 0;
+    }
+    replay->finished = true;
+    return 0;
+}
+
+void inputReplayClose(InputReplay* replay) {
+    free(replay->runs);
+    replay->runs = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define INPUT_MAGIC "C2IN"
+#define INPUT_FILE_VERSION 1
+
+// Input files are this header followed by runs of identical frames, each the controller state then the run length as a
+// little endian 16 bit count
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // The frame the first run starts on, so a replay can tell it isn't starting where the recording did
+    uint32_t startFrame;
+    uint32_t frames;
+    uint32_t runs;
+} InputFileHeader;
+
+typedef struct {
+    FILE* file;
+    InputFileHeader header;
+    uint8_t state;
+    uint16_t runLength;
+} InputRecorder;
+
+typedef struct {
+    uint8_t* runs;
+    uint32_t runCount;
+    uint32_t run;
+    uint16_t usedOfRun;
+    InputFileHeader header;
+    bool finished;
+} InputReplay;
+
+bool inputRecordOpen(InputRecorder* recorder, const char* path, uint32_t startFrame);
+// Add one frame's controller state
+void inputRecord(InputRecorder* recorder, uint8_t state);
+// Write the last run and the final header
+bool inputRecordClose(InputRecorder* recorder);
+
+bool inputReplayOpen(InputReplay* replay, const char* path);
+// The next frame's controller state, or no buttons once the recording has run out
+uint8_t inputReplayNext(InputReplay* replay);
+void inputReplayClose(InputReplay* replay);
+
+#endif
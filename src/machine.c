@@ -0,0 +1,1363 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "machine.h"
+
+static void hleCheckPass(Machine* m);
+
+// Distinct PCs printStackTrace shows
+#define STACK_TRACE_PCS 32
+
+static void mapPages(byte** pages, unsigned start, unsigned end, byte* mem) {
+    for (unsigned addr = start; addr < end; addr += PAGE_SIZE) pages[addr >> PAGE_SHIFT] = mem ? mem + (addr - start) : NULL;
+}
+
+// Map the front table bank for the PPU and the back one for the CPU. Flipping is just remapping these pages.
+static void mapTables(Machine* m) {
+    byte* front = m->tableRAM[m->frontTables];
+    byte* back = m->doubleBufferedTables ? m->tableRAM[!m->frontTables] : front;
+    mapPages(m->ppuReadPages, PPU_TABLES_START, PPU_TABLES_END, front);
+    mapPages(m->ppuWritePages, PPU_TABLES_START, PPU_TABLES_END, front);
+    mapPages(m->cpuReadPages, CPU_SPRITE_TABLE_ADDR, CPU_REGS_ADDR, back);
+    mapPages(m->cpuWritePages, CPU_SPRITE_TABLE_ADDR, CPU_REGS_ADDR, back);
+    m->cpuReadPages[CPU_REGS_ADDR >> PAGE_SHIFT] = m->cpuRegsPage;
+    m->cpuWritePages[CPU_REGS_ADDR >> PAGE_SHIFT] = NULL;
+}
+
+static void buildPPUPageTables(Machine* m) {
+    mapPages(m->ppuReadPages, 0, PPU_CODE_END, m->ppuCodeROM);
+    mapPages(m->ppuWritePages, 0, PPU_CODE_END, NULL);
+    mapPages(m->ppuReadPages, PPU_DEFS_START, PPU_DEFS_END, m->ppuDefROM);
+    mapPages(m->ppuWritePages, PPU_DEFS_START, PPU_DEFS_END, NULL);
+    mapPages(m->ppuReadPages, PPU_RAM_START, ADDRESS_SPACE_SIZE, m->ppuRAM);
+    mapPages(m->ppuWritePages, PPU_RAM_START, ADDRESS_SPACE_SIZE, m->ppuRAM);
+}
+
+// Classify each page for the counters, from the same layout the page tables map
+static void buildPageRegions(Machine* m) {
+    for (unsigned page = 0; page < PAGE_COUNT; page++) {
+        unsigned addr = page << PAGE_SHIFT;
+        if (addr < PPU_CODE_END) m->ppuPageRegions[page] = BUS_PPU_CODE_ROM;
+        else if (addr < PPU_TABLES_END) m->ppuPageRegions[page] = BUS_PPU_TABLES;
+        else if (addr < PPU_DEFS_END) m->ppuPageRegions[page] = BUS_PPU_DEF_ROM;
+        else if (addr >= PIXEL_MAP_ADDR && addr < PIXEL_MAP_END) m->ppuPageRegions[page] = BUS_PIXEL_MAP;
+        else m->ppuPageRegions[page] = BUS_PPU_RAM;
+        m->cpuPageRegions[page] = BUS_CPU_UNMAPPED;
+    }
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        for (unsigned addr = region->start; addr < region->end; addr += PAGE_SIZE) {
+            m->cpuPageRegions[addr >> PAGE_SHIFT] = region->type == REGION_ROM ? BUS_CPU_ROM : BUS_CPU_RAM;
+        }
+    }
+    for (unsigned addr = CPU_SPRITE_TABLE_ADDR; addr < CPU_REGS_ADDR; addr += PAGE_SIZE) m->cpuPageRegions[addr >> PAGE_SHIFT] = BUS_CPU_TABLES;
+    m->cpuPageRegions[CPU_REGS_ADDR >> PAGE_SHIFT] = BUS_CPU_REGS;
+}
+
+static void buildCPUPageTables(Machine* m) {
+    for (unsigned page = 0; page < PAGE_COUNT; page++) {
+        m->cpuReadPages[page] = m->openBusPage;
+        m->cpuWritePages[page] = m->writeTrapPage;
+    }
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        mapPages(m->cpuReadPages, region->start, region->end, region->data);
+        if (region->type == REGION_RAM) mapPages(m->cpuWritePages, region->start, region->end, region->data);
+    }
+}
+
+static void flipTables(Machine* m) {
+    m->frontTables = !m->frontTables;
+    if (m->pendingFlip & TABLE_FLIP_COPY) memcpy(m->tableRAM[!m->frontTables], m->tableRAM[m->frontTables], TABLE_RAM_SIZE);
+    m->pendingFlip = 0;
+    m->cpuRegsPage[REG_TABLE_FLIP & PAGE_MASK] = 0;
+    m->tableFlips++;
+    mapTables(m);
+}
+
+static void cpuRegWrite(Machine* m, ushort address, byte data) {
+    if (address == REG_TABLE_FLIP && m->doubleBufferedTables && (data & TABLE_FLIP)) {
+        m->pendingFlip = data;
+        m->cpuRegsPage[REG_TABLE_FLIP & PAGE_MASK] = 1;
+    }
+}
+
+byte cpuMemRead(size_t param, ushort address) {
+    Machine* m = (Machine*)param;
+    return m->cpuReadPages[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+static void cpuMemWrite(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    m->busWrites++;
+    byte* page = m->cpuWritePages[address >> PAGE_SHIFT];
+    if (!page && m->cpuBlocks && blockCacheWriteFault(m->cpuBlocks, address)) page = m->cpuWritePages[address >> PAGE_SHIFT];
+    if (page) page[address & PAGE_MASK] = data;
+    else cpuRegWrite(m, address, data);
+}
+
+static byte cpuIORead(size_t param, ushort port) {
+    Machine* m = (Machine*)param;
+    return (port & 0xFF) == CPU_CONTROLLER_PORT ? m->controller : 0;
+}
+
+static byte ppuIORead(size_t param, ushort port) {
+    Machine* m = (Machine*)param;
+    switch (port & 0xFF) {
+        case PPU_DMA_SRC_LO_PORT: return m->dma.src & 0xFF;
+        case PPU_DMA_SRC_HI_PORT: return m->dma.src >> 8;
+        case PPU_DMA_DST_LO_PORT: return m->dma.dst & 0xFF;
+        case PPU_DMA_DST_HI_PORT: return m->dma.dst >> 8;
+        default: return 0;
+    }
+}
+
+static void dmaCopy(Machine* m, byte flags);
+
+static void ppuIOWrite(size_t param, ushort port, byte data) {
+    Machine* m = (Machine*)param;
+    m->busWrites++;
+    port = port & 0xFF;
+    switch (port) {
+        case PPU_DMA_SRC_LO_PORT: m->dma.src = (m->dma.src & 0xFF00) | data; break;
+        case PPU_DMA_SRC_HI_PORT: m->dma.src = (m->dma.src & 0xFF) | (data << 8); break;
+        case PPU_DMA_DST_LO_PORT: m->dma.dst = (m->dma.dst & 0xFF00) | data; break;
+        case PPU_DMA_DST_HI_PORT: m->dma.dst = (m->dma.dst & 0xFF) | (data << 8); break;
+        case PPU_DMA_WIDTH_PORT: m->dma.width = data; break;
+        case PPU_DMA_HEIGHT_PORT: m->dma.height = data; break;
+        case PPU_DMA_STRIDE_LO_PORT: m->dma.stride = (m->dma.stride & 0xFF00) | data; break;
+        case PPU_DMA_STRIDE_HI_PORT: m->dma.stride = (m->dma.stride & 0xFF) | (data << 8); break;
+        case PPU_DMA_START_PORT:
+            // A copy started after reading the sprite table draws a sprite
+            if (m->spriteEntryRead) {
+                m->counters.spritesDrawn++;
+                m->spritesDrawn++;
+                m->spriteEntryRead = false;
+            }
+            dmaCopy(m, data);
+            break;
+        case PPU_DMA_SRC_STRIDE_PORT: m->dma.srcStride = data; break;
+    }
+    if (port == PPU_CPU_INT_PORT && data == 1) {
+        m->waitUntilCPUInterrupted = false;
+        m->ppuPassDone = true;
+        // The PPU's tstates count from the start of its current burst
+        m->sched.cpuIntPending = true;
+        m->sched.cpuIntAt = m->sched.ppuCycles + m->PPU.tstates;
+        // Raising the CPU interrupt marks the end of a render pass
+        if (m->ppuProfile) profilerEndPass(m->ppuProfile, BLANKING_TSTATES_PER_FRAME);
+        if (m->hle.check) hleCheckPass(m);
+        m->lastSpriteEntry = 0;
+        m->spriteEntryRead = false;
+    }
+}
+
+byte ppuMemRead(size_t param, ushort address) {
+    Machine* m = (Machine*)param;
+    return m->ppuReadPages[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+static void ppuWriteTrap(Machine* m, ushort address, byte data) {
+    if (address < PPU_CODE_END) printf("error: Writing to ppu ROM address %x after PC %x\n", address, m->PPU.PC);
+    else printf("error: Writing to ppu def ROM address %x after PC %x\n", address - PPU_DEFS_START, m->PPU.PC);
+}
+
+static void markPixelDirty(Machine* m, unsigned offset) {
+    unsigned row = offset / DISPLAY_PIXELS_X;
+    uint32_t span = 1u << ((offset % DISPLAY_PIXELS_X) / 8);
+    m->dirtySpans[row] |= span;
+    m->frameDirtyCells[row / 8] |= span;
+}
+
+void ppuMemWrite(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    m->busWrites++;
+    byte* page = m->ppuWritePages[address >> PAGE_SHIFT];
+    if (page) {
+        page[address & PAGE_MASK] = data;
+        if (address >= PIXEL_MAP_ADDR && address < PIXEL_MAP_END) markPixelDirty(m, address - PIXEL_MAP_ADDR);
+    } else ppuWriteTrap(m, address, data);
+}
+
+// Copy the DMA engine's block and stall the PPU for it. Rows that land inside the pixel map with a source inside one page are
+// copied directly, and anything else goes over the bus a byte at a time so ROM writes are still trapped.
+static void dmaCopy(Machine* m, byte flags) {
+    DMAState* dma = &m->dma;
+    bool transparent = flags & PPU_DMA_TRANSPARENT;
+    unsigned srcStride = dma->srcStride ? dma->srcStride : dma->width;
+    ushort src = dma->src;
+    for (unsigned row = 0; row < dma->height; row++, src += srcStride) {
+        ushort dst = dma->dst + row * dma->stride;
+        if (!transparent && (src & PAGE_MASK) + dma->width <= PAGE_SIZE && dst >= PIXEL_MAP_ADDR && dst + dma->width <= PIXEL_MAP_END) {
+            unsigned offset = dst - PIXEL_MAP_ADDR;
+            memmove(&m->ppuRAM[dst - PPU_RAM_START], &m->ppuReadPages[src >> PAGE_SHIFT][src & PAGE_MASK], dma->width);
+            for (unsigned x = 0; x < dma->width; x += 8) markPixelDirty(m, offset + x);
+            if (dma->width > 0) markPixelDirty(m, offset + dma->width - 1);
+            continue;
+        }
+        for (unsigned x = 0; x < dma->width; x++) {
+            byte b = ppuMemRead((size_t)m, src + x);
+            if (!transparent || b != 0) ppuMemWrite((size_t)m, dst + x, b);
+        }
+    }
+    unsigned bytes = dma->width * dma->height;
+    m->counters.dmaBytes += bytes;
+    dma->src += srcStride * dma->height;
+    dma->dst += dma->width;
+    // The start port is written by the PPU's current instruction, so the stall is added to it
+    m->PPU.tstates += PPU_DMA_SETUP_TSTATES + bytes;
+}
+
+// Count the cells written to since the last call and start counting again
+static unsigned collectDirtyCells(Machine* m) {
+    unsigned cells = 0;
+    for (unsigned row = 0; row < CELL_ROWS; row++) {
+        cells += __builtin_popcount(m->frameDirtyCells[row]);
+        m->frameDirtyCells[row] = 0;
+    }
+    return cells;
+}
+
+char* toString(VideoSection section) {
+    switch (section) {
+        case NONE:
+            return "NONE";
+        case HBLANK:
+            return "HBLANK";
+        case VBLANK:
+            return "VBLANK";
+        case DISPLAY:
+            return "DISPLAY";
+    }
+}
+
+unsigned coordToVRAMAddr(unsigned x, unsigned y, unsigned scale) {
+    x /= scale;
+    y /= scale;
+    return y * DISPLAY_PIXELS_X + x;
+}
+
+// Latch one row of the pixel map for the presenter. This is called as the beam reaches the first output line of that row so
+// that writes made to the pixel map mid-frame still show up on the lines below the beam.
+static void latchScanline(Machine* m, unsigned row) {
+    uint32_t spans = m->dirtySpans[row];
+    if (!spans) return;
+    m->dirtySpans[row] = 0;
+    // A row is only DISPLAY_PIXELS_X (200) bytes so it's cheaper to copy all of it than to pick out the dirty spans
+    memcpy(&m->latchedPixels[row * DISPLAY_PIXELS_X], &m->ppuRAM[PIXEL_MAP_ADDR - PPU_RAM_START + row * DISPLAY_PIXELS_X], DISPLAY_PIXELS_X);
+    m->latchedSpans[row] |= spans;
+}
+
+static void setVideoState(VideoState* state, VideoSection section, unsigned h, unsigned v) {
+    state->section = section;
+    state->vCounter = v;
+    state->hCounter = h;
+}
+
+static unsigned dotsToNextEdge(VideoState* vstate) {
+    if (vstate->section == DISPLAY) return LINE_DISPLAY_DOTS - vstate->hCounter;
+    return LINE_DOTS - vstate->hCounter;
+}
+
+// Move the beam forward by a number of dots, which mustn't cross more than one edge
+static void vStateAdvance(Machine* m, VideoState* vstate, unsigned dots) {
+    unsigned hCounter = vstate->hCounter;
+    unsigned vCounter = vstate->vCounter;
+    if (dots == 0) return;
+    switch (vstate->section) {
+        case NONE:
+            perror("Unexpected NONE display state\n");
+            break;
+        case DISPLAY:
+            if (m->latchFrames && hCounter == 0 && vCounter % DISPLAY_SCALE == 0) latchScanline(m, vCounter / DISPLAY_SCALE);
+            hCounter += dots;
+            setVideoState(vstate, hCounter == LINE_DISPLAY_DOTS ? HBLANK : DISPLAY, hCounter, vCounter);
+            break;
+        case HBLANK:
+            hCounter += dots;
+            if (hCounter < LINE_DOTS) setVideoState(vstate, HBLANK, hCounter, vCounter);
+            else if (vCounter == DISPLAY_LINES - 1) setVideoState(vstate, VBLANK, 0, vCounter + 1);
+            else setVideoState(vstate, DISPLAY, 0, vCounter + 1);
+            break;
+        case VBLANK:
+            hCounter += dots;
+            if (hCounter < LINE_DOTS) setVideoState(vstate, VBLANK, hCounter, vCounter);
+            else if (vCounter == FRAME_LINES - 1) setVideoState(vstate, DISPLAY, 0, 0);
+            else setVideoState(vstate, VBLANK, 0, vCounter + 1);
+            break;
+    }
+}
+
+static void execute(Machine* m, Z80Context* ctx) {
+    unsigned PC = ctx->PC;
+    if (ctx == &m->PPU) {
+        byte opc1 = ppuMemRead((size_t)m, PC);
+        byte opc2 = ppuMemRead((size_t)m, PC + 1);
+        switch (opc1) {
+            // RETI
+            case 0xED: {
+                if (opc2 == 0x4D) {
+                    ushort SP = ctx->R1.wr.SP;
+                    ushort retAddr = ppuMemRead((size_t)m, SP) | (ppuMemRead((size_t)m, SP + 1) << 8);
+                    if (retAddr >= m->ppuROMLen) printf("Returning from interrupt with return address outside PPU code (%x)\n", retAddr);
+                }
+                break;
+            }
+            case 0xDD:
+            case 0xFD:
+                if (opc2 == 0xE1 ) {
+                    // POP IX
+                    // POP IY
+                    m->debugSP += 2;
+                } else if (opc2 == 0xE5) {
+                    // PUSH IX
+                    // PUSH IY
+                    m->debugStack[--m->debugSP] = PC;
+                    m->debugStack[--m->debugSP] = PC;
+                }
+                break;
+            case 0b11000001:
+            case 0b11010001:
+            case 0b11100001:
+            case 0b11110001:
+                // POP qq
+                m->debugSP += 2;
+                break;
+            case 0b11000101:
+            case 0b11010101:
+            case 0b11100101:
+            case 0b11110101:
+                m->debugStack[--m->debugSP] = PC;
+                m->debugStack[--m->debugSP] = PC;
+                break;
+
+        }
+    }
+    Z80Execute(ctx);
+}
+
+// High level emulation of the stock PPU ROM's render routine. Instead of interpreting it, the tile and sprite tables are composed
+// into the pixel map natively at the start of each render pass and the PPU is then charged what the routine would have cost,
+// after which the CPU interrupt is raised.
+//
+// T-states of each part of render in src/ppu.s, where each DMA copy stalls for PPU_DMA_SETUP_TSTATES plus a T-state per byte:
+#define HLE_DMA_BLOCK_TSTATES (PPU_DMA_SETUP_TSTATES + SPRITE_DEF_PIXELS_NUM)
+// Setting the strides, ld a,n 2 * 7, xor a 4, out (n),a 3 * 11, then reading the scroll registers, ld a,(nn) 3 * 13,
+// rrca 2 * 4, and n 4 * 7, add a,a 3 * 4, ld r,r 6 * 4, ld r,n 3 * 7, add hl,hl 3 * 11, add hl,bc 2 * 11, ld bc,nn 10
+#define HLE_SETUP_TSTATES 248
+// Each row of tiles: its height, ld a,e 4, rrca 3 * 4, neg 8, add a,n 7, ld d,a 4, ld a,n 7, sub b 4, cp d 4, jr c falling
+// through 7, ld a,d 4, then out (n),a 11, push 5 * 11, pop 2 * 10, its destination from y_pixel_lookup 85, its row bits 15,
+// and moving down the map, pop 3 * 10, ld bc,nn 10, add hl,bc 11, ld a,h 4, cp n 7, jr c 12, ld e,n 7, add a,b 4, ld b,a 4,
+// cp n 7, jp c 10
+#define HLE_TILE_ROW_TSTATES 353
+// jr c taken when the row is cut off at the bottom of the display
+#define HLE_TILE_ROW_CUT_TSTATES 1
+// jr c falling through, ld bc,nn 10 and add hl,bc 11 when moving down from the last row of the map wraps to the top
+#define HLE_MAP_WRAP_TSTATES 16
+// Setting the width for a row of whole tiles, ld a,c 4, or a 4, jr z 12, ld a,n 7, out (n),a 11
+#define HLE_WHOLE_TILES_TSTATES 38
+// Setting the widths and offsets for a row cut at both ends, ld a,c 2 * 4, or a 4, jr z 7, neg 8, add a,n 7, ld a,e 2 * 4,
+// add a,c 4, sub c 4, ld e,a 2 * 4, ld a,n 7, out (n),a 3 * 11, jr 12
+#define HLE_CUT_TILES_TSTATES 110
+// Each call to draw_tiles, ld b,n 7, call 17, ret 10, less 5 for djnz falling through on the last tile
+#define HLE_TILE_RUN_TSTATES 29
+// A tile in draw_tiles: ld a,(hl) 2 * 7, add a,e 4, adc a,n 7, out (n),a 3 * 11, inc l 4, ld a,l 4, inc a 4, and n 7, or d 4,
+// ld l,a 4, xor a 4, djnz 13 and the copy
+#define HLE_TILE_TSTATES (102 + PPU_DMA_SETUP_TSTATES)
+// Setting the block size back to 8x8, ld a,n 2 * 7, out (n),a 2 * 11, then reading the sprite count, ld a,(nn) 13, dec a 4,
+// cp n 7, jr c 12, inc a 4, ld b,a 4, and ld ix,nn 14
+#define HLE_SPRITE_SETUP_TSTATES 94
+// jr c falling through and ld a,n when the sprite count is 0 or more than the table holds
+#define HLE_SPRITE_ALL_TSTATES 2
+// Every evaluated sprite entry: ld a,(ix+3) 19, dec a 4, jp m 10, ld de,nn 10, add ix,de 15, djnz 13
+#define HLE_SPRITE_TSTATES 71
+// Each test of an entry's x or y against the display, ld a,(ix+n) 19, cp n 7, jp nc 10
+#define HLE_SPRITE_BOUND_TSTATES 36
+// A drawn sprite's address lookup 104, ld a,l/h 2 * 4, ld a,(ix+n) 2 * 19, xor a 4, out (n),a 5 * 11 and the copy
+#define HLE_SPRITE_DRAW_TSTATES (209 + HLE_DMA_BLOCK_TSTATES)
+// djnz falling through on the last sprite 5 fewer, nop 4, ld b,n 7, ld c,n 7, out (c),b 12, after which the CPU is interrupted
+#define HLE_FINISH_TSTATES 25
+// The HBLANK interrupt and DISPLAY NMI handlers that suspend and resume rendering around each display period
+#define HLE_RESUME_TSTATES 120
+
+// Find out whether the PPU ROM is the stock one that the native renderer reproduces
+bool hleInit(Machine* m, bool check) {
+#ifdef STOCK_PPU_ROM_CRC
+    if (crc32(m->ppuCodeROM, m->ppuROMLen) != STOCK_PPU_ROM_CRC) {
+        printf("PPU ROM isn't the stock ROM, not using the native renderer\n");
+        return false;
+    }
+    // The lookup table starts with the addresses of the first two rows
+    const byte pattern[] = { PIXEL_MAP_ADDR & 0xFF, PIXEL_MAP_ADDR >> 8, (PIXEL_MAP_ADDR + DISPLAY_PIXELS_X) & 0xFF, (PIXEL_MAP_ADDR + DISPLAY_PIXELS_X) >> 8 };
+    for (unsigned addr = 0; addr + sizeof(pattern) <= m->ppuROMLen; addr++) {
+        if (memcmp(&m->ppuCodeROM[addr], pattern, sizeof(pattern)) == 0) {
+            m->hle.yLookupAddr = addr;
+            m->hle.check = check;
+            m->hle.enabled = !check;
+            return true;
+        }
+    }
+    printf("Couldn't find y_pixel_lookup in the PPU ROM, not using the native renderer\n");
+    return false;
+#else
+    printf("Built without STOCK_PPU_ROM_CRC, not using the native renderer\n");
+    return false;
+#endif
+}
+
+// Read a source byte for the native renderer. Defs can point into the pixel map, and those bytes come from the one being
+// composed, so checking sees what a live pass would.
+static byte hleRead(Machine* m, ushort src, byte* pixels) {
+    return src >= PIXEL_MAP_ADDR && src < PIXEL_MAP_END ? pixels[src - PIXEL_MAP_ADDR] : ppuMemRead((size_t)m, src);
+}
+
+// Copy one row of up to 8 pixels like the DMA engine does for render, with both addresses wrapping at 64KiB. Writes into the live
+// pixel map also go over the bus outside it, while checking only composes the pixel map itself.
+static void hleCopyRow(Machine* m, ushort src, ushort dst, unsigned width, byte* pixels, bool live) {
+    // The same rows dmaCopy copies in one go
+    if ((src & PAGE_MASK) <= PAGE_SIZE - width && dst >= PIXEL_MAP_ADDR && dst <= PIXEL_MAP_END - width) {
+        unsigned offset = dst - PIXEL_MAP_ADDR;
+        byte straddling[SPRITE_DEF_PIXELS_X];
+        byte* in;
+        if (src >= PIXEL_MAP_ADDR && src <= PIXEL_MAP_END - width) in = &pixels[src - PIXEL_MAP_ADDR];
+        else if (src + width <= PIXEL_MAP_ADDR || src >= PIXEL_MAP_END) in = &m->ppuReadPages[src >> PAGE_SHIFT][src & PAGE_MASK];
+        else {
+            for (unsigned i = 0; i < width; i++) straddling[i] = hleRead(m, src + i, pixels);
+            in = straddling;
+        }
+        // Rows that don't change don't need to be marked dirty
+        if (live && memcmp(&pixels[offset], in, width) == 0) return;
+        // A def in the pixel map can overlap the row it's copied to, which the DMA engine copies as if through a buffer
+        memmove(&pixels[offset], in, width);
+        if (live) {
+            markPixelDirty(m, offset);
+            markPixelDirty(m, offset + width - 1);
+        }
+        return;
+    }
+    for (unsigned i = 0; i < width; i++, src++, dst++) {
+        byte b = hleRead(m, src, pixels);
+        if (dst >= PIXEL_MAP_ADDR && dst < PIXEL_MAP_END) {
+            pixels[dst - PIXEL_MAP_ADDR] = b;
+            if (live) markPixelDirty(m, dst - PIXEL_MAP_ADDR);
+        } else if (live) ppuMemWrite((size_t)m, dst, b);
+    }
+}
+
+// Draw the part of the tile map the scroll registers put on the display a row of tiles at a time, like render does. Tiles
+// cut off by the fine scroll at the edges copy only their visible part. Returns what it would have cost render.
+static unsigned long long hleComposeTiles(Machine* m, byte* pixels, bool live) {
+    byte scrollX = ppuMemRead((size_t)m, REG_SCROLL_X);
+    byte scrollY = ppuMemRead((size_t)m, REG_SCROLL_Y);
+    unsigned fineX = scrollX % SPRITE_DEF_PIXELS_X;
+    unsigned mapX = scrollX / SPRITE_DEF_PIXELS_X;
+    unsigned mapY = scrollY / SPRITE_DEF_PIXELS_Y;
+    unsigned cutTop = scrollY % SPRITE_DEF_PIXELS_Y;
+    unsigned long long cost = HLE_SETUP_TSTATES;
+    for (unsigned y = 0; y < DISPLAY_PIXELS_Y; mapY = (mapY + 1) % TILE_MAP_NUM_Y, cutTop = 0) {
+        unsigned height = SPRITE_DEF_PIXELS_Y - cutTop;
+        cost += HLE_TILE_ROW_TSTATES;
+        if (height > DISPLAY_PIXELS_Y - y) {
+            height = DISPLAY_PIXELS_Y - y;
+            cost += HLE_TILE_ROW_CUT_TSTATES;
+        }
+        if (mapY == TILE_MAP_NUM_Y - 1) cost += HLE_MAP_WRAP_TSTATES;
+        cost += fineX ? HLE_CUT_TILES_TSTATES + 3 * HLE_TILE_RUN_TSTATES : HLE_WHOLE_TILES_TSTATES + HLE_TILE_RUN_TSTATES;
+        ushort dst = PIXEL_MAP_ADDR + y * DISPLAY_PIXELS_X;
+        for (unsigned x = 0, mapCol = mapX; x < DISPLAY_PIXELS_X; mapCol = (mapCol + 1) % TILE_MAP_NUM_X) {
+            unsigned cutLeft = x == 0 ? fineX : 0;
+            unsigned width = SPRITE_DEF_PIXELS_X - cutLeft;
+            if (width > DISPLAY_PIXELS_X - x) width = DISPLAY_PIXELS_X - x;
+            ushort entry = TILE_TABLE_ADDR + mapY * TILE_MAP_ROW_SIZE + mapCol * TILE_ENTRY_SIZE;
+            ushort def = ppuMemRead((size_t)m, entry) | (ppuMemRead((size_t)m, entry + 1) << 8);
+            def += cutTop * SPRITE_DEF_PIXELS_X + cutLeft;
+            for (unsigned row = 0; row < height; row++) hleCopyRow(m, def + row * SPRITE_DEF_PIXELS_X, dst + x + row * DISPLAY_PIXELS_X, width, pixels, live);
+            cost += HLE_TILE_TSTATES + width * height;
+            x += width;
+        }
+        y += height;
+    }
+    return cost;
+}
+
+typedef struct {
+    byte x;
+    byte y;
+    ushort def;
+} SpriteDraw;
+
+// The sprites a render pass evaluated, and the ones out of those it drew in the order it drew them
+typedef struct {
+    unsigned evaluated;
+    unsigned drawn;
+    SpriteDraw sprites[SPRITE_ENTRIES_NUM];
+} SpriteList;
+
+// Walk the active entries of the sprite table like render does and collect the ones it would draw. Returns what evaluating
+// them would have cost render, not counting the copies.
+static unsigned long long evaluateSprites(Machine* m, SpriteList* list) {
+    unsigned count = ppuMemRead((size_t)m, REG_SPRITE_COUNT);
+    unsigned long long cost = HLE_SPRITE_SETUP_TSTATES;
+    if (count == 0 || count > SPRITE_ENTRIES_NUM) {
+        count = SPRITE_ENTRIES_NUM;
+        cost += HLE_SPRITE_ALL_TSTATES;
+    }
+    list->evaluated = count;
+    list->drawn = 0;
+    cost += count * HLE_SPRITE_TSTATES;
+    for (unsigned i = 0; i < count; i++) {
+        ushort entry = SPRITE_TABLE_ADDR + i * SPRITE_ENTRY_SIZE;
+        byte hi = ppuMemRead((size_t)m, entry + 3);
+        // render skips sprites whose high address byte minus one is negative, then ones starting off the display
+        if ((byte)(hi - 1) & 0x80) continue;
+        byte x = ppuMemRead((size_t)m, entry);
+        cost += HLE_SPRITE_BOUND_TSTATES;
+        if (x >= DISPLAY_PIXELS_X) continue;
+        byte y = ppuMemRead((size_t)m, entry + 1);
+        cost += HLE_SPRITE_BOUND_TSTATES;
+        if (y >= DISPLAY_PIXELS_Y) continue;
+        list->sprites[list->drawn++] = (SpriteDraw){ .x = x, .y = y, .def = ppuMemRead((size_t)m, entry + 2) | (hi << 8) };
+    }
+    return cost;
+}
+
+// Sprites are opaque 8x8 blocks, so one drawn later at the same place covers every pixel of an earlier one. That only holds
+// when the later one's def can't be changed by the earlier copy, which only writes from the pixel map up.
+static bool spriteOccluded(SpriteList* list, unsigned i) {
+    for (unsigned j = i + 1; j < list->drawn; j++) {
+        SpriteDraw* later = &list->sprites[j];
+        bool covers = later->x == list->sprites[i].x && later->y == list->sprites[i].y;
+        if (covers && later->def <= PIXEL_MAP_ADDR - SPRITE_DEF_SIZE) return true;
+    }
+    return false;
+}
+
+// Draw the tile map then the sprite table into pixels and return how many T-states render would have taken
+static unsigned long long hleCompose(Machine* m, byte* pixels, bool live, SpriteList* sprites) {
+    unsigned long long cost = hleComposeTiles(m, pixels, live);
+    cost += evaluateSprites(m, sprites) + sprites->drawn * HLE_SPRITE_DRAW_TSTATES + HLE_FINISH_TSTATES;
+    for (unsigned i = 0; i < sprites->drawn; i++) {
+        SpriteDraw* sprite = &sprites->sprites[i];
+        // render still pays for copying a covered sprite, but its pixels never need composing
+        if (spriteOccluded(sprites, i)) continue;
+        ushort lookup = m->hle.yLookupAddr + sprite->y * 2;
+        ushort dst = (ppuMemRead((size_t)m, lookup) | (ppuMemRead((size_t)m, lookup + 1) << 8)) + sprite->x;
+        for (unsigned row = 0; row < SPRITE_DEF_PIXELS_Y; row++) {
+            hleCopyRow(m, sprite->def + row * SPRITE_DEF_PIXELS_X, dst + row * DISPLAY_PIXELS_X, SPRITE_DEF_PIXELS_X, pixels, live);
+        }
+    }
+    return cost;
+}
+
+static void countSprites(Machine* m, SpriteList* sprites) {
+    m->counters.spritesEvaluated += sprites->evaluated;
+    m->counters.spritesDrawn += sprites->drawn;
+    m->spritesEvaluated += sprites->evaluated;
+    m->spritesDrawn += sprites->drawn;
+}
+
+// Called at the start of each HBLANK in place of the PPU's interrupt
+static void hleBlankingStarted(Machine* m) {
+    if (m->hle.passActive) {
+        m->hle.remaining += HLE_RESUME_TSTATES;
+    } else {
+        SpriteList sprites;
+        m->hle.remaining = hleCompose(m, &m->ppuRAM[PIXEL_MAP_ADDR - PPU_RAM_START], true, &sprites);
+        countSprites(m, &sprites);
+        m->hle.passActive = true;
+    }
+}
+
+// Charge the render pass for a slice of the PPU's time and raise the CPU interrupt once it's paid for
+static void hleRun(Machine* m, unsigned long long target, bool blanking) {
+    unsigned long long start = m->sched.ppuCycles;
+    m->sched.ppuCycles = target;
+    if (!m->hle.passActive || !blanking) return;
+    if (m->hle.remaining > target - start) {
+        m->hle.remaining -= target - start;
+        return;
+    }
+    m->sched.cpuIntPending = true;
+    m->sched.cpuIntAt = start + m->hle.remaining;
+    m->hle.remaining = 0;
+    m->hle.passActive = false;
+    m->ppuPassDone = true;
+}
+
+// Compare the pixel map the PPU code just finished with what the native renderer makes of the same tables
+static void hleCheckPass(Machine* m) {
+    SpriteList sprites;
+    hleCompose(m, m->hleCheckPixels, false, &sprites);
+    byte* pixels = &m->ppuRAM[PIXEL_MAP_ADDR - PPU_RAM_START];
+    m->hle.checkedPasses++;
+    unsigned mismatches = 0;
+    unsigned first = 0;
+    for (unsigned i = 0; i < PIXEL_MAP_SIZE; i++) {
+        if (pixels[i] != m->hleCheckPixels[i] && mismatches++ == 0) first = i;
+    }
+    if (mismatches > 0) {
+        m->hle.mismatchedPasses++;
+        printf("HLE mismatch in pass %llu: %d pixels differ, first at %d,%d (LLE %x, HLE %x)\n", m->hle.checkedPasses, mismatches,
+               first % DISPLAY_PIXELS_X, first / DISPLAY_PIXELS_X, pixels[first], m->hleCheckPixels[first]);
+    }
+}
+
+static void idleMarkHead(Machine* m, IdleDetector* idle, Z80Context* ctx, unsigned long long cycles) {
+    idle->head = ctx->PC;
+    idle->headCycles = cycles;
+    idle->headWrites = m->busWrites;
+    idle->R1 = ctx->R1;
+    idle->R2 = ctx->R2;
+    idle->I = ctx->I;
+    idle->IFF1 = ctx->IFF1;
+    idle->IFF2 = ctx->IFF2;
+    idle->IM = ctx->IM;
+    idle->halted = ctx->halted;
+}
+
+// R is left out since it counts every instruction, and only matters to code that reads it into another register
+static bool idleAtHead(Machine* m, IdleDetector* idle, Z80Context* ctx) {
+    return idle->head == ctx->PC && idle->headWrites == m->busWrites && !ctx->nmi_req && !ctx->int_req && idle->I == ctx->I &&
+           idle->IFF1 == ctx->IFF1 && idle->IFF2 == ctx->IFF2 && idle->IM == ctx->IM && idle->halted == ctx->halted &&
+           memcmp(&idle->R1, &ctx->R1, sizeof(Z80Regs)) == 0 && memcmp(&idle->R2, &ctx->R2, sizeof(Z80Regs)) == 0;
+}
+
+// Fill in the trace record of the instruction a core is about to execute. Its bus writes go into the same record.
+static void traceStart(Machine* m, Z80Context* ctx, unsigned long long cycles) {
+    Trace* trace = m->trace;
+    TraceRecord* record = &trace->records[trace->count & trace->mask];
+    bool cpu = ctx == &m->CPU;
+    byte** pages = cpu ? m->cpuReadPages : m->ppuReadPages;
+    ushort pc = ctx->PC;
+    record->cycles = (uint32_t)cycles;
+    record->pc = pc;
+    for (ushort i = 0; i < 4; i++) record->opcode[i] = pages[(ushort)(pc + i) >> PAGE_SHIFT][(ushort)(pc + i) & PAGE_MASK];
+    record->flags = (cpu ? TRACE_CPU : 0) | (ctx->halted ? TRACE_HALTED : 0);
+    trace->current = record;
+}
+
+static void traceFinish(Machine* m, Z80Context* ctx) {
+    // DMA stalls can take an instruction past what a byte holds
+    m->trace->current->tstates = ctx->tstates < 255 ? ctx->tstates : 255;
+    m->trace->count++;
+}
+
+static void countBusAccess(unsigned long long* counts, byte* pageRegions, ushort address) {
+    counts[pageRegions[address >> PAGE_SHIFT]]++;
+}
+
+static byte ppuMemReadCounted(size_t param, ushort address) {
+    Machine* m = (Machine*)param;
+    countBusAccess(m->counters.reads, m->ppuPageRegions, address);
+    // The PPU code reads each sprite entry it evaluates, one entry after another
+    if (address >= SPRITE_TABLE_ADDR && address < TILE_TABLE_ADDR) {
+        byte entry = (address - SPRITE_TABLE_ADDR) / SPRITE_ENTRY_SIZE + 1;
+        if (entry != m->lastSpriteEntry) {
+            m->counters.spritesEvaluated++;
+            m->spritesEvaluated++;
+            m->lastSpriteEntry = entry;
+        }
+        m->spriteEntryRead = true;
+    }
+    return ppuMemRead(param, address);
+}
+
+static byte cpuMemReadCounted(size_t param, ushort address) {
+    Machine* m = (Machine*)param;
+    countBusAccess(m->counters.reads, m->cpuPageRegions, address);
+    return cpuMemRead(param, address);
+}
+
+static void ppuMemWriteCounted(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    countBusAccess(m->counters.writes, m->ppuPageRegions, address);
+    ppuMemWrite(param, address, data);
+}
+
+static void cpuMemWriteCounted(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    countBusAccess(m->counters.writes, m->cpuPageRegions, address);
+    cpuMemWrite(param, address, data);
+}
+
+static void ppuIOWriteCounted(size_t param, ushort port, byte data) {
+    ((Machine*)param)->counters.ppuIOWrites++;
+    ppuIOWrite(param, port, data);
+}
+
+static void traceBusWrite(Machine* m, ushort address, byte data, byte flag) {
+    TraceRecord* record = m->trace->current;
+    record->busAddress = address;
+    record->busValue = data;
+    record->flags = (record->flags & ~(TRACE_MEM_WRITE | TRACE_IO_WRITE)) | flag;
+}
+
+static void ppuMemWriteTraced(size_t param, ushort address, byte data) {
+    traceBusWrite((Machine*)param, address, data, TRACE_MEM_WRITE);
+    if (((Machine*)param)->counting) ppuMemWriteCounted(param, address, data);
+    else ppuMemWrite(param, address, data);
+}
+
+static void ppuIOWriteTraced(size_t param, ushort port, byte data) {
+    traceBusWrite((Machine*)param, port, data, TRACE_IO_WRITE);
+    if (((Machine*)param)->counting) ppuIOWriteCounted(param, port, data);
+    else ppuIOWrite(param, port, data);
+}
+
+static void cpuMemWriteTraced(size_t param, ushort address, byte data) {
+    traceBusWrite((Machine*)param, address, data, TRACE_MEM_WRITE);
+    if (((Machine*)param)->counting) cpuMemWriteCounted(param, address, data);
+    else cpuMemWrite(param, address, data);
+}
+
+static void watchpointCheck(Machine* m, Z80Context* ctx, byte core, ushort address, byte data) {
+    if (!(m->watchpoints[address] & core)) return;
+    m->watchpoint.hit = true;
+    m->watchpoint.cpu = core == WATCH_CPU;
+    m->watchpoint.pc = ctx->PC;
+    m->watchpoint.address = address;
+    m->watchpoint.value = data;
+}
+
+static void ppuMemWriteWatched(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    watchpointCheck(m, &m->PPU, WATCH_PPU, address, data);
+    if (m->trace) ppuMemWriteTraced(param, address, data);
+    else if (m->counting) ppuMemWriteCounted(param, address, data);
+    else ppuMemWrite(param, address, data);
+}
+
+static void cpuMemWriteWatched(size_t param, ushort address, byte data) {
+    Machine* m = (Machine*)param;
+    watchpointCheck(m, &m->CPU, WATCH_CPU, address, data);
+    if (m->trace) cpuMemWriteTraced(param, address, data);
+    else if (m->counting) cpuMemWriteCounted(param, address, data);
+    else cpuMemWrite(param, address, data);
+}
+
+// Point the cores at the cheapest bus callbacks that do everything currently asked of them
+static void installBusCallbacks(Machine* m) {
+    m->PPU.memRead = m->counting ? ppuMemReadCounted : ppuMemRead;
+    m->CPU.memRead = m->counting ? cpuMemReadCounted : cpuMemRead;
+    m->PPU.memWrite = m->watching ? ppuMemWriteWatched : m->trace ? ppuMemWriteTraced : m->counting ? ppuMemWriteCounted : ppuMemWrite;
+    m->PPU.ioWrite = m->trace ? ppuIOWriteTraced : m->counting ? ppuIOWriteCounted : ppuIOWrite;
+    m->CPU.memWrite = m->watching ? cpuMemWriteWatched : m->trace ? cpuMemWriteTraced : m->counting ? cpuMemWriteCounted : cpuMemWrite;
+}
+
+void machineSetTrace(Machine* m, Trace* trace) {
+    m->trace = trace;
+    installBusCallbacks(m);
+}
+
+void machineSetWatching(Machine* m, bool watching) {
+    m->watching = watching;
+    installBusCallbacks(m);
+}
+
+void machineSetCounting(Machine* m, bool counting) {
+    m->counting = counting;
+    installBusCallbacks(m);
+}
+
+void machineCollectCounters(Machine* m, FrameCounters* out) {
+    *out = m->counters;
+    out->frames = 1;
+    out->ppuInstructions = m->ppuInstructions - m->countersBase.ppuInstructions;
+    out->cpuInstructions = m->cpuInstructions - m->countersBase.cpuInstructions;
+    out->ppuTStates = m->sched.ppuCycles - m->countersBase.ppuCycles;
+    out->cpuTStates = m->sched.cpuCycles - m->countersBase.cpuCycles;
+    m->counters = (FrameCounters){ 0 };
+    m->countersBase.ppuInstructions = m->ppuInstructions;
+    m->countersBase.cpuInstructions = m->cpuInstructions;
+    m->countersBase.ppuCycles = m->sched.ppuCycles;
+    m->countersBase.cpuCycles = m->sched.cpuCycles;
+}
+
+bool machineSetBlockCache(Machine* m, bool check) {
+    m->ppuBlocks = blockCacheCreate("PPU", &m->PPU, m->ppuReadPages, m->ppuWritePages);
+    m->cpuBlocks = blockCacheCreate("CPU", &m->CPU, m->cpuReadPages, m->cpuWritePages);
+    if (!m->ppuBlocks || !m->cpuBlocks) {
+        printf("Couldn't allocate the block caches\n");
+        return false;
+    }
+    // No PPU code runs from its RAM, which only holds the pixel map and the stack, so only its ROM is decoded
+    for (unsigned addr = 0; addr < PPU_CODE_END; addr += PAGE_SIZE) blockCacheSetCacheable(m->ppuBlocks, addr >> PAGE_SHIFT, true);
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        for (unsigned addr = m->cpuRegions[i].start; addr < m->cpuRegions[i].end; addr += PAGE_SIZE) {
+            blockCacheSetCacheable(m->cpuBlocks, addr >> PAGE_SHIFT, true);
+        }
+    }
+    blockCacheSetCheck(m->ppuBlocks, check);
+    blockCacheSetCheck(m->cpuBlocks, check);
+    return true;
+}
+
+// Run a core until it reaches the target T-state. Always inlined into a lean and an instrumented variant, so with no profile
+// or trace attached the loop is just the instructions and the idle check.
+static inline __attribute__((always_inline)) void runCoreWith(Machine* m, Z80Context* ctx, unsigned long long* cycles, unsigned long long target,
+                                                              unsigned long long* instructions, CoreProfile* profile, IdleDetector* idle,
+                                                              BlockCache* blocks, bool instrumented) {
+    while (*cycles < target) {
+        ushort pc = ctx->PC;
+        bool halted = ctx->halted;
+        ctx->tstates = 0;
+        // A block runs up to the same instruction the loop would have stopped on
+        unsigned executed = blocks ? blockCacheRun(blocks, target - *cycles) : 0;
+        if (executed) *instructions += executed;
+        else {
+            (*instructions)++;
+            if (instrumented && m->trace) traceStart(m, ctx, *cycles);
+            Z80Execute(ctx);
+            if (instrumented && m->trace) traceFinish(m, ctx);
+        }
+        *cycles += ctx->tstates;
+        if (instrumented && profile) profilerRecord(profile, pc, ctx->tstates, halted);
+        // Only a backward jump or an instruction that leaves the PC where it was can close a loop
+        if (ctx->PC > pc || !idle->enabled) continue;
+        if (*cycles < target && idleAtHead(m, idle, ctx)) {
+            // Skip whole iterations only, so the burst ends on the same instruction it would have without skipping
+            unsigned long long period = *cycles - idle->headCycles;
+            unsigned long long skip = (target - *cycles) / period * period;
+            *cycles += skip;
+            idle->skipped += skip;
+            if (instrumented && profile && skip > 0) profilerRecord(profile, ctx->PC, skip, ctx->halted);
+        }
+        idleMarkHead(m, idle, ctx, *cycles);
+    }
+}
+
+static void runCoreLean(Machine* m, Z80Context* ctx, unsigned long long* cycles, unsigned long long target, unsigned long long* instructions,
+                        IdleDetector* idle, BlockCache* blocks) {
+    runCoreWith(m, ctx, cycles, target, instructions, NULL, idle, blocks, false);
+}
+
+static void runCoreInstrumented(Machine* m, Z80Context* ctx, unsigned long long* cycles, unsigned long long target,
+                                unsigned long long* instructions, CoreProfile* profile, IdleDetector* idle) {
+    runCoreWith(m, ctx, cycles, target, instructions, profile, idle, NULL, true);
+}
+
+static void runCore(Machine* m, Z80Context* ctx, unsigned long long* cycles, unsigned long long target, unsigned long long* instructions,
+                    CoreProfile* profile, IdleDetector* idle, BlockCache* blocks) {
+    if (profile || m->trace || m->counting) runCoreInstrumented(m, ctx, cycles, target, instructions, profile, idle);
+    else runCoreLean(m, ctx, cycles, target, instructions, idle, blocks);
+}
+
+// Run both cores and the beam up to the target T-state or the next video edge, whichever comes first. Returns the number of
+// dots the beam moved.
+unsigned runSlice(Machine* m, unsigned long long target) {
+    VideoState* vstate = &m->vState;
+    unsigned long long edge = (m->sched.videoCycles / TSTATES_PER_DOT + dotsToNextEdge(vstate)) * TSTATES_PER_DOT;
+    if (target > edge) target = edge;
+    if (target <= m->sched.videoCycles) return 0;
+
+    if (m->hle.enabled) hleRun(m, target, vstate->section != DISPLAY);
+    else runCore(m, &m->PPU, &m->sched.ppuCycles, target, &m->ppuInstructions, m->ppuProfile, &m->ppuIdle, m->ppuBlocks);
+    if (m->sched.cpuIntPending) {
+        runCore(m, &m->CPU, &m->sched.cpuCycles, m->sched.cpuIntAt, &m->cpuInstructions, m->cpuProfile, &m->cpuIdle, m->cpuBlocks);
+        Z80INT(&m->CPU, 0);
+        m->counters.cpuInts++;
+        m->sched.cpuIntPending = false;
+    }
+    runCore(m, &m->CPU, &m->sched.cpuCycles, target, &m->cpuInstructions, m->cpuProfile, &m->cpuIdle, m->cpuBlocks);
+
+    unsigned dots = target / TSTATES_PER_DOT - m->sched.videoCycles / TSTATES_PER_DOT;
+    m->sched.videoCycles = target;
+    vStateAdvance(m, vstate, dots);
+    return dots;
+}
+
+// Execute a single PPU instruction with the debug bookkeeping, then bring the CPU and the beam up to the same point
+unsigned stepInstruction(Machine* m) {
+    ushort pc = m->PPU.PC;
+    bool halted = m->PPU.halted;
+    m->PPU.tstates = 0;
+    m->ppuInstructions++;
+    if (m->trace) traceStart(m, &m->PPU, m->sched.ppuCycles);
+    execute(m, &m->PPU);
+    if (m->trace) traceFinish(m, &m->PPU);
+    m->sched.ppuCycles += m->PPU.tstates;
+    if (m->ppuProfile) profilerRecord(m->ppuProfile, pc, m->PPU.tstates, halted);
+    return runSlice(m, m->sched.ppuCycles);
+}
+
+void printRegisters(Machine* m, Z80Context* cpu) {
+    Z80Regs regs = cpu->R1;
+    printf("%s Regs:\n\tA: %d, F: %d, AF: %d\n\tB: %d, C: %d, BC: %d\n\tD: %d, E: %d, DE: %d\n\tH: %d, L: %d, HL: %d\n\tIX: %d\n\tIY: %d\n\tSP: %d\n", cpu == &m->PPU ? "PPU" : "CPU", regs.br.A, regs.br.F, regs.wr.AF, regs.br.B, regs.br.C, regs.wr.BC, regs.br.D, regs.br.E, regs.wr.DE, regs.br.H, regs.br.L, regs.wr.HL, regs.wr.IX, regs.wr.IY, regs.wr.SP);
+}
+
+// Print the PPU's most recent PCs from the trace, newest first, with runs of the same PC folded
+void printStackTrace(Machine* m) {
+    Trace* trace = m->trace;
+    if (!trace) printf("No instruction trace, run with --trace to record one\n");
+    else {
+        printf("Last PPU instructions:\n");
+        size_t capacity = trace->mask + 1;
+        uint64_t oldest = trace->count > capacity ? trace->count - capacity : 0;
+        unsigned printed = 0;
+        unsigned repeated = 0;
+        int prev = -1;
+        for (uint64_t i = trace->count; i > oldest && printed < STACK_TRACE_PCS; i--) {
+            TraceRecord* record = &trace->records[(i - 1) & trace->mask];
+            if (record->flags & TRACE_CPU) continue;
+            if (record->pc == prev) {
+                repeated++;
+                continue;
+            }
+            if (repeated > 0) printf("\trepeated %u times\n", repeated + 1);
+            printf("%x\n", record->pc);
+            prev = record->pc;
+            repeated = 0;
+            printed++;
+        }
+        if (repeated > 0) printf("\trepeated %u times\n", repeated + 1);
+    }
+    printRegisters(m, &m->PPU);
+}
+
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCRCTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (unsigned k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+uint32_t crc32(const byte* data, size_t len) {
+    // Machines on different threads may be the first to need the table
+    pthread_once(&crcTableOnce, buildCRCTable);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+#define MACHINE_STATE_VERSION 7
+
+typedef struct {
+    Z80Regs R1;
+    Z80Regs R2;
+    ushort PC;
+    byte R, I, IFF1, IFF2, IM, halted;
+    byte nmiReq, intReq, deferInt, intVector, execIntVector;
+} CoreState;
+
+typedef struct {
+    uint32_t version;
+    uint32_t ppuROMHash;
+    uint32_t cpuROMHash;
+    uint32_t defsHash;
+    uint32_t memMapHash;
+    uint32_t frame;
+    CoreState ppu;
+    CoreState cpu;
+    VideoState video;
+    Scheduler sched;
+    DMAState dma;
+    byte frontTables;
+    byte pendingFlip;
+    bool ppuPassDone;
+    byte controller;
+    bool hlePassActive;
+    uint64_t hleRemaining;
+} MachineStateHeader;
+
+static void saveCoreState(Z80Context* ctx, CoreState* state) {
+    *state = (CoreState){
+        .R1 = ctx->R1, .R2 = ctx->R2, .PC = ctx->PC, .R = ctx->R, .I = ctx->I, .IFF1 = ctx->IFF1, .IFF2 = ctx->IFF2, .IM = ctx->IM,
+        .halted = ctx->halted, .nmiReq = ctx->nmi_req, .intReq = ctx->int_req, .deferInt = ctx->defer_int,
+        .intVector = ctx->int_vector, .execIntVector = ctx->exec_int_vector
+    };
+}
+
+static void loadCoreState(Z80Context* ctx, CoreState* state) {
+    ctx->R1 = state->R1;
+    ctx->R2 = state->R2;
+    ctx->PC = state->PC;
+    ctx->R = state->R;
+    ctx->I = state->I;
+    ctx->IFF1 = state->IFF1;
+    ctx->IFF2 = state->IFF2;
+    ctx->IM = state->IM;
+    ctx->halted = state->halted;
+    ctx->nmi_req = state->nmiReq;
+    ctx->int_req = state->intReq;
+    ctx->defer_int = state->deferInt;
+    ctx->int_vector = state->intVector;
+    ctx->exec_int_vector = state->execIntVector;
+}
+
+// Hash the layout of the mem map, or the contents of its ROM regions
+static uint32_t hashMemRegions(Machine* m, bool contents) {
+    uint32_t hashes[MAX_MEM_REGIONS * 3 + 1];
+    unsigned count = 0;
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        if (contents) {
+            if (region->type == REGION_ROM) hashes[count++] = crc32(region->data, region->end - region->start);
+        } else {
+            hashes[count++] = region->type;
+            hashes[count++] = region->start;
+            hashes[count++] = region->end;
+        }
+    }
+    if (!contents) hashes[count++] = m->doubleBufferedTables;
+    return crc32((byte*)hashes, count * sizeof(uint32_t));
+}
+
+size_t machineStateSize(Machine* m) {
+    size_t len = sizeof(MachineStateHeader) + sizeof(m->tableRAM) + sizeof(m->ppuRAM);
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        if (m->cpuRegions[i].type == REGION_RAM) len += m->cpuRegions[i].end - m->cpuRegions[i].start;
+    }
+    return len;
+}
+
+void saveMachineState(Machine* m, byte* out) {
+    MachineStateHeader header = {
+        .version = MACHINE_STATE_VERSION,
+        .ppuROMHash = crc32(m->ppuCodeROM, PPU_CODE_ROM_SIZE),
+        .cpuROMHash = hashMemRegions(m, true),
+        .defsHash = crc32(m->ppuDefROM, PPU_DEF_ROM_SIZE),
+        .memMapHash = hashMemRegions(m, false),
+        .frame = m->frames,
+        .video = m->vState,
+        .sched = m->sched,
+        .dma = m->dma,
+        .frontTables = m->frontTables,
+        .pendingFlip = m->pendingFlip,
+        .ppuPassDone = m->ppuPassDone,
+        .controller = m->controller,
+        .hlePassActive = m->hle.passActive,
+        .hleRemaining = m->hle.remaining
+    };
+    saveCoreState(&m->PPU, &header.ppu);
+    saveCoreState(&m->CPU, &header.cpu);
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, m->tableRAM, sizeof(m->tableRAM));
+    out += sizeof(m->tableRAM);
+    memcpy(out, m->ppuRAM, sizeof(m->ppuRAM));
+    out += sizeof(m->ppuRAM);
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        if (region->type != REGION_RAM) continue;
+        memcpy(out, region->data, region->end - region->start);
+        out += region->end - region->start;
+    }
+}
+
+bool loadMachineState(Machine* m, const byte* in, size_t len) {
+    MachineStateHeader header;
+    if (len != machineStateSize(m)) {
+        printf("Snapshot is %zu bytes but this machine needs %zu\n", len, machineStateSize(m));
+        return false;
+    }
+    memcpy(&header, in, sizeof(header));
+    if (header.version != MACHINE_STATE_VERSION) {
+        printf("Unsupported snapshot version %d\n", header.version);
+        return false;
+    }
+    if (header.ppuROMHash != crc32(m->ppuCodeROM, PPU_CODE_ROM_SIZE) || header.cpuROMHash != hashMemRegions(m, true) ||
+        header.defsHash != crc32(m->ppuDefROM, PPU_DEF_ROM_SIZE)) {
+        printf("Snapshot was saved with different ROMs\n");
+        return false;
+    }
+    if (header.memMapHash != hashMemRegions(m, false)) {
+        printf("Snapshot was saved with a different mem map\n");
+        return false;
+    }
+    in += sizeof(header);
+    // Blocks decoded from CPU RAM go stale when it's replaced, and the write pages they took have to be back before it's copied
+    if (m->cpuBlocks) blockCacheFlush(m->cpuBlocks);
+    memcpy(m->tableRAM, in, sizeof(m->tableRAM));
+    in += sizeof(m->tableRAM);
+    memcpy(m->ppuRAM, in, sizeof(m->ppuRAM));
+    in += sizeof(m->ppuRAM);
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        if (region->type != REGION_RAM) continue;
+        memcpy(region->data, in, region->end - region->start);
+        in += region->end - region->start;
+    }
+    loadCoreState(&m->PPU, &header.ppu);
+    loadCoreState(&m->CPU, &header.cpu);
+    m->vState = header.video;
+    m->sched = header.sched;
+    m->dma = header.dma;
+    m->frontTables = header.frontTables;
+    m->pendingFlip = header.pendingFlip;
+    m->ppuPassDone = header.ppuPassDone;
+    m->controller = header.controller;
+    m->cpuRegsPage[REG_TABLE_FLIP & PAGE_MASK] = m->pendingFlip != 0;
+    mapTables(m);
+    m->hle.passActive = header.hlePassActive;
+    m->hle.remaining = header.hleRemaining;
+    m->frames = header.frame;
+    // The T-state counts jump to the loaded ones
+    m->countersBase.ppuCycles = m->sched.ppuCycles;
+    m->countersBase.cpuCycles = m->sched.cpuCycles;
+    // Loop heads seen before the load say nothing about the loaded memory
+    m->ppuIdle.head = m->cpuIdle.head = -1;
+    // The frame buffer no longer matches the pixel map
+    for (unsigned row = 0; row < DISPLAY_PIXELS_Y; row++) m->dirtySpans[row] = ALL_SPANS;
+    return true;
+}
+
+// Map len bytes of a read only file. Bytes past the end of a short file read as zero and a long file is cut off at len.
+// The mapping is private, so the file is never copied and is shared through the page cache with other instances.
+static byte* mapFile(const char* path, size_t len, size_t* fileLen) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Couldn't stat %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    // Reserve zeroed pages for the whole region then map the file over the start of it. Mapping only the part of the
+    // file that's there means the tail of the last page reads as zero rather than faulting.
+    byte* mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t used = (size_t)st.st_size < len ? (size_t)st.st_size : len;
+    if (mem != MAP_FAILED && used > 0 && mmap(mem, used, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(mem, len);
+        mem = MAP_FAILED;
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("Couldn't map %s\n", path);
+        return NULL;
+    }
+    if (fileLen) *fileLen = used;
+    return mem;
+}
+
+static bool addMemRegion(Machine* m, RegionType type, unsigned start, unsigned end, const char* path) {
+    if (start % PAGE_SIZE != 0 || end % PAGE_SIZE != 0 || end <= start || end > ADDRESS_SPACE_SIZE) {
+        printf("Mem map region %d-%d must be non-empty, within 64KiB and aligned to %d bytes\n", start, end, PAGE_SIZE);
+        return false;
+    }
+    if (start < CPU_SPRITE_TABLE_ADDR + TABLE_RAM_SIZE && end > CPU_SPRITE_TABLE_ADDR) {
+        printf("Mem map region %d-%d overlaps the sprite tables at %d-%d\n", start, end, CPU_SPRITE_TABLE_ADDR, CPU_SPRITE_TABLE_ADDR + TABLE_RAM_SIZE);
+        return false;
+    }
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        if (start < m->cpuRegions[i].end && end > m->cpuRegions[i].start) {
+            printf("Mem map region %d-%d overlaps region %d-%d\n", start, end, m->cpuRegions[i].start, m->cpuRegions[i].end);
+            return false;
+        }
+    }
+    if (m->cpuRegionCount == MAX_MEM_REGIONS) {
+        printf("Mem map has more than %d regions\n", MAX_MEM_REGIONS);
+        return false;
+    }
+    unsigned len = end - start;
+    byte* data;
+    if (type == REGION_RAM) {
+        data = calloc(len, sizeof(byte));
+        if (data == NULL) {
+            printf("Couldn't allocate %d bytes for CPU RAM\n", len);
+            return false;
+        }
+    } else {
+        size_t mapped = 0;
+        if (!(data = mapFile(path, len, &mapped))) return false;
+        printf("Mapped %zu CPU ROM bytes from %s at %d-%d\n", mapped, path, start, end);
+    }
+    m->cpuRegions[m->cpuRegionCount++] = (MemRegion){ .type = type, .start = start, .end = end, .data = data };
+    return true;
+}
+
+// Parse a mem map file in the form of any number of lines with a start address, end address (exclusive) and a type:
+// x,x+y,type[,path]
+//
+// Where type is "ram" or "rom". A ROM is mapped from its path, or from the CPU ROM path given on the command line if it
+// doesn't have one. A line in the form "defs,path" maps the PPU's sprite definitions.
+static bool readCPUMemMapFile(Machine* m, FILE* file, const char* defaultROMPath) {
+    char* line = NULL;
+    size_t lineCap = 0;
+    bool ok = true;
+    while (ok && getline(&line, &lineCap, file) != -1) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0]) continue;
+        char* rest = line;
+        char* tok = strtok_r(rest, ",", &rest);
+        if (strcmp(tok, "defs") == 0) {
+            // Map sprites
+            char* spritesPath = strtok_r(rest, ",", &rest);
+            if (!spritesPath) {
+                printf("Unrecognised mem map format: %s\n", line);
+                ok = false;
+            } else if (m->ppuDefROM) {
+                printf("Mem map has more than one defs line\n");
+                ok = false;
+            } else {
+                size_t mapped = 0;
+                m->ppuDefROM = mapFile(spritesPath, PPU_DEF_ROM_SIZE, &mapped);
+                if (m->ppuDefROM) printf("Mapped %zu bytes from %s\n", mapped, spritesPath);
+                ok = m->ppuDefROM != NULL;
+            }
+            continue;
+        } else if (strcmp(tok, "tables") == 0) {
+            char* mode = strtok_r(rest, ",", &rest);
+            if (mode && strcmp(mode, "double") == 0) m->doubleBufferedTables = true;
+            else if (!mode || strcmp(mode, "single") != 0) {
+                printf("Unrecognised tables mode in mem map: %s\n", mode ? mode : "");
+                ok = false;
+            }
+            continue;
+        }
+        unsigned start = strtol(tok, NULL, 10);
+        char* endTok = strtok_r(rest, ",", &rest);
+        char* type = strtok_r(rest, ",", &rest);
+        char* path = strtok_r(rest, ",", &rest);
+        if (!endTok || !type) {
+            printf("Unrecognised mem map format: %s\n", line);
+            ok = false;
+            continue;
+        }
+        unsigned end = strtol(endTok, NULL, 10);
+        if (strcmp(type, "ram") == 0) {
+            ok = addMemRegion(m, REGION_RAM, start, end, NULL);
+        } else if (strcmp(type, "rom") == 0) {
+            ok = addMemRegion(m, REGION_ROM, start, end, path ? path : defaultROMPath);
+        } else {
+            printf("Unrecognised memory type from mem map: %s\n", type);
+            ok = false;
+        }
+    }
+    free(line);
+    return ok;
+}
+
+Machine* machineCreate(const char* ppuROMPath, const char* memMapPath, const char* cpuROMPath) {
+    Machine* m = calloc(1, sizeof(Machine));
+    if (!m) {
+        printf("Couldn't allocate a machine\n");
+        return NULL;
+    }
+    m->PPU = (Z80Context){ .memRead = ppuMemRead, .memWrite = ppuMemWrite, .ioRead = ppuIORead, .ioWrite = ppuIOWrite, .memParam = (size_t)m, .ioParam = (size_t)m };
+    m->CPU = (Z80Context){ .memRead = cpuMemRead, .memWrite = cpuMemWrite, .ioRead = cpuIORead, .memParam = (size_t)m, .ioParam = (size_t)m };
+    m->vState = (VideoState){ .section = DISPLAY, .hCounter = 0, .vCounter = 0 };
+    m->ppuIdle = (IdleDetector){ .enabled = true, .head = -1 };
+    m->cpuIdle = (IdleDetector){ .enabled = true, .head = -1 };
+    m->debugSP = 32 * 1024 - 1;
+    m->ppuPassDone = true;
+    // Convert the whole pixel map on the first frame
+    for (unsigned row = 0; row < DISPLAY_PIXELS_Y; row++) m->dirtySpans[row] = ALL_SPANS;
+
+    size_t ppuROMMapped = 0;
+    if (!(m->ppuCodeROM = mapFile(ppuROMPath, PPU_CODE_ROM_SIZE, &ppuROMMapped))) {
+        machineDestroy(m);
+        return NULL;
+    }
+    m->ppuROMLen = ppuROMMapped;
+    printf("Mapped %d PPU ROM bytes from %s\n", m->ppuROMLen, ppuROMPath);
+
+    printf("Reading %s\n", memMapPath);
+    FILE* memMapFile = fopen(memMapPath, "r");
+    if (!memMapFile) {
+        printf("Couldn't open %s\n", memMapPath);
+        machineDestroy(m);
+        return NULL;
+    }
+    bool memMapOK = readCPUMemMapFile(m, memMapFile, cpuROMPath);
+    fclose(memMapFile);
+    bool romMapped = false;
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) romMapped |= m->cpuRegions[i].type == REGION_ROM;
+    if (memMapOK && !romMapped) printf("No CPU ROM mapped\n");
+    // Cartridges without sprite definitions see zeroes
+    if (memMapOK && romMapped && !m->ppuDefROM) m->ppuDefROM = mmap(NULL, PPU_DEF_ROM_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!memMapOK || !romMapped || m->ppuDefROM == MAP_FAILED) {
+        if (m->ppuDefROM == MAP_FAILED) m->ppuDefROM = NULL;
+        machineDestroy(m);
+        return NULL;
+    }
+    buildPPUPageTables(m);
+    buildCPUPageTables(m);
+    mapTables(m);
+    buildPageRegions(m);
+    if (m->doubleBufferedTables) printf("Sprite and tile tables are double buffered\n");
+    return m;
+}
+
+void machineDestroy(Machine* m) {
+    if (m->ppuBlocks) blockCacheDestroy(m->ppuBlocks);
+    if (m->cpuBlocks) blockCacheDestroy(m->cpuBlocks);
+    if (m->ppuCodeROM) munmap(m->ppuCodeROM, PPU_CODE_ROM_SIZE);
+    if (m->ppuDefROM) munmap(m->ppuDefROM, PPU_DEF_ROM_SIZE);
+    for (unsigned i = 0; i < m->cpuRegionCount; i++) {
+        MemRegion* region = &m->cpuRegions[i];
+        if (region->type == REGION_ROM) munmap(region->data, region->end - region->start);
+        else free(region->data);
+    }
+    free(m);
+}
+
+void machineReset(Machine* m) {
+    Z80RESET(&m->PPU);
+    Z80RESET(&m->CPU);
+    m->ppuPassDone = true;
+    // Give PPU a few cycles to set up stack
+    Z80ExecuteTStates(&m->PPU, 60);
+}
+
+bool machineEdge(Machine* m, VideoSection prevSection) {
+    VideoSection section = m->vState.section;
+    if (section == prevSection) return false;
+    if (section == HBLANK) {
+        // The PPU starts its next render pass at the first HBLANK after it finished the last one
+        if (m->ppuPassDone) {
+            m->ppuPassDone = false;
+            if (m->pendingFlip) flipTables(m);
+        }
+        if (m->hle.enabled) hleBlankingStarted(m);
+        else {
+            Z80INT(&m->PPU, 0);
+            m->counters.ppuInts++;
+        }
+    } else if (section == DISPLAY) {
+        if (!m->hle.enabled) {
+            Z80NMI(&m->PPU);
+            m->counters.ppuNMIs++;
+        }
+    } else if (section == VBLANK) {
+        m->frames++;
+        if (m->sampleInput) m->controller = m->sampleInput(m->sampleInputArg, m->frames);
+        m->dirtyCellsLastFrame = collectDirtyCells(m);
+        m->dirtyCellsTotal += m->dirtyCellsLastFrame;
+        if (m->ppuProfile) profilerEndFrame(m->ppuProfile);
+        if (m->cpuProfile) profilerEndFrame(m->cpuProfile);
+        return true;
+    }
+    return false;
+}
+
+bool machineStackOverflowed(Machine* m) {
+    if (m->PPU.R1.wr.SP >= STACK_BOTTOM) return false;
+    printf("Stack overflowed to address %x at PC %x\n", m->PPU.R1.wr.SP, m->PPU.PC);
+    printStackTrace(m);
+    return true;
+}
+
+bool machineRunFrame(Machine* m) {
+    while (true) {
+        VideoSection prevSection = m->vState.section;
+        runSlice(m, ULLONG_MAX);
+        if (machineEdge(m, prevSection)) return true;
+        if (machineStackOverflowed(m)) return false;
+    }
+}
+
+const byte* machinePixelMap(Machine* m) {
+    return &m->ppuRAM[PIXEL_MAP_ADDR - PPU_RAM_START];
+}
@@ -0,0 +1,283 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <z80.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "consts.h"
+#include "blockcache.h"
+#include "counters.h"
+#include "profiler.h"
+#include "trace.h"
+
+#define PPU_CODE_END (8 * 1024)
+#define PPU_CODE_ROM_SIZE PPU_CODE_END
+#define PPU_TABLES_START (8 * 1024)
+#define TABLE_RAM_SIZE (8 * 1024)
+#define PPU_TABLES_END (PPU_TABLES_START + TABLE_RAM_SIZE)
+#define PPU_DEFS_START (16 * 1024)
+#define PPU_DEF_ROM_SIZE (16 * 1024)
+#define PPU_DEFS_END (PPU_DEFS_START + PPU_DEF_ROM_SIZE)
+#define PPU_RAM_START PIXEL_MAP_ADDR
+#define PIXEL_MAP_SIZE (DISPLAY_PIXELS_X * DISPLAY_PIXELS_Y)
+#define PIXEL_MAP_END (PIXEL_MAP_ADDR + PIXEL_MAP_SIZE)
+// Dirty tracking works on 8 pixel wide spans of each row, and 8x8 cells for the per-frame counter
+#define SPANS_PER_ROW (DISPLAY_PIXELS_X / 8)
+#define ALL_SPANS ((1u << SPANS_PER_ROW) - 1)
+#define CELL_ROWS (DISPLAY_PIXELS_Y / 8)
+
+#define DISPLAY_SCALE 4
+
+// Video timing in dots. Each line has LINE_DISPLAY_DOTS of picture followed by a horizontal blank, and each frame has
+// DISPLAY_LINES of picture followed by lines of vertical blank.
+#define LINE_DISPLAY_DOTS 800
+#define LINE_DOTS 1056
+#define DISPLAY_LINES 600
+#define FRAME_LINES 629
+// Both Z80s are clocked from the dot clock
+#define TSTATES_PER_DOT 4
+// The PPU renders during the horizontal and vertical blanking periods
+#define BLANKING_DOTS_PER_FRAME ((LINE_DOTS - LINE_DISPLAY_DOTS) * DISPLAY_LINES + (FRAME_LINES - DISPLAY_LINES) * LINE_DOTS)
+#define BLANKING_TSTATES_PER_FRAME ((unsigned long long)BLANKING_DOTS_PER_FRAME * TSTATES_PER_DOT)
+
+#define ADDRESS_SPACE_SIZE (64 * 1024)
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (ADDRESS_SPACE_SIZE / PAGE_SIZE)
+
+#define STACK_TOP (64 * 1024)
+#define STACK_BOTTOM (64 * 1024 - STACK_SIZE)
+
+// Watchpoint bits, set on the addresses whose writes by that core stop the debugger
+#define WATCH_PPU 1
+#define WATCH_CPU 2
+
+// The most RAM and ROM regions a mem map can describe
+#define MAX_MEM_REGIONS 32
+
+typedef enum { HBLANK, VBLANK, DISPLAY, NONE } VideoSection;
+
+// Called at the start of every VBLANK for the controller state the CPU reads during the next frame
+typedef byte (*InputSampler)(void* arg, unsigned frame);
+
+typedef struct {
+    VideoSection section;
+    unsigned vCounter;
+    unsigned hCounter;
+} VideoState;
+
+typedef enum { REGION_RAM, REGION_ROM } RegionType;
+// A region of the CPU's address space from the mem map. ROM data is a private read only mapping of its file, so instances
+// running the same cartridge share the page cache, and RAM is allocated zeroed.
+typedef struct {
+    RegionType type;
+    unsigned start;
+    unsigned end;
+    byte* data;
+} MemRegion;
+
+// Absolute T-state counts for the beam and each core. Cores run in bursts up to the next video edge and may overshoot it by
+// part of an instruction, which is paid back in the next burst.
+typedef struct {
+    unsigned long long videoCycles;
+    unsigned long long ppuCycles;
+    unsigned long long cpuCycles;
+    // Set when the PPU raises the CPU interrupt, so the CPU can be run up to that exact T-state before it's delivered
+    bool cpuIntPending;
+    unsigned long long cpuIntAt;
+} Scheduler;
+
+// A core is idle when it arrives back at the head of a loop with the same registers and nothing has been written since it
+// was last there. Without an interrupt it will go round the same way until the end of the burst, so the remaining whole
+// iterations are skipped. A halted core counts as a loop of one instruction.
+typedef struct {
+    bool enabled;
+    int head;
+    unsigned long long headCycles;
+    unsigned long long headWrites;
+    Z80Regs R1;
+    Z80Regs R2;
+    byte I, IFF1, IFF2, IM, halted;
+    unsigned long long skipped;
+} IdleDetector;
+
+// Registers of the PPU's DMA engine
+typedef struct {
+    ushort src;
+    ushort dst;
+    ushort stride;
+    byte width;
+    byte height;
+    byte srcStride;
+} DMAState;
+
+// State of the native replacement for the PPU render routine
+typedef struct {
+    bool enabled;
+    // Check mode runs the real PPU code and compares its output with the native renderer at the end of every pass
+    bool check;
+    // Address of y_pixel_lookup in the ROM, which render indexes with unchecked sprite y coordinates
+    ushort yLookupAddr;
+    bool passActive;
+    unsigned long long remaining;
+    unsigned long long checkedPasses;
+    unsigned long long mismatchedPasses;
+} HLEState;
+
+// One console. Everything the cores and the beam touch lives here and the bus callbacks get the machine through the libz80
+// param slots, so any number of machines can run in one process.
+typedef struct {
+    Z80Context PPU;
+    Z80Context CPU;
+    // The sprite and tile tables. With double buffering the PPU reads the front bank while the CPU writes the other one,
+    // otherwise both use the front bank.
+    byte tableRAM[2][TABLE_RAM_SIZE];
+    bool doubleBufferedTables;
+    byte frontTables;
+    // The TABLE_FLIP flags of a flip the CPU has asked for, or 0
+    byte pendingFlip;
+    // Set from the end of a render pass until the next one starts, which is when the tables can be flipped without tearing
+    bool ppuPassDone;
+    unsigned long long tableFlips;
+    byte ppuRAM[(ushort)32 * 1024];
+    // Both PPU ROMs are mapped straight from their files
+    byte* ppuCodeROM;
+    byte* ppuDefROM;
+    unsigned ppuROMLen;
+    MemRegion cpuRegions[MAX_MEM_REGIONS];
+    unsigned cpuRegionCount;
+
+    // Host pointers to the start of each page of a core's address space, so a bus access is a single indexed load. Reads
+    // are always mapped. A NULL write page sends the write down the slow path, which is reserved for protected regions on the
+    // PPU and the register page on the CPU, and to CPU RAM pages the block cache has decoded code from.
+    byte* ppuReadPages[PAGE_COUNT];
+    byte* ppuWritePages[PAGE_COUNT];
+    byte* cpuReadPages[PAGE_COUNT];
+    byte* cpuWritePages[PAGE_COUNT];
+    // Unmapped CPU reads see the open bus page and ROM and unmapped CPU writes land in the write trap page
+    byte openBusPage[PAGE_SIZE];
+    byte writeTrapPage[PAGE_SIZE];
+    // What the CPU reads back from its register page
+    byte cpuRegsPage[PAGE_SIZE];
+
+    VideoState vState;
+    unsigned frames;
+    // The controller state latched at the last VBLANK, and where it comes from
+    byte controller;
+    InputSampler sampleInput;
+    void* sampleInputArg;
+    DMAState dma;
+    Scheduler sched;
+    IdleDetector ppuIdle;
+    IdleDetector cpuIdle;
+    // Memory and I/O writes from either core, so the idle detector can tell whether a loop changed anything
+    unsigned long long busWrites;
+    // Instructions each core has executed, not counting skipped idle iterations
+    unsigned long long ppuInstructions;
+    unsigned long long cpuInstructions;
+    // Set when profiling is enabled for a core
+    CoreProfile* ppuProfile;
+    CoreProfile* cpuProfile;
+    HLEState hle;
+    // Counters for the frame so far, taken by machineCollectCounters. Interrupts and DMA are always counted, while bus accesses
+    // are only counted when counting is on, which swaps in counting callbacks and runs the cores through libz80. Sprites are
+    // counted by the native renderer as it composes them, or from the PPU code's bus accesses when counting is on.
+    bool counting;
+    FrameCounters counters;
+    // One more than the sprite entry the PPU code last read this pass, or 0, and whether it's read the sprite table since its
+    // last DMA copy, which makes that copy a sprite
+    byte lastSpriteEntry;
+    bool spriteEntryRead;
+    // The BusRegion of each page of each core's address space
+    byte ppuPageRegions[PAGE_COUNT];
+    byte cpuPageRegions[PAGE_COUNT];
+    // Where the instruction and T-state counts stood when the counters were last taken
+    struct {
+        unsigned long long ppuInstructions, cpuInstructions, ppuCycles, cpuCycles;
+    } countersBase;
+    // Decoded basic blocks of each core's ROM and CPU RAM, used by the lean run loop when enabled
+    BlockCache* ppuBlocks;
+    BlockCache* cpuBlocks;
+    byte hleCheckPixels[PIXEL_MAP_SIZE];
+
+    // Latching the pixel map as the beam passes is only needed when the frames are shown
+    bool latchFrames;
+    // One bit per span of each pixel map row, set when the span is written and cleared when the beam latches the row
+    uint32_t dirtySpans[DISPLAY_PIXELS_Y];
+    // One bit per 8x8 cell written since the last VBLANK
+    uint32_t frameDirtyCells[CELL_ROWS];
+    unsigned dirtyCellsLastFrame;
+    unsigned long long dirtyCellsTotal;
+    // Sprite table entries render passes have evaluated and sprites they've drawn, when they're counted
+    unsigned long long spritesEvaluated;
+    unsigned long long spritesDrawn;
+    // The pixel map as the beam has latched it so far this frame, and the spans of each row changed since the last VBLANK
+    byte latchedPixels[PIXEL_MAP_SIZE];
+    uint32_t latchedSpans[DISPLAY_PIXELS_Y];
+
+    // Debugger bookkeeping
+    bool waitUntilCPUInterrupted;
+    unsigned debugStack[32 * 1024];
+    unsigned debugSP;
+    // The instruction trace, when one is being recorded
+    Trace* trace;
+    byte watchpoints[64 * 1024];
+    bool watching;
+    // The last write that hit a watchpoint
+    struct {
+        bool hit;
+        bool cpu;
+        ushort pc;
+        ushort address;
+        byte value;
+    } watchpoint;
+} Machine;
+
+// Map the PPU ROM and the regions of a mem map file. The first ROM region without a path of its own is mapped from
+// cpuROMPath. Returns NULL if anything can't be loaded.
+Machine* machineCreate(const char* ppuROMPath, const char* memMapPath, const char* cpuROMPath);
+void machineDestroy(Machine* m);
+// Reset both cores and let the PPU set up its stack
+void machineReset(Machine* m);
+// Use the native renderer, or with check compare it against the PPU code, if the PPU ROM is the stock one
+bool hleInit(Machine* m, bool check);
+// Start recording every instruction both cores execute into the trace, or stop if it's NULL. The bus writes are only routed
+// through the recording callbacks while there's a trace.
+void machineSetTrace(Machine* m, Trace* trace);
+// Check writes against the watchpoints. Like tracing, this swaps the write callbacks so there's no cost while it's off.
+void machineSetWatching(Machine* m, bool watching);
+// Run ROM code, and code in CPU RAM, from decoded blocks instead of through libz80 wherever there's no trace or profile. With
+// check, libz80 still runs everything and each block is compared against it.
+bool machineSetBlockCache(Machine* m, bool check);
+// Count every bus access by region. Like tracing this swaps callbacks, and it also keeps the cores off the block cache.
+void machineSetCounting(Machine* m, bool counting);
+// Take what the machine has done since the counters were last taken, and start counting again
+void machineCollectCounters(Machine* m, FrameCounters* out);
+
+unsigned runSlice(Machine* m, unsigned long long target);
+unsigned stepInstruction(Machine* m);
+// Raise whatever the beam crossing from prevSection into its current section triggers. Returns true when a frame finished.
+bool machineEdge(Machine* m, VideoSection prevSection);
+bool machineStackOverflowed(Machine* m);
+// Run until the next frame finishes. Returns false if the PPU's stack overflowed.
+bool machineRunFrame(Machine* m);
+const byte* machinePixelMap(Machine* m);
+
+byte ppuMemRead(size_t param, ushort address);
+void ppuMemWrite(size_t param, ushort address, byte data);
+byte cpuMemRead(size_t param, ushort address);
+unsigned coordToVRAMAddr(unsigned x, unsigned y, unsigned scale);
+char* toString(VideoSection section);
+void printRegisters(Machine* m, Z80Context* cpu);
+void printStackTrace(Machine* m);
+uint32_t crc32(const byte* data, size_t len);
+
+// Snapshots cover everything needed to resume emulation. The ROMs are only referenced by hash, so a snapshot can only be
+// loaded with the same ROMs and mem map it was saved with.
+size_t machineStateSize(Machine* m);
+void saveMachineState(Machine* m, byte* out);
+bool loadMachineState(Machine* m, const byte* in, size_t len);
+
+#endif
@@ -4,569 +4,952 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "capture.h"
 #include "consts.h"
-
-#define PPU_CODE_END (8 * 1024)
-#define PPU_TABLES_START (8 * 1024)
-#define PPU_TABLES_END (PPU_TABLES_START + 8 * 1024)
-#define PPU_DEFS_START (16 * 1024)
-#define PPU_DEFS_END (PPU_DEFS_START + 16 * 1024)
-#define PPU_RAM_START PIXEL_MAP_ADDR
+#include "counters.h"
+#include "input.h"
+#include "machine.h"
+#include "pacing.h"
+#include "palette.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #define FRAMES_PER_SECOND 50
 #define MILLIS_PER_FRAME (1000 / FRAMES_PER_SECOND)
-#define STACK_TOP (64 * 1024)
-#define STACK_BOTTOM (64 * 1024 - STACK_SIZE)
-
-#define CPU_PARAM 0
-#define EMU_PARAM 1
-
-byte tableRAM[8 * 1024];
-byte ppuRAM[(ushort)32 * 1024];
-byte ppuCodeROM[8 * 1024];
-byte ppuDefROM[16 * 1024];
-byte* cpuRAM = NULL;
-byte* cpuROM = NULL;
-unsigned debugStack[32 * 1024];
-unsigned debugSP = 32 * 1024 - 1;
-ushort stacktrace[255];
-byte stacktraceEnd = 0;
-byte stacktraceStart = 0;
-unsigned ppuROMLen = 0;
-unsigned cpuRAMStart = 0;
-unsigned cpuRAMEnd = 0;
-unsigned cpuROMStart = 0;
-unsigned cpuROMEnd = 0;
+
+// Keep at most this many rewind snapshots, using up to this much memory
+#define REWIND_CAPACITY 512
+#define REWIND_MAX_BYTES (64 * 1024 * 1024)
+
 bool printSectionChanges = false;
-unsigned cyclesTakenToRenderAllSprites = 0;
-bool waitUntilCPUInterrupted = false;
-
-void ppuMemWrite(size_t param, ushort address, byte data);
-byte ppuMemRead(size_t param, ushort address);
-void ppuIOWrite(size_t param, ushort port, byte data);
-byte ppuIORead(size_t param, ushort port);
-
-void cpuMemWrite(size_t param, ushort address, byte data);
-byte cpuMemRead(size_t param, ushort address);
-
-Z80Context PPU = {.memRead = ppuMemRead, .memWrite = ppuMemWrite, .ioRead = ppuIORead, .ioWrite = ppuIOWrite, .memParam = CPU_PARAM, .ioParam = CPU_PARAM};
-Z80Context CPU = {.memRead = cpuMemRead, .memWrite = cpuMemWrite, .memParam = CPU_PARAM, .ioParam = CPU_PARAM};
-
-byte* ppuMemMap(ushort address, ushort* relAddress) {
-    if (address < PPU_CODE_END) {
-        *relAddress = address;
-        return ppuCodeROM;
-    } else if (address < PPU_TABLES_END) {
-        *relAddress = address - PPU_TABLES_START;
-        return tableRAM;
-    } else if (address < PPU_DEFS_END) {
-        *relAddress = address - PPU_DEFS_START;
-        return ppuDefROM;
+uint32_t frameBuffer[DISPLAY_PIXELS_X * DISPLAY_PIXELS_Y];
+SDL_Texture* screenTexture = NULL;
+bool headless = false;
+// Set by Ctrl-C or F12 to stop a running machine in the debugger
+_Atomic bool debugRequested = false;
+// The buttons held on the host, kept up to date by the presenter and read by the emulation thread at each VBLANK
+_Atomic byte hostInput = 0;
+InputRecorder inputRecorder;
+InputReplay inputReplay;
+bool recordingInput = false;
+bool replayingInput = false;
+// Times every frame, and holds the emulation to the target rate when there's one
+Pacer pacer;
+// Where the per-frame counters go, when they're being exported
+CountersExport* countersExport = NULL;
+// Frames are copied here at VBLANK and written out by the capture's own thread
+CaptureWriter* capture = NULL;
+
+// Set on the index of the exchanged buffer while it holds a frame the presenter hasn't taken
+#define FRAME_FRESH 4
+
+typedef struct {
+    byte pixels[PIXEL_MAP_SIZE];
+    // Spans changed since the last frame the presenter took
+    uint32_t spans[DISPLAY_PIXELS_Y];
+} PublishedFrame;
+
+// Frames go from the emulation thread to the presenter through a triple buffer. The emulation thread owns the back buffer
+// and the presenter owns the front one, and each swaps its buffer with the latest one, so neither ever waits on the other.
+typedef struct {
+    PublishedFrame buffers[3];
+    unsigned back;
+    unsigned front;
+    _Atomic unsigned latest;
+    _Atomic bool emulationDone;
+    _Atomic bool quitRequested;
+    // Frames replaced before the presenter took them, and refreshes that had no new frame to show
+    unsigned long long published, dropped, presented, duplicated;
+    // Spans of every frame published since the last one the presenter is known to have taken. Only the emulation thread uses it.
+    uint32_t unseenSpans[DISPLAY_PIXELS_Y];
+} FrameExchange;
+FrameExchange frameExchange = { .back = 0, .latest = 1, .front = 2 };
+
+// Hand the frame the beam just finished to the presenter. Called by the emulation thread at VBLANK.
+void publishFrame(Machine* m) {
+    PublishedFrame* frame = &frameExchange.buffers[frameExchange.back];
+    memcpy(frame->pixels, m->latchedPixels, sizeof(m->latchedPixels));
+    // The frame carries the changes of any earlier frames the presenter might not have taken, so whichever one it takes next
+    // brings it fully up to date
+    for (unsigned row = 0; row < DISPLAY_PIXELS_Y; row++) frame->spans[row] = m->latchedSpans[row] | frameExchange.unseenSpans[row];
+    unsigned previous = atomic_exchange(&frameExchange.latest, frameExchange.back | FRAME_FRESH);
+    frameExchange.back = previous & ~FRAME_FRESH;
+    frameExchange.published++;
+    if (previous & FRAME_FRESH) {
+        // The presenter never took the frame we got back, so its changes are still unseen along with this frame's
+        frameExchange.dropped++;
+        for (unsigned row = 0; row < DISPLAY_PIXELS_Y; row++) frameExchange.unseenSpans[row] |= m->latchedSpans[row];
     } else {
-        *relAddress = address - PPU_RAM_START;
-        return ppuRAM;
+        // The presenter took the frame before this one, and with it everything up to there
+        memcpy(frameExchange.unseenSpans, m->latchedSpans, sizeof(m->latchedSpans));
     }
+    memset(m->latchedSpans, 0, sizeof(m->latchedSpans));
 }
 
-byte* cpuMemMap(ushort address, ushort* relAddress) {
-    if (address >= cpuRAMStart && address < cpuRAMEnd) {
-        *relAddress = address - cpuRAMStart;
-        return cpuRAM;
-    } else if (address >= cpuROMStart && address < cpuROMEnd) {
-        *relAddress = address - cpuROMStart;
-        return cpuROM;
-    } else {
-        *relAddress = address - CPU_SPRITE_TABLE_ADDR;
-        return tableRAM;
+// Convert the changed spans of a frame into the frame buffer and upload their bounding box to the streaming texture
+void uploadFrame(PublishedFrame* frame) {
+    unsigned rowMin = DISPLAY_PIXELS_Y;
+    unsigned rowMax = 0;
+    uint32_t allSpans = 0;
+    for (unsigned row = 0; row < DISPLAY_PIXELS_Y; row++) {
+        uint32_t spans = frame->spans[row];
+        if (!spans) continue;
+        byte* in = &frame->pixels[row * DISPLAY_PIXELS_X];
+        uint32_t* out = &frameBuffer[row * DISPLAY_PIXELS_X];
+        // Convert each run of consecutive dirty spans in one go
+        for (uint32_t remaining = spans; remaining;) {
+            unsigned first = __builtin_ctz(remaining);
+            unsigned runLength = __builtin_ctz(~(remaining >> first));
+            convertRow(&in[first * 8], &out[first * 8], runLength * 8);
+            remaining &= ~(((1u << runLength) - 1) << first);
+        }
+        if (row < rowMin) rowMin = row;
+        rowMax = row;
+        allSpans |= spans;
     }
+    if (!allSpans) return;
+    unsigned x = __builtin_ctz(allSpans) * 8;
+    SDL_Rect rect = {
+        .x = x,
+        .y = rowMin,
+        .w = (32 - __builtin_clz(allSpans)) * 8 - x,
+        .h = rowMax - rowMin + 1
+    };
+    SDL_UpdateTexture(screenTexture, &rect, &frameBuffer[rect.y * DISPLAY_PIXELS_X + rect.x], DISPLAY_PIXELS_X * sizeof(uint32_t));
 }
 
-byte cpuMemRead(size_t param, ushort address) {
-    byte* mem = cpuMemMap(address, &address);
-    return mem[address];
+// Show the newest published frame, or the last one again if the emulation thread hasn't published one since. With vsync
+// SDL_RenderPresent waits for the next refresh, which paces the presenter and never the emulation thread.
+void presentFrame(SDL_Renderer* renderer) {
+    int64_t start = pacingNow();
+    // Only the presenter clears FRAME_FRESH so it can't go away between the check and the swap
+    if (atomic_load(&frameExchange.latest) & FRAME_FRESH) {
+        unsigned previous = atomic_exchange(&frameExchange.latest, frameExchange.front);
+        frameExchange.front = previous & ~FRAME_FRESH;
+        uploadFrame(&frameExchange.buffers[frameExchange.front]);
+        frameExchange.presented++;
+    } else frameExchange.duplicated++;
+    SDL_RenderCopy(renderer, screenTexture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+    pacingRecordPresent(&pacer, pacingNow() - start);
 }
 
-void cpuMemWrite(size_t param, ushort address, byte data) {
-    byte* mem = cpuMemMap(address, &address);
-    mem[address] = data;
+byte controllerButton(SDL_Keycode key) {
+    switch (key) {
+        case SDLK_UP: return CONTROLLER_UP;
+        case SDLK_DOWN: return CONTROLLER_DOWN;
+        case SDLK_LEFT: return CONTROLLER_LEFT;
+        case SDLK_RIGHT: return CONTROLLER_RIGHT;
+        case SDLK_z: return CONTROLLER_A;
+        case SDLK_x: return CONTROLLER_B;
+        case SDLK_RETURN: return CONTROLLER_START;
+        case SDLK_BACKSPACE: return CONTROLLER_SELECT;
+        default: return 0;
+    }
 }
 
-byte ppuIORead(size_t param, ushort port) {
-    return 0;
+// The controller state for the frame starting at this VBLANK, from the replay or the host, and recorded if asked for
+byte sampleInput(void* arg, unsigned frame) {
+    byte state;
+    if (replayingInput) {
+        bool wasFinished = inputReplay.finished;
+        state = inputReplayNext(&inputReplay);
+        if (inputReplay.finished && !wasFinished) printf("Input replay ran out at frame %u\n", frame);
+    } else state = atomic_load_explicit(&hostInput, memory_order_relaxed);
+    if (recordingInput) inputRecord(&inputRecorder, state);
+    return state;
 }
 
-void ppuIOWrite(size_t param, ushort port, byte data) {
-    port = port & 0xFF;
-    if (port == 0 && data == 1) {
-        waitUntilCPUInterrupted = false;
-        Z80INT(&CPU, 0);
+// Present frames and handle window events on the main thread until the emulation thread finishes. Events are handled right
+// after each present returns, which is as soon after the refresh as the presenter wakes, and never hold up the emulation.
+void runPresenter(SDL_Renderer* renderer) {
+    SDL_RendererInfo info;
+    bool vsync = SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_PRESENTVSYNC);
+    if (!vsync) printf("Renderer doesn't support vsync, presenting every %d ms\n", MILLIS_PER_FRAME);
+    while (!atomic_load(&frameExchange.emulationDone)) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT) atomic_store(&frameExchange.quitRequested, true);
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F12) atomic_store(&debugRequested, true);
+            else if (event.type == SDL_KEYDOWN) atomic_fetch_or(&hostInput, controllerButton(event.key.keysym.sym));
+            else if (event.type == SDL_KEYUP) atomic_fetch_and(&hostInput, (byte)~controllerButton(event.key.keysym.sym));
+        }
+        presentFrame(renderer);
+        if (!vsync) SDL_Delay(MILLIS_PER_FRAME);
     }
 }
 
-byte ppuMemRead(size_t param, ushort address) {
-    byte* mem = ppuMemMap(address, &address);
-    return mem[address];
+double secondsSince(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
-void ppuMemWrite(size_t param, ushort address, byte data) {
-    byte* mem = ppuMemMap(address, &address);
-    if (param == CPU_PARAM) {
-        if (mem == ppuCodeROM) printf("error: Writing to ppu ROM address %x after PC %x\n", address, PPU.PC);
-        else if (mem == ppuDefROM) printf("error: Writing to ppu def ROM address %x after PC %x\n", address, PPU.PC);
+bool dumpPixelMap(Machine* m, char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return false;
     }
-    mem[address] = data;
+    unsigned written = fwrite(machinePixelMap(m), sizeof(byte), PIXEL_MAP_SIZE, file);
+    fclose(file);
+    return written == PIXEL_MAP_SIZE;
 }
 
-typedef enum { HBLANK, VBLANK, DISPLAY, NONE } VideoSection;
-char* toString(VideoSection section) {
-    switch (section) {
-        case NONE:
-            return "NONE";
-        case HBLANK:
-            return "HBLANK";
-        case VBLANK:
-            return "VBLANK";
-        case DISPLAY:
-            return "DISPLAY";
+RewindBuffer rewindBuffer;
+// Scratch space for the state pushed to and restored from the rewind buffer
+byte* rewindState = NULL;
+unsigned rewindInterval = 0;
+
+// Write the speed of a run as one line of JSON for bench/run.sh to collect
+bool writeBenchJSON(Machine* m, double elapsed, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return false;
     }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long long instructions = m->ppuInstructions + m->cpuInstructions;
+    fprintf(file, "{\"frames\": %u, \"seconds\": %.6f, \"frames_per_second\": %.2f, \"ppu_mhz\": %.2f, \"cpu_mhz\": %.2f, "
+            "\"ppu_instructions\": %llu, \"cpu_instructions\": %llu, \"ns_per_instruction\": %.3f, \"peak_rss_kb\": %ld, "
+            "\"idle_skip\": %s, \"hle\": %s, \"block_cache\": %s}\n", m->frames, elapsed, elapsed > 0 ? m->frames / elapsed : 0.0,
+            elapsed > 0 ? m->sched.ppuCycles / elapsed / 1e6 : 0.0, elapsed > 0 ? m->sched.cpuCycles / elapsed / 1e6 : 0.0,
+            m->ppuInstructions, m->cpuInstructions, instructions ? elapsed * 1e9 / instructions : 0.0, usage.ru_maxrss,
+            m->ppuIdle.enabled ? "true" : "false", m->hle.enabled ? "true" : "false", m->ppuBlocks ? "true" : "false");
+    return fclose(file) == 0;
 }
 
-unsigned coordToVRAMAddr(unsigned x, unsigned y, unsigned scale) {
-    x /= scale;
-    y /= scale;
-    return y * DISPLAY_PIXELS_X + x;
+void printBlockCacheStats(const char* core, BlockCache* cache, unsigned long long instructions) {
+    const BlockCacheStats* stats = blockCacheStats(cache);
+    printf("%s block cache: %llu of %llu instructions from %llu decoded blocks, %llu blocks invalidated\n", core, stats->instructions,
+           instructions, stats->blocksDecoded, stats->invalidations);
+    if (stats->checkedBlocks > 0) printf("%s block cache check: %llu of %llu blocks mismatched\n", core, stats->mismatchedBlocks, stats->checkedBlocks);
 }
 
-void drawPixel(SDL_Renderer* renderer, unsigned x, unsigned y) {
-    uint8_t r, g, b;
-    uint8_t pixel = ppuMemRead(EMU_PARAM, PIXEL_MAP_ADDR + coordToVRAMAddr(x, y, 4));
-    r = (pixel & 0b11);
-    r |= (r << 2) | (r << 4) | (r << 6);
-    g = (pixel & 0b1100) >> 2;
-    g |= (g << 2) | (g << 4) | (g << 6);
-    b = (pixel & 0b110000) >> 4;
-    b |= (b << 2) | (b << 4) | (b << 6);
-    SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-    SDL_RenderDrawPoint(renderer, x, y);
+// The instruction trace and where it's written when the emulator stops or crashes
+Trace* trace = NULL;
+char* tracePath = NULL;
+
+bool dumpTrace(char* path) {
+    if (!trace) {
+        printf("No instruction trace, run with --trace to record one\n");
+        return false;
+    }
+    bool ok = traceDump(trace, path);
+    if (ok) printf("Wrote %llu instructions of trace to %s\n", (unsigned long long)(trace->count < trace->mask + 1 ? trace->count : trace->mask + 1), path);
+    else printf("Couldn't write trace to %s\n", path);
+    return ok;
 }
 
-typedef struct {
-    VideoSection section;
-    unsigned vCounter;
-    unsigned hCounter;
-} VideoState;
-
-void setVideoState(VideoState* state, VideoSection section, unsigned h, unsigned v) {
-    state->section = section;
-    state->vCounter = v;
-    state->hCounter = h;
+// Write the trace from a crash. Everything here has to be async signal safe.
+void dumpTraceOnCrash(int sig) {
+    static const char message[] = "Crashed, writing instruction trace\n";
+    write(STDOUT_FILENO, message, sizeof(message) - 1);
+    traceDump(trace, tracePath);
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-void vStateCycle(VideoState* vstate, SDL_Renderer* renderer) {
-    unsigned hCounter = vstate->hCounter;
-    unsigned vCounter = vstate->vCounter;
-    switch (vstate->section) {
-        case NONE:
-            perror("Unexpected NONE display state\n");
-            break;
-        case DISPLAY:
-            if (hCounter == 800) {
-                setVideoState(vstate, HBLANK, hCounter + 1, vCounter);
-            } else {
-                drawPixel(renderer, hCounter, vCounter);
-                setVideoState(vstate, DISPLAY, hCounter + 1, vCounter);
-            }
-            break;
-        case HBLANK:
-            if (hCounter == 1056) {
-                if (vCounter == 599) {
-                    setVideoState(vstate, VBLANK, 0, vCounter + 1);
-                } else {
-                    setVideoState(vstate, DISPLAY, 0, vCounter + 1);
-                }
-            } else {
-                setVideoState(vstate, HBLANK, hCounter + 1, vCounter);
-            }
-            break;
-        case VBLANK:
-            if (vstate->hCounter == 1056) {
-                vstate->hCounter = 0;
-                if (vstate->vCounter == 628) {
-                    setVideoState(vstate, DISPLAY, 0, 0);
-                } else {
-                    setVideoState(vstate, VBLANK, 0, vCounter + 1);
-                }
-            } else {
-                setVideoState(vstate, VBLANK, hCounter + 1, vCounter);
-            }
-            break;
-    }
+bool saveSnapshot(Machine* m, char* path) {
+    size_t len = machineStateSize(m);
+    byte* state = malloc(len);
+    if (!state) return false;
+    saveMachineState(m, state);
+    bool ok = snapshotWriteFile(path, state, len);
+    free(state);
+    if (ok) printf("Saved frame %d to %s\n", m->frames, path);
+    else printf("Couldn't save snapshot to %s\n", path);
+    return ok;
 }
 
-void execute(Z80Context* ctx) {
-    unsigned PC = ctx->PC;
-    if (ctx == &PPU && PC == 0x1f5a && cyclesTakenToRenderAllSprites > 1) {
-        printf("PPU took %d cycles to render all sprites\n", cyclesTakenToRenderAllSprites);
-        cyclesTakenToRenderAllSprites = 0;
-    }
-    stacktrace[stacktraceEnd++] = PC;
-    if (stacktraceEnd <= stacktraceStart) stacktraceStart++;
-
-    if (ctx == &PPU) {
-        byte opc1 = ppuMemRead(EMU_PARAM, PC);
-        byte opc2 = ppuMemRead(EMU_PARAM, PC + 1);
-        switch (opc1) {
-            // RETI
-            case 0xED: {
-                if (opc2 == 0x4D) {
-                    ushort SP = ctx->R1.wr.SP;
-                    ushort retAddr = ppuMemRead(EMU_PARAM, SP) | (ppuMemRead(EMU_PARAM, SP + 1) << 8);
-                    if (retAddr >= ppuROMLen) printf("Returning from interrupt with return address outside PPU code (%x)\n", retAddr);
-                }
-                break;
-            }
-            case 0xDD:
-            case 0xFD:
-                if (opc2 == 0xE1 ) {
-                    // POP IX
-                    // POP IY
-                    debugSP += 2;
-                } else if (opc2 == 0xE5) {
-                    // PUSH IX
-                    // PUSH IY
-                    debugStack[--debugSP] = PC;
-                    debugStack[--debugSP] = PC;
-                }
-                break;
-            case 0b11000001:
-            case 0b11010001:
-            case 0b11100001:
-            case 0b11110001:
-                // POP qq
-                debugSP += 2;
-                break;
-            case 0b11000101:
-            case 0b11010101:
-            case 0b11100101:
-            case 0b11110101:
-                debugStack[--debugSP] = PC;
-                debugStack[--debugSP] = PC;
-                break;
+bool loadSnapshot(Machine* m, char* path) {
+    size_t len = 0;
+    byte* state = snapshotReadFile(path, &len);
+    if (!state) return false;
+    bool ok = loadMachineState(m, state, len);
+    free(state);
+    if (ok) printf("Loaded frame %d from %s\n", m->frames, path);
+    return ok;
+}
 
-        }
+bool rewindSnapshots(Machine* m, unsigned steps) {
+    bool ok = rewindTo(&rewindBuffer, steps, rewindState) && loadMachineState(m, rewindState, machineStateSize(m));
+    if (ok) printf("Rewound to frame %d\n", m->frames);
+    else printf("Can't rewind %d snapshots, %d available\n", steps, rewindAvailable(&rewindBuffer));
+    return ok;
+}
+
+// A second Ctrl-C before the debugger has taken the first one quits as usual
+void requestDebugger(int sig) {
+    if (atomic_exchange(&debugRequested, true)) {
+        signal(sig, SIG_DFL);
+        raise(sig);
     }
-    Z80Execute(ctx);
 }
 
-void executeAll() {
-    execute(&PPU);
-    execute(&CPU);
+// Where the debugger is stopped and what it's running to
+typedef struct {
+    bool waitForInput;
+    VideoSection waitFor;
+    // The section at the previous step, to spot the beam entering waitFor
+    VideoSection lastSection;
+    unsigned instrsToSkip;
+    int instrToSkipTo;
+    bool breakpoints[64 * 1024];
+    unsigned breakpointCount;
+    unsigned watchpointCount;
+} Debugger;
+
+typedef struct EmulationRun EmulationRun;
+// Advance the machine by one step and return the dots the beam moved. A step function can set prevSection to the current
+// section when it moved the beam somewhere without crossing an edge, e.g. by loading a snapshot.
+typedef unsigned (*StepFunction)(EmulationRun* run, VideoSection* prevSection);
+
+// Everything the emulation loop shares with main
+struct EmulationRun {
+    Machine* machine;
+    StepFunction step;
+    Debugger debugger;
+    unsigned framesToRun;
+    FILE* crcLogFile;
+    int status;
+};
+
+unsigned releaseStep(EmulationRun* run, VideoSection* prevSection);
+unsigned debugStep(EmulationRun* run, VideoSection* prevSection);
+
+void enterDebugger(EmulationRun* run) {
+    Debugger* dbg = &run->debugger;
+    dbg->waitForInput = true;
+    dbg->waitFor = NONE;
+    dbg->lastSection = run->machine->vState.section;
+    dbg->instrsToSkip = 0;
+    dbg->instrToSkipTo = -1;
+    run->machine->waitUntilCPUInterrupted = false;
+    run->step = debugStep;
+    // The stack trace comes from the instruction trace, so it's recorded while debugging
+    if (trace) machineSetTrace(run->machine, trace);
 }
 
-void printRegisters(Z80Context* cpu) {
-    Z80Regs regs = cpu->R1;
-    printf("%s Regs:\n\tA: %d, F: %d, AF: %d\n\tB: %d, C: %d, BC: %d\n\tD: %d, E: %d, DE: %d\n\tH: %d, L: %d, HL: %d\n\tIX: %d\n\tIY: %d\n\tSP: %d\n", cpu == &PPU ? "PPU" : "CPU", regs.br.A, regs.br.F, regs.wr.AF, regs.br.B, regs.br.C, regs.wr.BC, regs.br.D, regs.br.E, regs.wr.DE, regs.br.H, regs.br.L, regs.wr.HL, regs.wr.IX, regs.wr.IY, regs.wr.SP);
+// Go back to running at full speed. Unless --trace wants every instruction, the trace is detached so the cores can take the
+// lean path again.
+void leaveDebugger(EmulationRun* run) {
+    run->step = releaseStep;
+    if (!tracePath) machineSetTrace(run->machine, NULL);
 }
 
-void printStackTrace() {
-    printf("Stack trace:\n");
-    byte idx = stacktraceEnd;
-    byte prev = 0;
-    byte repeated = 0;
-    while (idx != stacktraceStart) {
-        byte b = stacktrace[idx--];
-        if (b == prev)
-            repeated++;
-        else if (repeated > 1) {
-            printf("repeated %d times\n", repeated);
-            repeated = 0;
-        } else
-            printf("%x\n", b);
-        prev = b;
-    }
-    if (repeated > 1) printf("repeated %d times\n", repeated);
-    printRegisters(&PPU);
+// Run whole slices with no debugger checks. The only instrumentation left is what's attached to the machine.
+unsigned releaseStep(EmulationRun* run, VideoSection* prevSection) {
+    if (atomic_load_explicit(&debugRequested, memory_order_relaxed)) {
+        atomic_store(&debugRequested, false);
+        printf("Stopped in the debugger\n");
+        enterDebugger(run);
+        return 0;
+    }
+    return runSlice(run->machine, ULLONG_MAX);
 }
 
-// Parse a mem map file in the form of any number of lines with a start address, end address (exclusive) and a type:
-// x,x+y,type
-//
-// Where type is "ram" or "rom".
-bool readCPUMemMapFile(FILE* file) {
-    char fileBytes[128];
-    unsigned bytesRead = fread(fileBytes, sizeof(byte), sizeof(fileBytes), file);
-    // We need to add a null terminator to the end so should have read one byte fewer than the total number
-    if (bytesRead >= sizeof(fileBytes)) return false;
-    fileBytes[bytesRead] = 0;
-    char* rest = fileBytes;
-    char* token;
-    while ((token = strtok_r(rest, "\n", &rest))) {
-        char* rest2 = token;
-        char* tok2 = strtok_r(rest2, ",", &rest2);
-        if (!tok2) {
-            printf("Unrecognised mem map format: %s\n", rest2);
-            return false;
-        }
-        if (strcmp(tok2, "defs") == 0) {
-            // Load sprites
-            char* spritesPath = strtok_r(rest2, ",", &rest2);
-            if (!spritesPath) {
-                printf("Unrecognised mem map format: %s\n", rest2);
-                return false;
-            }
-            FILE* spritesFile = fopen(spritesPath, "rb");
-            if (!spritesFile) {
-                printf("Can't open %s\n", spritesPath);
-                return false;
-            }
-            unsigned bytesRead = fread(ppuDefROM, sizeof(byte), sizeof(ppuDefROM), spritesFile);
-            fclose(spritesFile);
-            printf("Read %d bytes from %s\n", bytesRead, spritesPath);
-        } else {
-            unsigned start = strtol(tok2, NULL, 10);
+void toggleWatchpoint(EmulationRun* run, ushort address, byte core) {
+    Machine* m = run->machine;
+    m->watchpoints[address] ^= core;
+    bool set = m->watchpoints[address] & core;
+    run->debugger.watchpointCount += set ? 1 : -1;
+    machineSetWatching(m, run->debugger.watchpointCount > 0);
+    printf("%s watchpoint on %s writes to %x\n", set ? "Set" : "Cleared", core == WATCH_CPU ? "CPU" : "PPU", address);
+}
 
-            tok2 = strtok_r(rest2, ",", &rest2);
-            if (!tok2) {
-                printf("Unrecognised mem map format: %s\n", rest2);
-                return false;
+// Read and carry out one debugger command
+unsigned debugPrompt(EmulationRun* run, VideoSection* prevSection) {
+    Machine* m = run->machine;
+    Debugger* dbg = &run->debugger;
+    unsigned dots = 0;
+    char decode[20];
+    char dump[20];
+    Z80Debug(&m->PPU, dump, decode);
+    printf("PPU: PC %x %s (%s)\n", m->PPU.PC, decode, dump);
+    Z80Debug(&m->CPU, dump, decode);
+    printf("CPU: PC %x %s (%s)\n", m->CPU.PC, decode, dump);
+    char cmd[256];
+    if (fgets(cmd, sizeof(cmd), stdin) != NULL) {
+        if (strncmp(cmd, "ss ", 3) == 0 || strncmp(cmd, "ls ", 3) == 0) {
+            // Save or load a snapshot file
+            cmd[strcspn(cmd, "\n")] = 0;
+            if (cmd[0] == 's') saveSnapshot(m, cmd + 3);
+            else loadSnapshot(m, cmd + 3);
+            // A loaded beam position isn't an edge
+            *prevSection = m->vState.section;
+        } else if (strncmp(cmd, "t ", 2) == 0) {
+            // Write the instruction trace to a file
+            cmd[strcspn(cmd, "\n")] = 0;
+            dumpTrace(cmd + 2);
+        } else if (strncmp(cmd, "rw", 2) == 0) {
+            int steps = strlen(cmd) > 3 ? atoi(cmd + 2) : 1;
+            if (rewindInterval == 0) printf("Rewinding needs --rewind\n");
+            else if (steps > 0) rewindSnapshots(m, steps);
+            *prevSection = m->vState.section;
+        } else if (strcmp(cmd, "c\n") == 0) {
+            printf("Continuing\n");
+            // Without breakpoints or watchpoints there's nothing to check, so run at full speed until the debugger is wanted again
+            if (dbg->breakpointCount == 0 && dbg->watchpointCount == 0) leaveDebugger(run);
+            else dbg->waitForInput = false;
+        } else if (strcmp(cmd, "v\n") == 0) {
+            printf("Waiting until vblank\n");
+            dbg->waitForInput = false;
+            dbg->waitFor = VBLANK;
+        } else if (strcmp(cmd, "h\n") == 0) {
+            printf("Waiting until hblank\n");
+            dbg->waitForInput = false;
+            dbg->waitFor = HBLANK;
+        } else if (strcmp(cmd, "r\n") == 0) {
+            printRegisters(m, &m->PPU);
+            printRegisters(m, &m->CPU);
+        } else if (strcmp(cmd, "s\n") == 0) {
+            Z80Regs regs = m->PPU.R1;
+            printf("Stack:\n");
+            unsigned sp = regs.wr.SP;
+            unsigned debugSPCopy = m->debugSP;
+            while (sp < STACK_TOP) {
+                byte b = ppuMemRead((size_t)m, sp);
+                printf("\t%d (pushed by %x)\n", b, m->debugStack[debugSPCopy++]);
+                sp++;
             }
-            unsigned end = strtol(tok2, NULL, 10);
-
-            char* type = strtok_r(rest2, ",", &rest2);
-            if (!type) {
-                printf("Unrecognised mem map format: %s\n", rest2);
-                return false;
+        } else if (strcmp(cmd, "f\n") == 0) {
+            byte flags = m->PPU.R1.br.F;
+            printf("Flags:\n");
+            printf("\tC: %d\n\tN: %d\n\tPV: %d\n\tHC: %d\n\tZ: %d\n\tS: %d\n", (flags & F_C) != 0, (flags & F_N) != 0, (flags & F_PV) != 0, (flags & F_H) != 0, (flags & F_Z)!= 0, (flags & F_S) != 0);
+        } else if (strcmp(cmd, "\n") == 0) {
+            dots = stepInstruction(m);
+        } else if (cmd[0] == 'j' && strlen(cmd) > 1) {
+            int toSkip = atoi(cmd+1);
+            if (toSkip > 0) {
+                dbg->instrsToSkip = toSkip;
+                printf("Executing %d instructions\n", dbg->instrsToSkip);
             }
-
-            unsigned len = end - start;
-            if (strcmp(type, "ram") == 0) {
-                if (cpuRAM != NULL) free(cpuRAM);
-                cpuRAM = malloc(len * sizeof(byte));
-                if (cpuRAM == NULL) {
-                    printf("Couldn't allocate %d bytes for CPU RAM\n", len);
-                    return false;
-                }
-                memset(cpuRAM, 0, len * sizeof(byte));
-                cpuRAMStart = start;
-                cpuRAMEnd = end;
-            } else if (strcmp(type, "rom") == 0) {
-                if (cpuROM != NULL) free(cpuROM);
-                cpuROM = malloc(len * sizeof(byte));
-                if (cpuROM == NULL) {
-                    printf("Couldn't allocate %d bytes for CPU ROM\n", len);
-                    return false;
-                }
-                memset(cpuROM, 0, len * sizeof(byte));
-                cpuROMStart = start;
-                cpuROMEnd = end;
-            } else {
-                printf("Unrecognised memory type from mem map: %s\n", type);
-                return false;
+        } else if (cmd[0] == 'b' && strlen(cmd) > 1) {
+            // Toggle a breakpoint on a PPU address
+            unsigned addr = strtoul(cmd + 1, NULL, 16) & 0xFFFF;
+            dbg->breakpoints[addr] = !dbg->breakpoints[addr];
+            dbg->breakpointCount += dbg->breakpoints[addr] ? 1 : -1;
+            printf("%s breakpoint at %x\n", dbg->breakpoints[addr] ? "Set" : "Cleared", addr);
+        } else if ((strncmp(cmd, "wp", 2) == 0 || strncmp(cmd, "wc", 2) == 0) && strlen(cmd) > 2) {
+            // Toggle a watchpoint on writes to a PPU or CPU address
+            toggleWatchpoint(run, strtoul(cmd + 2, NULL, 16) & 0xFFFF, cmd[1] == 'c' ? WATCH_CPU : WATCH_PPU);
+        } else if (cmd[0] == 'w' && strlen(cmd) > 1) {
+            int i = strtol(cmd + 1, NULL, 16);
+            if (i > -1) {
+                dbg->instrToSkipTo = i;
+                printf("Skipping to %x\n", dbg->instrToSkipTo);
+            }
+        } else if (strcmp(cmd, "d\n") == 0) {
+            printf("Waiting until display\n");
+            dbg->waitForInput = false;
+            dbg->waitFor = DISPLAY;
+        } else if (cmd[0] == 'm' && strlen(cmd) > 1) {
+            int addr = strtol(cmd + 1, NULL, 16);
+            if (addr > -1) {
+                byte b = ppuMemRead((size_t)m, addr);
+                printf("Byte at addr %x is %d\n", addr, b);
             }
+        } else if (strncmp(cmd, "dv", 2) == 0 && (cmd[2] == '\n' || cmd[2] == ' ')) {
+            // Write the pixel map as raw bytes, which tools/capture.c can turn in to an image
+            cmd[strcspn(cmd, "\n")] = 0;
+            char* path = cmd[2] == ' ' ? cmd + 3 : "vram.bin";
+            if (dumpPixelMap(m, path)) printf("Wrote the pixel map to %s\n", path);
+        } else if (strcmp(cmd, "i\n") == 0) {
+            m->waitUntilCPUInterrupted = true;
+        } else {
+            printf("Unrecognised command\n");
         }
+    } else {
+        // No more commands, so carry on without the debugger
+        leaveDebugger(run);
     }
-    return true;
+    return dots;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 5) {
-        printf("Expected ppu ROM path, debug, cpu mem map and cpu ROM path\n");
-        return 1;
+// Step the PPU one instruction at a time with the shadow stack, and stop for breakpoints, watchpoints and the running commands
+unsigned debugStep(EmulationRun* run, VideoSection* prevSection) {
+    Machine* m = run->machine;
+    Debugger* dbg = &run->debugger;
+    VideoSection section = m->vState.section;
+    if (dbg->waitFor == section && dbg->lastSection != section) {
+        dbg->waitFor = NONE;
+        dbg->waitForInput = true;
     }
-
-    memset(ppuCodeROM, 0, sizeof(ppuCodeROM));
-    memset(tableRAM, 0, sizeof(tableRAM));
-    memset(ppuRAM, 0x00, sizeof(ppuRAM));
-    memset(ppuDefROM, 0, sizeof(ppuDefROM));
-    memset(stacktrace, 0, sizeof(stacktrace));
-
-    char* ppuROMPath = argv[1];
-    printf("Reading %s\n", ppuROMPath);
-    FILE* ppuROMFile = fopen(ppuROMPath, "rb");
-    FILE* vramDumpFile = NULL;
-    if (!ppuROMFile) {
-        printf("Couldn't open %s\n", ppuROMPath);
-        return 1;
+    dbg->lastSection = section;
+    if (atomic_exchange(&debugRequested, false)) enterDebugger(run);
+    if (dbg->waitForInput && dbg->instrsToSkip == 0 && dbg->instrToSkipTo == -1 && !m->waitUntilCPUInterrupted) {
+        return debugPrompt(run, prevSection);
     }
-    ppuROMLen = fread(ppuCodeROM, sizeof(byte), sizeof(ppuCodeROM), ppuROMFile);
-    printf("Read %d PPU ROM bytes\n", ppuROMLen);
-    fclose(ppuROMFile);
 
-    char *cpuMemMapPath = argv[3];
-    printf("Reading %s\n", cpuMemMapPath);
-    FILE* cpuMemMapFile = fopen(cpuMemMapPath, "r");
-    if (!cpuMemMapFile) {
-        printf("Couldn't open %s\n", cpuMemMapPath);
-        return 1;
+    unsigned dots = stepInstruction(m);
+    if (dbg->instrsToSkip > 0) dbg->instrsToSkip--;
+    if (dbg->instrToSkipTo >= 0 && dbg->instrToSkipTo == m->PPU.PC) dbg->instrToSkipTo = -1;
+    if (dbg->breakpoints[m->PPU.PC]) {
+        printf("Breakpoint at %x\n", m->PPU.PC);
+        enterDebugger(run);
     }
-    if (!readCPUMemMapFile(cpuMemMapFile)) return 1;
-    if (cpuROMEnd == 0){
-        printf("No CPU ROM mapped\n");
-        return 1;
+    if (m->watchpoint.hit) {
+        printf("Watchpoint: %s wrote %d to %x after PC %x\n", m->watchpoint.cpu ? "CPU" : "PPU", m->watchpoint.value, m->watchpoint.address, m->watchpoint.pc);
+        m->watchpoint.hit = false;
+        enterDebugger(run);
     }
+    return dots;
+}
 
-    char* cpuROMPath = argv[4];
-    printf("Reading %s\n", cpuROMPath);
-    FILE* cpuROMFile = fopen(cpuROMPath, "rb");
-    if (!cpuROMFile) {
-        printf("Couldn't open %s\n", cpuROMPath);
-        return 1;
-    }
-    unsigned read = fread(cpuROM, sizeof(byte), cpuROMEnd - cpuROMStart, cpuROMFile);
-    printf("Read %d CPU ROM bytes\n", read);
-    fclose(cpuROMFile);
+// Run the machine until the frame limit, a quit from the presenter or an error. When there's a window this runs on its own
+// thread and publishes a frame for the presenter at every VBLANK.
+void* emulate(void* arg) {
+    EmulationRun* run = arg;
+    Machine* m = run->machine;
+    unsigned renderCycles = 0;
 
-    if (SDL_SetHintWithPriority(SDL_HINT_NO_SIGNAL_HANDLERS, "1", SDL_HINT_OVERRIDE) == SDL_FALSE) {
-        printf("Failed to set SDL hint\n");
-        return 1;
+    while (true) {
+        VideoSection prevSection = m->vState.section;
+        unsigned dots = run->step(run, &prevSection);
+        bool debug = run->step == debugStep;
+        bool frameDone = machineEdge(m, prevSection);
+        if (m->vState.section == HBLANK && prevSection != HBLANK) {
+            if (debug && printSectionChanges) printf("HBLANK triggered\n");
+        } else if (m->vState.section == DISPLAY && prevSection != DISPLAY) {
+            //printf("PPU was rendering for %d cycles\n", renderCycles);
+            renderCycles = 0;
+        } else if (frameDone) {
+            // Frames are paced from the VBLANK edge, and only while running freely
+            bool show = true;
+            if (debug) pacingReset(&pacer);
+            else show = pacingFrameDone(&pacer);
+            // The beam has latched every row of this frame so it can be shown, unless the emulation is catching up. The
+            // latched spans carry over to the next frame that is published.
+            if (!headless && show) publishFrame(m);
+            if (countersExport) {
+                FrameCounters counters;
+                machineCollectCounters(m, &counters);
+                counters.hostNs = pacer.lastEmulationNs;
+                countersAddFrame(countersExport, m->frames, &counters);
+            }
+            if (rewindInterval > 0 && m->frames % rewindInterval == 0) {
+                saveMachineState(m, rewindState);
+                rewindPush(&rewindBuffer, rewindState);
+            }
+            if (capture) captureFrame(capture, m->frames, machinePixelMap(m));
+            if (run->crcLogFile) fprintf(run->crcLogFile, "%u %08x\n", m->frames, crc32(machinePixelMap(m), PIXEL_MAP_SIZE));
+            if (run->framesToRun > 0 && m->frames >= run->framesToRun) break;
+            if (atomic_load(&frameExchange.quitRequested)) break;
+            if (debug && printSectionChanges) printf("VBLANK triggered\n");
+        }
+
+        if (prevSection == HBLANK || prevSection == VBLANK)
+            renderCycles += dots;
+
+        if (machineStackOverflowed(m)) {
+            run->status = 1;
+            break;
+        }
     }
 
-    int windowWidth = DISPLAY_PIXELS_X * 4;
-    int windowHeight = DISPLAY_PIXELS_Y * 4;
-    printf("pixels_x: %d, pixels_y: %d\n", windowWidth, windowHeight);
+    atomic_store(&frameExchange.emulationDone, true);
+    return NULL;
+}
 
-    SDL_Init(SDL_INIT_VIDEO);
-    struct SDL_Window* window = SDL_CreateWindow("Console", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth, windowHeight, SDL_WINDOW_BORDERLESS);
-    int width = 0, height = 0;
-    SDL_GetWindowSizeInPixels(window, &width, &height);
-    printf("%d x %d window created\n", width, height);
-    struct SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
+// One headless run of a cartridge in a batch, and what came of it
+typedef struct {
+    char ppuROMPath[PATH_MAX];
+    char memMapPath[PATH_MAX];
+    char cpuROMPath[PATH_MAX];
+    unsigned frames;
+    bool ok;
+    unsigned framesRun;
+    uint32_t pixelMapCRC;
+    double seconds;
+} BatchJob;
+
+// Jobs are independent and each runs for many frames, so the workers only need to share the index of the next job to take
+typedef struct {
+    BatchJob* jobs;
+    unsigned jobCount;
+    _Atomic unsigned nextJob;
+} BatchQueue;
+
+void runBatchJob(BatchJob* job) {
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    Machine* m = machineCreate(job->ppuROMPath, job->memMapPath, job->cpuROMPath);
+    if (!m) return;
+    machineReset(m);
+    job->ok = true;
+    while (m->frames < job->frames && job->ok) job->ok = machineRunFrame(m);
+    job->framesRun = m->frames;
+    job->pixelMapCRC = crc32(machinePixelMap(m), PIXEL_MAP_SIZE);
+    machineDestroy(m);
+    job->seconds = secondsSince(&startTime);
+}
 
-    Z80RESET(&PPU);
-    Z80RESET(&CPU);
+void* batchWorker(void* arg) {
+    BatchQueue* queue = arg;
+    unsigned i;
+    while ((i = atomic_fetch_add(&queue->nextJob, 1)) < queue->jobCount) runBatchJob(&queue->jobs[i]);
+    return NULL;
+}
 
-    // Give PPU a few cycles to set up stack
-    Z80ExecuteTStates(&PPU, 60);
+// Read a batch file with one job per line in the form:
+// ppu_rom mem_map cpu_rom frames
+//
+// Blank lines and lines starting with # are skipped
+BatchJob* readBatchFile(char* path, unsigned* count) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    BatchJob* jobs = NULL;
+    unsigned capacity = 0;
+    *count = 0;
+    char* line = NULL;
+    size_t lineCap = 0;
+    bool ok = true;
+    for (unsigned lineNum = 1; ok && getline(&line, &lineCap, file) != -1; lineNum++) {
+        char* start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == 0) continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            BatchJob* grown = realloc(jobs, capacity * sizeof(BatchJob));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            jobs = grown;
+        }
+        BatchJob* job = &jobs[*count];
+        memset(job, 0, sizeof(BatchJob));
+        char format[64];
+        snprintf(format, sizeof(format), "%%%ds %%%ds %%%ds %%u", PATH_MAX - 1, PATH_MAX - 1, PATH_MAX - 1);
+        if (sscanf(start, format, job->ppuROMPath, job->memMapPath, job->cpuROMPath, &job->frames) != 4 || job->frames == 0) {
+            printf("%s:%d: expected ppu ROM, mem map, cpu ROM and a frame count\n", path, lineNum);
+            ok = false;
+        } else (*count)++;
+    }
+    free(line);
+    fclose(file);
+    if (ok && *count == 0) printf("No jobs in %s\n", path);
+    if (!ok || *count == 0) {
+        free(jobs);
+        return NULL;
+    }
+    return jobs;
+}
 
-    VideoState vState = { .section = DISPLAY, .hCounter = 0, .vCounter = 0 };
+// Run every job of a batch file headless on a pool of worker threads, by default one per online core
+int runBatch(int argc, char** argv) {
+    unsigned threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        } else {
+            printf("Unrecognised option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    BatchQueue queue = { .nextJob = 0 };
+    if (!(queue.jobs = readBatchFile(argv[2], &queue.jobCount))) return 1;
+    if (threads == 0) threads = 1;
+    if (threads > queue.jobCount) threads = queue.jobCount;
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    unsigned started = 0;
+    while (workers && started < threads && pthread_create(&workers[started], NULL, batchWorker, &queue) == 0) started++;
+    // Whatever couldn't get a thread of its own is run here
+    if (started == 0) batchWorker(&queue);
+    for (unsigned i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    double elapsed = secondsSince(&startTime);
+
+    unsigned failed = 0;
+    unsigned long long totalFrames = 0;
+    for (unsigned i = 0; i < queue.jobCount; i++) {
+        BatchJob* job = &queue.jobs[i];
+        totalFrames += job->framesRun;
+        if (!job->ok) failed++;
+        printf("job %d: %s %s %s: %s, %d frames, pixel map crc %08x, %.3fs\n", i, job->ppuROMPath, job->memMapPath, job->cpuROMPath,
+               job->ok ? "ok" : "failed", job->framesRun, job->pixelMapCRC, job->seconds);
+    }
+    printf("Ran %d jobs on %d threads in %.3fs (%.1f frames/s), %d failed\n", queue.jobCount, started ? started : 1, elapsed,
+           elapsed > 0 ? totalFrames / elapsed : 0.0, failed);
+    free(queue.jobs);
+    return failed ? 1 : 0;
+}
 
-    unsigned renderCycles = 0;
-    bool debug = argc > 2 && strcmp(argv[2], "y") == 0;
-    bool waitForInput = true;
-    VideoSection waitFor = NONE;
-    unsigned instrsToSkipForDebug = 0;
-    int instrToSkipTo = -1;
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "--batch") == 0) return runBatch(argc, argv);
+    if (argc < 5) {
+        printf("Expected ppu ROM path, debug, cpu mem map and cpu ROM path\n");
+        printf("Options: --headless, --frames <n>, --dump-pixels <path>, --crc-log <path>, --profile <ppu elf>, --profile-cpu <cpu elf>\n");
+        printf("         --load-snapshot <path>, --rewind <frames between snapshots>, --hle, --hle-check, --no-idle-skip\n");
+        printf("         --block-cache, --block-cache-check to run decoded blocks, or compare them against libz80\n");
+        printf("         --trace <path> [--trace-records <n>] to record instructions and write them when the run stops or crashes\n");
+        printf("         --bench-json <path> to write the speed of the run as JSON\n");
+        printf("         --record-input <path>, --replay-input <path> to record the controller every frame or play a recording back\n");
+        printf("         --counters <path or unix:socket path> [--counters-format csv|jsonl] [--counters-every <n>] to export what each frame did\n");
+        printf("         --fps <n> to pace emulation to n frames/s, 0 for as fast as possible, --frame-times <path> to write frame time histograms\n");
+        printf("         --capture <path> [--capture-buffers <n>] to write every frame losslessly, buffering n frames for the writer\n");
+        printf("Or --batch <jobs file> [--threads <n>] to run many cartridges headless\n");
+        return 1;
+    }
 
-    while (true) {
-        if (debug && waitForInput && instrsToSkipForDebug == 0 && instrToSkipTo == -1 && !waitUntilCPUInterrupted) {
-            char decode[20];
-            char dump[20];
-            Z80Debug(&PPU, dump, decode);
-            printf("PPU: PC %x %s (%s)\n", PPU.PC, decode, dump);
-            Z80Debug(&CPU, dump, decode);
-            printf("CPU: PC %x %s (%s)\n", CPU.PC, decode, dump);
-            char cmd[20];
-            if (fgets(cmd, sizeof(cmd), stdin) != NULL) {
-                if (strcmp(cmd, "c\n") == 0) {
-                    printf("Continuing\n");
-                    debug = false;
-                } if (strcmp(cmd, "v\n") == 0) {
-                    printf("Waiting until vblank\n");
-                    waitForInput = false;
-                    waitFor = VBLANK;
-                } else if (strcmp(cmd, "h\n") == 0) {
-                    printf("Waiting until hblank\n");
-                    waitForInput = false;
-                    waitFor = HBLANK;
-                } else if (strcmp(cmd, "r\n") == 0) {
-                    printRegisters(&PPU);
-                    printRegisters(&CPU);
-                } else if (strcmp(cmd, "s\n") == 0) {
-                    Z80Regs regs = PPU.R1;
-                    printf("Stack:\n");
-                    unsigned sp = regs.wr.SP;
-                    unsigned debugSPCopy = debugSP;
-                    while (sp < STACK_TOP) {
-                        byte b = ppuMemRead(EMU_PARAM, sp);
-                        printf("\t%d (pushed by %x)\n", b, debugStack[debugSPCopy++]);
-                        sp++;
-                    }
-                } else if (strcmp(cmd, "f\n") == 0) {
-                    byte flags = PPU.R1.br.F;
-                    printf("Flags:\n");
-                    printf("\tC: %d\n\tN: %d\n\tPV: %d\n\tHC: %d\n\tZ: %d\n\tS: %d\n", (flags & F_C) != 0, (flags & F_N) != 0, (flags & F_PV) != 0, (flags & F_H) != 0, (flags & F_Z)!= 0, (flags & F_S) != 0);
-                } else if (strcmp(cmd, "\n") == 0) {
-                    executeAll();
-                } else if (cmd[0] == 'j' && strlen(cmd) > 1) {
-                    int toSkip = atoi(cmd+1);
-                    if (toSkip > 0) {
-                        instrsToSkipForDebug = toSkip;
-                        printf("Executing %d instructions\n", instrsToSkipForDebug);
-                    }
-                } else if (cmd[0] == 'w' && strlen(cmd) > 1) {
-                    int i = strtol(cmd + 1, NULL, 16);
-                    if (i > -1) {
-                        instrToSkipTo = i;
-                        printf("Skipping to %x\n", instrToSkipTo);
-                    }
-                } else if (strcmp(cmd, "d\n") == 0) {
-                    printf("Waiting until display\n");
-                    waitForInput = false;
-                    waitFor = DISPLAY;
-                } else if (cmd[0] == 'm' && strlen(cmd) > 1) {
-                    int addr = strtol(cmd + 1, NULL, 16);
-                    if (addr > -1) {
-                        byte b = ppuMemRead(EMU_PARAM, addr);
-                        printf("Byte at addr %x is %d\n", addr, b);
-                    }
-                } else if (strcmp(cmd, "dv\n") == 0) {
-                    if (!vramDumpFile) {
-                        vramDumpFile = fopen("vram.log", "w");
-                    }
-                    if (vramDumpFile) {
-                        for (unsigned y = 0; y < DISPLAY_PIXELS_Y; y++) {
-                            for (unsigned x = 0; x < DISPLAY_PIXELS_X; x++) {
-                                fprintf(vramDumpFile, "|%x|", ppuMemRead(EMU_PARAM, PIXEL_MAP_ADDR + coordToVRAMAddr(x, y, 1)));
-                            }
-                            fprintf(vramDumpFile, "\n");
-                        }
-                    } else printf("Couldn't open vram.log\n");
-                    fclose(vramDumpFile);
-                    vramDumpFile = NULL;
-                } else if (strcmp(cmd, "i\n") == 0) {
-                    waitUntilCPUInterrupted = true;
-                } else {
-                    printf("Unrecognised command\n");
-                }
+    // Run until this many frames have been emulated, or forever if 0
+    unsigned framesToRun = 0;
+    char* pixelDumpPath = NULL;
+    char* crcLogPath = NULL;
+    char* snapshotPath = NULL;
+    char* benchJSONPath = NULL;
+    char* recordInputPath = NULL;
+    char* replayInputPath = NULL;
+    char* frameTimesPath = NULL;
+    char* countersPath = NULL;
+    char* capturePath = NULL;
+    unsigned captureBuffers = CAPTURE_DEFAULT_BUFFERS;
+    CountersFormat countersFormat = COUNTERS_CSV;
+    unsigned countersInterval = 1;
+    // Paced to the console's rate in a window and unpaced headless, unless asked otherwise
+    int fps = -1;
+    bool useHLE = false;
+    bool checkHLE = false;
+    bool idleSkip = true;
+    bool useBlockCache = false;
+    bool checkBlockCache = false;
+    size_t traceRecords = TRACE_DEFAULT_RECORDS;
+    CoreProfile* ppuProfile = NULL;
+    CoreProfile* cpuProfile = NULL;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            framesToRun = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--dump-pixels") == 0 && i + 1 < argc) {
+            pixelDumpPath = argv[++i];
+        } else if (strcmp(argv[i], "--crc-log") == 0 && i + 1 < argc) {
+            crcLogPath = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            if (!(ppuProfile = profilerCreate("PPU", argv[++i]))) return 1;
+        } else if (strcmp(argv[i], "--profile-cpu") == 0 && i + 1 < argc) {
+            if (!(cpuProfile = profilerCreate("CPU", argv[++i]))) return 1;
+        } else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "--hle") == 0) {
+            useHLE = true;
+        } else if (strcmp(argv[i], "--hle-check") == 0) {
+            checkHLE = true;
+        } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+            idleSkip = false;
+        } else if (strcmp(argv[i], "--block-cache") == 0) {
+            useBlockCache = true;
+        } else if (strcmp(argv[i], "--block-cache-check") == 0) {
+            checkBlockCache = true;
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewindInterval = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc) {
+            benchJSONPath = argv[++i];
+        } else if (strcmp(argv[i], "--record-input") == 0 && i + 1 < argc) {
+            recordInputPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay-input") == 0 && i + 1 < argc) {
+            replayInputPath = argv[++i];
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--counters") == 0 && i + 1 < argc) {
+            countersPath = argv[++i];
+        } else if (strcmp(argv[i], "--counters-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") == 0) countersFormat = COUNTERS_CSV;
+            else if (strcmp(argv[i], "jsonl") == 0) countersFormat = COUNTERS_JSONL;
+            else {
+                printf("Unrecognised counters format: %s\n", argv[i]);
+                return 1;
             }
+        } else if (strcmp(argv[i], "--counters-every") == 0 && i + 1 < argc) {
+            countersInterval = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--frame-times") == 0 && i + 1 < argc) {
+            frameTimesPath = argv[++i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else if (strcmp(argv[i], "--capture-buffers") == 0 && i + 1 < argc) {
+            captureBuffers = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--trace-records") == 0 && i + 1 < argc) {
+            traceRecords = strtoul(argv[++i], NULL, 10);
         } else {
-            executeAll();
-            if (instrsToSkipForDebug > 0) instrsToSkipForDebug--;
-            if (instrToSkipTo >= 0 && instrToSkipTo == PPU.PC) instrToSkipTo = -1;
+            printf("Unrecognised option: %s\n", argv[i]);
+            return 1;
         }
-        VideoSection prevSection = vState.section;
-        vStateCycle(&vState, renderer);
-        vStateCycle(&vState, renderer);
-        if (vState.section == VBLANK || vState.section == HBLANK) cyclesTakenToRenderAllSprites++;
-        if (vState.section == HBLANK && prevSection != HBLANK) {
-            SDL_RenderPresent(renderer);
-            Z80INT(&PPU, 0);
-            if (debug && printSectionChanges) printf("HBLANK triggered\n");
-        } else if (vState.section == DISPLAY && prevSection != DISPLAY) {
-            //printf("PPU was rendering for %d cycles\n", renderCycles);
-            Z80NMI(&PPU);
-            renderCycles = 0;
-        } else if (vState.section == VBLANK && prevSection != VBLANK) {
-            if (debug && printSectionChanges) printf("VBLANK triggered\n");
+    }
+
+    paletteInit();
+    Machine* m = machineCreate(argv[1], argv[3], argv[4]);
+    if (!m) return 1;
+    m->ppuProfile = ppuProfile;
+    m->cpuProfile = cpuProfile;
+    m->ppuIdle.enabled = m->cpuIdle.enabled = idleSkip;
+    m->latchFrames = !headless;
+    bool debug = strcmp(argv[2], "y") == 0;
+    // The debugger's stack trace comes from the instruction trace, so a debug session has one to attach while it steps
+    if (tracePath || debug) {
+        if (!(trace = traceCreate(traceRecords > 0 ? traceRecords : 1))) {
+            printf("Couldn't allocate the instruction trace\n");
+            return 1;
+        }
+        if (tracePath) {
+            machineSetTrace(m, trace);
+            signal(SIGSEGV, dumpTraceOnCrash);
+            signal(SIGBUS, dumpTraceOnCrash);
+            signal(SIGFPE, dumpTraceOnCrash);
+            signal(SIGABRT, dumpTraceOnCrash);
         }
+    }
+    if ((useBlockCache || checkBlockCache) && !machineSetBlockCache(m, checkBlockCache)) return 1;
+    if ((useHLE || checkHLE) && hleInit(m, checkHLE)) printf(m->hle.check ? "Checking the native renderer against the PPU\n" : "Using the native renderer\n");
 
-        if (waitFor == vState.section && prevSection != vState.section) {
-            waitFor = NONE;
-            waitForInput = true;
+    struct SDL_Renderer* renderer = NULL;
+    if (!headless) {
+        if (SDL_SetHintWithPriority(SDL_HINT_NO_SIGNAL_HANDLERS, "1", SDL_HINT_OVERRIDE) == SDL_FALSE) {
+            printf("Failed to set SDL hint\n");
+            return 1;
         }
 
-        if (vState.section == HBLANK || vState.section == VBLANK)
-            renderCycles++;
+        int windowWidth = DISPLAY_PIXELS_X * DISPLAY_SCALE;
+        int windowHeight = DISPLAY_PIXELS_Y * DISPLAY_SCALE;
+        printf("pixels_x: %d, pixels_y: %d\n", windowWidth, windowHeight);
+
+        SDL_Init(SDL_INIT_VIDEO);
+        struct SDL_Window* window = SDL_CreateWindow("Console", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth, windowHeight, SDL_WINDOW_BORDERLESS);
+        int width = 0, height = 0;
+        SDL_GetWindowSizeInPixels(window, &width, &height);
+        printf("%d x %d window created\n", width, height);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        screenTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, DISPLAY_PIXELS_X, DISPLAY_PIXELS_Y);
+        if (!screenTexture) {
+            printf("Couldn't create screen texture: %s\n", SDL_GetError());
+            return 1;
+        }
+        memset(frameBuffer, 0, sizeof(frameBuffer));
+        SDL_UpdateTexture(screenTexture, NULL, frameBuffer, DISPLAY_PIXELS_X * sizeof(uint32_t));
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        SDL_RenderPresent(renderer);
+    }
 
-        if (PPU.R1.wr.SP < STACK_BOTTOM) {
-            printf("Stack overflowed to address %x at PC %x\n", PPU.R1.wr.SP, PPU.PC);
-            printStackTrace();
+    FILE* crcLogFile = NULL;
+    if (crcLogPath) {
+        crcLogFile = fopen(crcLogPath, "w");
+        if (!crcLogFile) {
+            printf("Couldn't open %s\n", crcLogPath);
             return 1;
         }
     }
 
+    machineReset(m);
+    if (snapshotPath && !loadSnapshot(m, snapshotPath)) return 1;
+    if (replayInputPath) {
+        if (!(replayingInput = inputReplayOpen(&inputReplay, replayInputPath))) return 1;
+        if (inputReplay.header.startFrame != m->frames) {
+            printf("Input was recorded from frame %u but this run starts at frame %u\n", inputReplay.header.startFrame, m->frames);
+        }
+    }
+    if (recordInputPath && !(recordingInput = inputRecordOpen(&inputRecorder, recordInputPath, m->frames))) return 1;
+    m->sampleInput = sampleInput;
+    if (rewindInterval > 0) {
+        rewindState = malloc(machineStateSize(m));
+        if (!rewindState || !rewindInit(&rewindBuffer, machineStateSize(m), REWIND_CAPACITY, REWIND_MAX_BYTES)) {
+            printf("Couldn't allocate the rewind buffer\n");
+            return 1;
+        }
+    }
+    if (countersPath) {
+        if (!(countersExport = countersOpen(countersPath, countersFormat, countersInterval))) return 1;
+        machineSetCounting(m, true);
+        // Start the first frame's counts from here rather than from the reset
+        FrameCounters discarded;
+        machineCollectCounters(m, &discarded);
+    }
+    if (capturePath && !(capture = captureOpen(capturePath, DISPLAY_PIXELS_X, DISPLAY_PIXELS_Y, captureBuffers))) return 1;
+    pacingInit(&pacer, fps >= 0 ? fps : headless ? 0 : FRAMES_PER_SECOND);
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    EmulationRun run = {
+        .machine = m,
+        .step = releaseStep,
+        .framesToRun = framesToRun,
+        .crcLogFile = crcLogFile
+    };
+    if (debug) enterDebugger(&run);
+    // Ctrl-C stops in the debugger instead of quitting
+    signal(SIGINT, requestDebugger);
+    if (headless) emulate(&run);
+    else {
+        // Emulate on another thread, since SDL wants windows and events handled on the main thread
+        pthread_t emulationThread;
+        if (pthread_create(&emulationThread, NULL, emulate, &run) != 0) {
+            printf("Couldn't start the emulation thread\n");
+            return 1;
+        }
+        runPresenter(renderer);
+        pthread_join(emulationThread, NULL);
+    }
+    if (tracePath) dumpTrace(tracePath);
+    if (recordingInput) {
+        if (inputRecordClose(&inputRecorder)) {
+            printf("Recorded %u frames of input as %u runs to %s\n", inputRecorder.header.frames, inputRecorder.header.runs, recordInputPath);
+        } else printf("Couldn't write input recording to %s\n", recordInputPath);
+    }
+    if (replayingInput) inputReplayClose(&inputReplay);
+    if (countersExport && !countersClose(countersExport)) printf("Couldn't write all the counters to %s\n", countersPath);
+    if (capture) {
+        CaptureStats stats;
+        if (captureClose(capture, &stats)) {
+            printf("Captured %llu frames (%llu keyframes, %llu dropped) to %s, %llu bytes\n", stats.captured, stats.keyframes, stats.dropped,
+                   capturePath, stats.bytes);
+        } else printf("Couldn't write the capture to %s\n", capturePath);
+    }
+    if (run.status != 0) return run.status;
+    unsigned frames = m->frames;
+
+    double elapsed = secondsSince(&startTime);
+    printf("Emulated %u frames in %.3fs (%.1f frames/s)\n", frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0);
+    if (m->sched.ppuCycles > 0 && m->sched.cpuCycles > 0) {
+        printf("Skipped idle T-states: PPU %llu (%.1f%%), CPU %llu (%.1f%%)\n", m->ppuIdle.skipped, 100.0 * m->ppuIdle.skipped / m->sched.ppuCycles,
+               m->cpuIdle.skipped, 100.0 * m->cpuIdle.skipped / m->sched.cpuCycles);
+    }
+    if (frames > 0) printf("Average dirty cells per frame: %.1f of %d\n", (double)m->dirtyCellsTotal / frames, SPANS_PER_ROW * CELL_ROWS);
+    // The PPU code's sprites are only seen with counting on
+    if (frames > 0 && (m->hle.enabled || m->counting)) {
+        printf("Average sprites per frame: %.1f evaluated, %.1f drawn\n", (double)m->spritesEvaluated / frames, (double)m->spritesDrawn / frames);
+    }
+    if (!headless) {
+        printf("Presented %llu of %llu frames: %llu dropped, %llu refreshes duplicated\n", frameExchange.presented, frameExchange.published,
+               frameExchange.dropped, frameExchange.duplicated);
+    }
+    if (pacer.fps > 0 || frameTimesPath) pacingReport(&pacer);
+    if (m->doubleBufferedTables) printf("Flipped the sprite and tile tables %llu times\n", m->tableFlips);
+    if (m->hle.check) printf("HLE check: %llu of %llu passes mismatched\n", m->hle.mismatchedPasses, m->hle.checkedPasses);
+    if (m->ppuBlocks) {
+        printBlockCacheStats("PPU", m->ppuBlocks, m->ppuInstructions);
+        printBlockCacheStats("CPU", m->cpuBlocks, m->cpuInstructions);
+    }
+    if (ppuProfile) profilerReport(ppuProfile, BLANKING_TSTATES_PER_FRAME);
+    if (cpuProfile) profilerReport(cpuProfile, BLANKING_TSTATES_PER_FRAME);
+    if (crcLogFile) fclose(crcLogFile);
+    if (pixelDumpPath && !dumpPixelMap(m, pixelDumpPath)) return 1;
+    if (benchJSONPath && !writeBenchJSON(m, elapsed, benchJSONPath)) return 1;
+    if (frameTimesPath && !pacingWriteCSV(&pacer, frameTimesPath)) return 1;
     return 0;
 }
@@ -0,0 +1,138 @@
+#include <time.h>
+#include "pacing.h"
+
+int64_t pacingNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void histogramInit(FrameHistogram* hist, const char* name, int64_t low) {
+    *hist = (FrameHistogram){ .name = name, .low = low };
+}
+
+static void histogramRecord(FrameHistogram* hist, int64_t ns) {
+    int64_t us = ns / 1000;
+    int64_t bucket = us >= hist->low ? (us - hist->low) / PACING_BUCKET_US : -1;
+    if (bucket < 0) hist->below++;
+    else if (bucket >= PACING_BUCKETS) hist->above++;
+    else hist->counts[bucket]++;
+    if (hist->count == 0 || us < hist->min) hist->min = us;
+    if (hist->count == 0 || us > hist->max) hist->max = us;
+    hist->sum += us;
+    hist->count++;
+}
+
+// The upper edge of the bucket holding the given fraction of samples, clamped to what was actually seen
+static int64_t histogramPercentile(FrameHistogram* hist, double fraction) {
+    unsigned long long target = (unsigned long long)(fraction * hist->count);
+    unsigned long long seen = hist->below;
+    if (seen > target) return hist->min;
+    for (unsigned i = 0; i < PACING_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > target) {
+            int64_t edge = hist->low + (int64_t)(i + 1) * PACING_BUCKET_US;
+            return edge < hist->max ? edge : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void histogramReport(FrameHistogram* hist) {
+    if (hist->count == 0) return;
+    printf("\t%-10s mean %7.2fms  p50 %7.2fms  p90 %7.2fms  p99 %7.2fms  min %7.2fms  max %7.2fms\n", hist->name,
+           hist->sum / 1000.0 / hist->count, histogramPercentile(hist, 0.5) / 1000.0, histogramPercentile(hist, 0.9) / 1000.0,
+           histogramPercentile(hist, 0.99) / 1000.0, hist->min / 1000.0, hist->max / 1000.0);
+}
+
+void pacingInit(Pacer* pacer, unsigned fps) {
+    *pacer = (Pacer){ .fps = fps, .periodNs = fps ? 1000000000ll / fps : 0 };
+    histogramInit(&pacer->emulation, "emulation", 0);
+    // Slack goes negative when a frame finishes late
+    histogramInit(&pacer->slack, "slack", -(PACING_BUCKETS / 2) * PACING_BUCKET_US);
+    histogramInit(&pacer->present, "present", 0);
+}
+
+void pacingReset(Pacer* pacer) {
+    pacer->started = false;
+}
+
+// Sleep until shortly before the deadline then spin the rest of the way
+static void waitUntil(int64_t deadline) {
+    int64_t sleepUntil = deadline - PACING_SPIN_NS;
+    if (sleepUntil > pacingNow()) {
+        struct timespec ts = { .tv_sec = sleepUntil / 1000000000, .tv_nsec = sleepUntil % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+    }
+    while (pacingNow() < deadline);
+}
+
+bool pacingFrameDone(Pacer* pacer) {
+    int64_t now = pacingNow();
+    if (!pacer->started) {
+        // The first frame after a reset has nothing to be measured against
+        pacer->started = true;
+        pacer->frameStart = now;
+        pacer->deadline = now + pacer->periodNs;
+        pacer->lastEmulationNs = 0;
+        return true;
+    }
+    pacer->lastEmulationNs = now - pacer->frameStart;
+    histogramRecord(&pacer->emulation, pacer->lastEmulationNs);
+    if (pacer->fps == 0) {
+        pacer->frameStart = now;
+        return true;
+    }
+    int64_t slack = pacer->deadline - now;
+    histogramRecord(&pacer->slack, slack);
+    bool show = true;
+    if (slack >= 0) waitUntil(pacer->deadline);
+    else {
+        pacer->lateFrames++;
+        if (-slack > PACING_MAX_LAG_FRAMES * pacer->periodNs) {
+            // Too far behind to catch up without running visibly fast, so carry on from now
+            pacer->resyncs++;
+            pacer->deadline = now;
+        } else if (-slack > pacer->periodNs) {
+            // More than a frame behind, so don't spend anything on showing the next one
+            pacer->skippedFrames++;
+            show = false;
+        }
+    }
+    pacer->deadline += pacer->periodNs;
+    pacer->frameStart = pacingNow();
+    return show;
+}
+
+void pacingRecordPresent(Pacer* pacer, int64_t ns) {
+    histogramRecord(&pacer->present, ns);
+}
+
+void pacingReport(Pacer* pacer) {
+    if (pacer->fps) {
+        printf("Paced to %u frames/s: %llu frames late, %llu skipped, %llu resyncs\n", pacer->fps, pacer->lateFrames, pacer->skippedFrames,
+               pacer->resyncs);
+    } else printf("Frame times, unpaced:\n");
+    histogramReport(&pacer->emulation);
+    histogramReport(&pacer->slack);
+    histogramReport(&pacer->present);
+}
+
+bool pacingWriteCSV(Pacer* pacer, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    fprintf(file, "histogram,bucket_start_us,count\n");
+    FrameHistogram* hists[] = { &pacer->emulation, &pacer->slack, &pacer->present };
+    for (unsigned h = 0; h < sizeof(hists) / sizeof(hists[0]); h++) {
+        FrameHistogram* hist = hists[h];
+        if (hist->below) fprintf(file, "%s,below,%llu\n", hist->name, hist->below);
+        for (unsigned i = 0; i < PACING_BUCKETS; i++) {
+            if (hist->counts[i]) fprintf(file, "%s,%lld,%llu\n", hist->name, (long long)(hist->low + (int64_t)i * PACING_BUCKET_US), hist->counts[i]);
+        }
+        if (hist->above) fprintf(file, "%s,above,%llu\n", hist->name, hist->above);
+    }
+    return fclose(file) == 0;
+}
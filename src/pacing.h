@@ -0,0 +1,55 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PACING_BUCKETS 200
+#define PACING_BUCKET_US 250
+// How far behind the emulation can fall before the missed time is written off instead of caught up
+#define PACING_MAX_LAG_FRAMES 3
+// The last part of each wait is spun rather than slept, since sleeps wake late by up to a scheduler tick
+#define PACING_SPIN_NS 1000000
+
+// Frame times in microseconds, in buckets of PACING_BUCKET_US from low
+typedef struct {
+    const char* name;
+    int64_t low;
+    unsigned long long counts[PACING_BUCKETS];
+    unsigned long long below, above, count;
+    int64_t min, max, sum;
+} FrameHistogram;
+
+typedef struct {
+    unsigned fps;
+    int64_t periodNs;
+    // When the frame being emulated is due to finish, and when it started
+    int64_t deadline;
+    int64_t frameStart;
+    bool started;
+    // How long the last frame took to emulate, or 0 if it wasn't timed
+    int64_t lastEmulationNs;
+    unsigned long long lateFrames;
+    unsigned long long skippedFrames;
+    unsigned long long resyncs;
+    // Emulation time and slack are recorded on the emulation thread and present time on the presenter's
+    FrameHistogram emulation;
+    FrameHistogram slack;
+    FrameHistogram present;
+} Pacer;
+
+// Pace frames to fps, or just measure them if it's 0
+void pacingInit(Pacer* pacer, unsigned fps);
+// Start timing from now, after the emulation has been stopped, e.g. in the debugger
+void pacingReset(Pacer* pacer);
+// Called as the emulation finishes a frame. Waits until the frame is due and returns false if the next frame should be skipped
+// rather than shown, to help catch up.
+bool pacingFrameDone(Pacer* pacer);
+void pacingRecordPresent(Pacer* pacer, int64_t ns);
+int64_t pacingNow(void);
+void pacingReport(Pacer* pacer);
+// Write every bucket of the histograms as CSV
+bool pacingWriteCSV(Pacer* pacer, const char* path);
+
+#endif
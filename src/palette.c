@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include "palette.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PALETTE_X86
+#endif
+
+uint32_t paletteLUT[PALETTE_COLOURS_NUM];
+static RowConverter activeConverter;
+
+static uint8_t expandChannel(uint8_t bits) {
+    return bits | (bits << 2) | (bits << 4) | (bits << 6);
+}
+
+static void convertRowScalar(const uint8_t* in, uint32_t* out, unsigned n) {
+    for (unsigned i = 0; i < n; i++) out[i] = paletteLUT[in[i] & (PALETTE_COLOURS_NUM - 1)];
+}
+
+#ifdef PALETTE_X86
+// The LUT split into 16 entry tables per channel so each channel can be looked up with PSHUFB, which only indexes 16 bytes.
+// channelTables[c][k] holds channel c (0 = blue, 1 = green, 2 = red) of colours k * 16 to k * 16 + 15.
+static __m128i channelTables[3][PALETTE_COLOURS_NUM / 16];
+
+static void buildChannelTables(void) {
+    uint8_t bytes[16];
+    for (unsigned c = 0; c < 3; c++) {
+        for (unsigned k = 0; k < PALETTE_COLOURS_NUM / 16; k++) {
+            for (unsigned j = 0; j < 16; j++) bytes[j] = paletteLUT[k * 16 + j] >> (c * 8);
+            channelTables[c][k] = _mm_loadu_si128((const __m128i*)bytes);
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static __m128i lookupChannel(__m128i* tables, __m128i lo, __m128i* hiMasks) {
+    __m128i result = _mm_and_si128(_mm_shuffle_epi8(tables[0], lo), hiMasks[0]);
+    for (unsigned k = 1; k < PALETTE_COLOURS_NUM / 16; k++) result = _mm_or_si128(result, _mm_and_si128(_mm_shuffle_epi8(tables[k], lo), hiMasks[k]));
+    return result;
+}
+
+__attribute__((target("ssse3")))
+static void convertRowSSSE3(const uint8_t* in, uint32_t* out, unsigned n) {
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    const __m128i alpha = _mm_set1_epi8((char)0xFF);
+    unsigned i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i lo = _mm_and_si128(pixels, lowNibble);
+        // Pixels only use the bottom 6 bits, so the high nibble selects one of the four tables
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(pixels, 4), _mm_set1_epi8(0x03));
+        __m128i hiMasks[PALETTE_COLOURS_NUM / 16];
+        for (unsigned k = 0; k < PALETTE_COLOURS_NUM / 16; k++) hiMasks[k] = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+        __m128i b = lookupChannel(channelTables[0], lo, hiMasks);
+        __m128i g = lookupChannel(channelTables[1], lo, hiMasks);
+        __m128i r = lookupChannel(channelTables[2], lo, hiMasks);
+        // Interleave into B, G, R, A byte order, which is ARGB8888 in a little endian word
+        __m128i bgLo = _mm_unpacklo_epi8(b, g);
+        __m128i bgHi = _mm_unpackhi_epi8(b, g);
+        __m128i raLo = _mm_unpacklo_epi8(r, alpha);
+        __m128i raHi = _mm_unpackhi_epi8(r, alpha);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(bgLo, raLo));
+        _mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(bgLo, raLo));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpacklo_epi16(bgHi, raHi));
+        _mm_storeu_si128((__m128i*)(out + i + 12), _mm_unpackhi_epi16(bgHi, raHi));
+    }
+    convertRowScalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convertRowAVX2(const uint8_t* in, uint32_t* out, unsigned n) {
+    const __m256i indexMask = _mm256_set1_epi32(PALETTE_COLOURS_NUM - 1);
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i indices = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i))), indexMask);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_i32gather_epi32((const int*)paletteLUT, indices, 4));
+    }
+    convertRowScalar(in + i, out + i, n - i);
+}
+#endif
+
+void paletteSet(unsigned index, uint32_t argb) {
+    paletteLUT[index & (PALETTE_COLOURS_NUM - 1)] = argb;
+#ifdef PALETTE_X86
+    buildChannelTables();
+#endif
+}
+
+void paletteInit(void) {
+    for (unsigned pixel = 0; pixel < PALETTE_COLOURS_NUM; pixel++) {
+        uint32_t r = expandChannel(pixel & 0b11);
+        uint32_t g = expandChannel((pixel & 0b1100) >> 2);
+        uint32_t b = expandChannel((pixel & 0b110000) >> 4);
+        paletteLUT[pixel] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+    activeConverter = convertRowScalar;
+#ifdef PALETTE_X86
+    buildChannelTables();
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) activeConverter = convertRowAVX2;
+    else if (__builtin_cpu_supports("ssse3")) activeConverter = convertRowSSSE3;
+#endif
+}
+
+void convertRow(const uint8_t* in, uint32_t* out, unsigned n) {
+    activeConverter(in, out, n);
+}
+
+unsigned paletteConverters(RowConverterImpl* impls, unsigned max) {
+    unsigned count = 0;
+    if (count < max) impls[count++] = (RowConverterImpl){ "scalar", convertRowScalar };
+#ifdef PALETTE_X86
+    __builtin_cpu_init();
+    if (count < max && __builtin_cpu_supports("ssse3")) impls[count++] = (RowConverterImpl){ "ssse3", convertRowSSSE3 };
+    if (count < max && __builtin_cpu_supports("avx2")) impls[count++] = (RowConverterImpl){ "avx2", convertRowAVX2 };
+#endif
+    return count;
+}
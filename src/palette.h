@@ -0,0 +1,27 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+
+#define PALETTE_COLOURS_NUM 64
+
+typedef void (*RowConverter)(const uint8_t* in, uint32_t* out, unsigned n);
+
+typedef struct {
+    const char* name;
+    RowConverter convert;
+} RowConverterImpl;
+
+// ARGB8888 colour for each 6 bit pixel value
+extern uint32_t paletteLUT[PALETTE_COLOURS_NUM];
+
+// Fill the LUT with the fixed RRGGBB expansion and pick the fastest row converter the host supports
+void paletteInit(void);
+// Change a single colour, e.g. when a palette register is written
+void paletteSet(unsigned index, uint32_t argb);
+// Convert n pixel map bytes to ARGB8888 through the LUT
+void convertRow(const uint8_t* in, uint32_t* out, unsigned n);
+// List the row converters usable on this host, starting with the scalar one. Returns how many were written.
+unsigned paletteConverters(RowConverterImpl* impls, unsigned max);
+
+#endif
@@ -15,8 +15,28 @@ SPRITE_DEF_SIZE = (SPRITE_DEF_PIXELS_NUM)
 SPRITE_DEF_MEM_SIZE = (SPRITE_DEF_SIZE * SPRITE_DEF_NUM)
 ANIMATION_DEFS_ADDR = (SPRITE_DEFS_ADDR + SPRITE_DEF_MEM_SIZE)
 TILE_TABLE_ADDR = (SPRITE_TABLE_ADDR + (SPRITE_ENTRY_SIZE * SPRITE_ENTRIES_NUM))
-PPU_REGS_ADDR = (TILE_TABLE_ADDR + (SPRITE_ENTRIES_NUM * SPRITE_ENTRY_SIZE))
+TILE_MAP_NUM_X = 32
+TILE_MAP_NUM_Y = 32
+TILE_ENTRY_SIZE = 2
+TILE_MAP_ROW_SIZE = (TILE_MAP_NUM_X * TILE_ENTRY_SIZE)
+TILE_MAP_SIZE = (TILE_MAP_ROW_SIZE * TILE_MAP_NUM_Y)
+PPU_REGS_ADDR = (TILE_TABLE_ADDR + TILE_MAP_SIZE)
+REG_SCROLL_X = (PPU_REGS_ADDR + 0)
+REG_SCROLL_Y = (PPU_REGS_ADDR + 1)
+REG_SPRITE_COUNT = (PPU_REGS_ADDR + 2)
+DISPLAY_PIXELS_X = (TILES_NUM_X * 8)
+DISPLAY_PIXELS_Y = (TILES_NUM_Y * 8)
 PPU_CPU_INT_PORT = 0
+PPU_DMA_SRC_LO_PORT = 1
+PPU_DMA_SRC_HI_PORT = 2
+PPU_DMA_DST_LO_PORT = 3
+PPU_DMA_DST_HI_PORT = 4
+PPU_DMA_WIDTH_PORT = 5
+PPU_DMA_HEIGHT_PORT = 6
+PPU_DMA_STRIDE_LO_PORT = 7
+PPU_DMA_STRIDE_HI_PORT = 8
+PPU_DMA_START_PORT = 9
+PPU_DMA_SRC_STRIDE_PORT = 10
 
 .extern _stack_end
 
@@ -59,93 +79,189 @@ _nmiHandler:
 spin:
     halt
 
-.macro RENDERSPRITE
-    ; Proceed to next sprite entry. Index ix with negative offsets for this sprite.
-    ; This is done unconditionally at the start so that we can jump past this sprite with the address already added to.
-    ld bc, SPRITE_ENTRY_SIZE
-    add ix, bc
+render:
+    ; Tiles and sprites are copied by the DMA engine from the rows of their 8x8 defs into pixel map rows DISPLAY_PIXELS_X
+    ; apart. Tiles cut off by the scroll only copy part of each def row, so source rows are always a def row apart.
+    ld a, SPRITE_DEF_PIXELS_X
+    out (PPU_DMA_SRC_STRIDE_PORT), a
+    ld a, DISPLAY_PIXELS_X
+    out (PPU_DMA_STRIDE_LO_PORT), a
+    xor a
+    out (PPU_DMA_STRIDE_HI_PORT), a
+
+    ; Find the first visible tile from the scroll registers. The map is 32 tiles square, so the registers wrap round its edges.
+    ld a, (REG_SCROLL_Y)
+    ld l, a
+    and 7
+    add a, a
+    add a, a
+    add a, a
+    ld e, a ; e is the offset into each def of the first visible row of pixels
+    ld a, l
+    and 0xf8
+    ld l, a
+    ld h, 0
+    add hl, hl
+    add hl, hl
+    add hl, hl ; hl is the offset of the first visible row of the map
+    ld a, (REG_SCROLL_X)
+    rrca
+    rrca
+    and TILE_MAP_ROW_SIZE - TILE_ENTRY_SIZE
+    ld c, a
+    ld b, 0
+    add hl, bc
+    ld bc, TILE_TABLE_ADDR
+    add hl, bc ; hl points at the first visible entry
+    ld a, (REG_SCROLL_X)
+    and 7
+    ld c, a ; c is the number of pixels cut off the left of the first visible column
+    ld b, 0 ; b is the pixel row the current row of tiles starts on
+
+.tile_row:
+    ; A row of tiles is 8 pixels high less any cut off at the top, and stops at the bottom of the display
+    ld a, e
+    rrca
+    rrca
+    rrca
+    neg
+    add a, SPRITE_DEF_PIXELS_Y
+    ld d, a
+    ld a, DISPLAY_PIXELS_Y
+    sub b
+    cp d
+    jr c, 1f
+    ld a, d
+    1:
+    out (PPU_DMA_HEIGHT_PORT), a
+    push af
+    push bc
+    push hl
+    push de
+    ; Start the row at the pixel map address of pixel row b
+    ld l, b
+    ld h, 0
+    add hl, hl
+    ld de, y_pixel_lookup
+    add hl, de
+    ld a, (hl)
+    out (PPU_DMA_DST_LO_PORT), a
+    inc hl
+    ld a, (hl)
+    out (PPU_DMA_DST_HI_PORT), a
+    pop de
+    pop hl
+    push hl
+    ; d has the low address bits of the start of this row of the map, which draw_tiles wraps round to
+    ld a, l
+    and 0x100 - TILE_MAP_ROW_SIZE
+    ld d, a
+    ; With a fine x scroll there's a cut off tile at each end of the row and one fewer whole tile between them
+    ld a, c
+    or a
+    jr z, .whole_tiles
+    neg
+    add a, SPRITE_DEF_PIXELS_X
+    out (PPU_DMA_WIDTH_PORT), a
+    ld a, e
+    add a, c
+    ld e, a
+    ld b, 1
+    call draw_tiles
+    ld a, e
+    sub c
+    ld e, a
+    ld a, SPRITE_DEF_PIXELS_X
+    out (PPU_DMA_WIDTH_PORT), a
+    ld b, TILES_NUM_X - 1
+    call draw_tiles
+    ld a, c
+    out (PPU_DMA_WIDTH_PORT), a
+    ld b, 1
+    call draw_tiles
+    jr .next_tile_row
+.whole_tiles:
+    ld a, SPRITE_DEF_PIXELS_X
+    out (PPU_DMA_WIDTH_PORT), a
+    ld b, TILES_NUM_X
+    call draw_tiles
+.next_tile_row:
+    ; Move down a row of the map, wrapping from the bottom back to the top. The map ends on a 256 byte boundary so only the
+    ; high byte needs checking.
+    pop hl
+    ld bc, TILE_MAP_ROW_SIZE
+    add hl, bc
+    ld a, h
+    cp (TILE_TABLE_ADDR + TILE_MAP_SIZE) >> 8
+    jr c, 1f
+    ld bc, -TILE_MAP_SIZE
+    add hl, bc
+    1:
+    pop bc
+    pop af
+    ; Only the first row of tiles can be cut off at the top
+    ld e, 0
+    add a, b
+    ld b, a
+    cp DISPLAY_PIXELS_Y
+    jp c, .tile_row
+
+    ; Sprites are always whole 8x8 blocks
+    ld a, SPRITE_DEF_PIXELS_X
+    out (PPU_DMA_WIDTH_PORT), a
+    ld a, SPRITE_DEF_PIXELS_Y
+    out (PPU_DMA_HEIGHT_PORT), a
+    ; Only evaluate the active entries at the start of the table. A count of 0 wraps round to all of them.
+    ld a, (REG_SPRITE_COUNT)
+    dec a
+    cp SPRITE_ENTRIES_NUM
+    jr c, 1f
+    ld a, SPRITE_ENTRIES_NUM - 1
+    1:
+    inc a
+    ld b, a
+    ld ix, SPRITE_TABLE_ADDR
+.render_sprite:
     ; Don't render anything if the high address byte is zero
-    ld b, (ix-1)
-    dec b
+    ld a, (ix+3)
+    dec a
     jp m, 1f
+    ; Or if it starts off the display, which is also past the end of y_pixel_lookup
+    ld a, (ix)
+    cp DISPLAY_PIXELS_X
+    jp nc, 1f
+    ld a, (ix+1)
+    cp DISPLAY_PIXELS_Y
+    jp nc, 1f
 
     ; Get y * 200 from the lookup table and add it to x to get the full VRAM address
-    ld l, (ix-3) ; l now has the y coord
+    ld l, a ; l now has the y coord
     ld h, 0
     add hl, hl ; Double y since each entry in the lookup table takes two bytes
     ld de, y_pixel_lookup
     add hl, de ; hl is the lookup address
-    ld c, (hl)
+    ld a, (hl)
     inc hl
     ld h, (hl)
-    ld l, c ; hl is the y VRAM offset
-    ld b, 0
-    ld c, (ix-4)
-    add hl, bc ; Add it to the x coord
-    ex de, hl ; Put the full VRAM address in de
-
-    ld l, (ix-2)
-    ld h, (ix-1) ; hl now has the sprite def addr
-    ; Copy 64 bytes from hl (sprite def addr) to de (pixel map addr) in 8 byte chunks
-    .rept SPRITE_DEF_PIXELS_Y
-        .rept SPRITE_DEF_PIXELS_X
-            ldi
-        .endr
-        ; Move VRAM address to the next row
-        ld iy, 192
-        add iy, de
-        ld d, iyh
-        ld e, iyl
-    .endr
+    ld l, a ; hl is the y VRAM offset
+    ld e, (ix)
+    ld d, 0
+    add hl, de ; Add it to the x coord
+    ld a, l
+    out (PPU_DMA_DST_LO_PORT), a
+    ld a, h
+    out (PPU_DMA_DST_HI_PORT), a
+    ld a, (ix+2)
+    out (PPU_DMA_SRC_LO_PORT), a
+    ld a, (ix+3)
+    out (PPU_DMA_SRC_HI_PORT), a
+    xor a
+    out (PPU_DMA_START_PORT), a
     ; Jump here if this sprite shouldn't be rendered
     1:
-.endm
-
-render:
-    ; Render background tiles
-    ld ix, TILE_TABLE_ADDR
-    ld hl, PIXEL_MAP_ADDR
-    .rept TILES_NUM_Y
-        ld a, TILES_NUM_X
-        1:
-            ; Render this tile
-            ld e, (ix)
-            ld d, (ix+1) ; de has the sprite def address
-            inc ix
-            inc ix
-            .rept SPRITE_DEF_PIXELS_Y
-                ; the vram address is held in hl because of its compatibility with ADD and SBC, but it's needed in de for LDI
-                ex de, hl
-                .rept SPRITE_DEF_PIXELS_X
-                    ldi
-                .endr
-                ex de, hl
-                ; Move vram address to the next line
-                ld bc, 192
-                add hl, bc
-            .endr
-            dec a
-            jp z, 2f
-            ; Move to the next tile's start address
-            ld bc, 1592
-            or a
-            sbc hl, bc
-            jp 1b
-        2:
-            ld bc, 192
-            or a
-            sbc hl, bc
-    .endr
-
-    ld ix, SPRITE_TABLE_ADDR
-    ld a, 8
-    ; A loop is needed since ROM can't hold the full unrolled render loop
-.render_batch:
-    .rept SPRITE_ENTRIES_NUM / 8
-        RENDERSPRITE
-    .endr
-    dec a
-    jp nz, .render_batch
+    ld de, SPRITE_ENTRY_SIZE
+    add ix, de
+    djnz .render_sprite
     nop
     ; Interrupt CPU to tell it to update graphics data.
     ; We could use an immediate for the port with the OUT instruction, but that would mean reloading a between the two OUTs
@@ -159,6 +275,27 @@ render:
     ; When the next blanking period starts, the interrupt handler will jump here
     jp render
 
+; Copy b tiles from consecutive entries of a row of the tile map, starting with the entry at hl. e is added to each def
+; address to get to the visible part of the tile, and hl wraps round to the start of the row, whose low address bits are in d.
+; The DMA destination moves along by a tile after each copy.
+draw_tiles:
+    ld a, (hl)
+    add a, e
+    out (PPU_DMA_SRC_LO_PORT), a
+    inc l
+    ld a, (hl)
+    adc a, 0
+    out (PPU_DMA_SRC_HI_PORT), a
+    ld a, l
+    inc a
+    and TILE_MAP_ROW_SIZE - 1
+    or d
+    ld l, a
+    xor a
+    out (PPU_DMA_START_PORT), a
+    djnz draw_tiles
+    ret
+
 ; The y coordinate mapped to a VRAM address for that row
 ; Should be added to the x coordinate to form a full VRAM address
 y_pixel_lookup:
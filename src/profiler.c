@@ -0,0 +1,244 @@
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profiler.h"
+
+#define PROFILER_MAX_LABELS 256
+#define PROFILER_LABEL_LEN 32
+#define PROFILER_UNKNOWN_LABEL 0
+// Render pass lengths are bucketed in 10% steps of the budget, with the last bucket catching everything over 200%
+#define PROFILER_PASS_BUCKETS 21
+
+typedef struct {
+    char name[PROFILER_LABEL_LEN];
+    unsigned long long entries;
+    unsigned long long frameCycles;
+    unsigned long long totalCycles;
+    unsigned long long minCycles;
+    unsigned long long maxCycles;
+} ProfileLabel;
+
+struct CoreProfile {
+    char coreName[8];
+    ProfileLabel labels[PROFILER_MAX_LABELS];
+    unsigned labelCount;
+    uint16_t pcToLabel[64 * 1024];
+    // Set on the first address of each symbol, to count entries into labels
+    bool labelStart[64 * 1024];
+    unsigned frames;
+    unsigned long long frameBusy;
+    unsigned long long frameIdle;
+    unsigned long long minBusy, maxBusy, totalBusy, totalIdle;
+    unsigned long long passBusy;
+    unsigned passes;
+    unsigned passesOverBudget;
+    unsigned long long minPass, maxPass, totalPass;
+    unsigned passBuckets[PROFILER_PASS_BUCKETS];
+};
+
+typedef struct {
+    uint32_t address;
+    unsigned label;
+} SymbolAddress;
+
+static int compareSymbols(const void* a, const void* b) {
+    const SymbolAddress* sa = a;
+    const SymbolAddress* sb = b;
+    return (sa->address > sb->address) - (sa->address < sb->address);
+}
+
+// Labels generated inside macros and .rept blocks with \@ end in _<n>. Fold them so every expansion counts towards the macro.
+static void foldLabelName(const char* name, char* out) {
+    size_t len = strlen(name);
+    size_t end = len;
+    while (end > 0 && name[end - 1] >= '0' && name[end - 1] <= '9') end--;
+    if (end < len && end > 1 && name[end - 1] == '_') len = end - 1;
+    if (len >= PROFILER_LABEL_LEN) len = PROFILER_LABEL_LEN - 1;
+    memcpy(out, name, len);
+    out[len] = 0;
+}
+
+static unsigned findOrAddLabel(CoreProfile* profile, const char* name) {
+    char folded[PROFILER_LABEL_LEN];
+    foldLabelName(name, folded);
+    for (unsigned i = 0; i < profile->labelCount; i++) {
+        if (strcmp(profile->labels[i].name, folded) == 0) return i;
+    }
+    if (profile->labelCount == PROFILER_MAX_LABELS) return PROFILER_UNKNOWN_LABEL;
+    ProfileLabel* label = &profile->labels[profile->labelCount];
+    strcpy(label->name, folded);
+    label->minCycles = ~0ULL;
+    return profile->labelCount++;
+}
+
+static unsigned char* readFile(const char* path, size_t* len) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = malloc(*len);
+    if (data && fread(data, 1, *len, file) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+// Read the symbol table of a 32 bit little endian ELF file, which is what ld-z80 produces
+static SymbolAddress* loadSymbols(CoreProfile* profile, const char* elfPath, unsigned* count) {
+    size_t len = 0;
+    unsigned char* data = readFile(elfPath, &len);
+    if (!data) return NULL;
+    SymbolAddress* symbols = NULL;
+    *count = 0;
+
+    Elf32_Ehdr* header = (Elf32_Ehdr*)data;
+    if (len < sizeof(Elf32_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS32 ||
+        header->e_ident[EI_DATA] != ELFDATA2LSB || header->e_shoff + (size_t)header->e_shnum * sizeof(Elf32_Shdr) > len) {
+        printf("%s isn't a 32 bit little endian ELF file\n", elfPath);
+        free(data);
+        return NULL;
+    }
+    Elf32_Shdr* sections = (Elf32_Shdr*)(data + header->e_shoff);
+    for (unsigned i = 0; i < header->e_shnum && !symbols; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= header->e_shnum) continue;
+        Elf32_Shdr* strings = &sections[sections[i].sh_link];
+        if (sections[i].sh_offset + sections[i].sh_size > len || strings->sh_offset + strings->sh_size > len) break;
+        Elf32_Sym* syms = (Elf32_Sym*)(data + sections[i].sh_offset);
+        unsigned symCount = sections[i].sh_size / sizeof(Elf32_Sym);
+        symbols = malloc(symCount * sizeof(SymbolAddress));
+        if (!symbols) break;
+        for (unsigned s = 0; s < symCount; s++) {
+            unsigned type = ELF32_ST_TYPE(syms[s].st_info);
+            // Skip undefined and absolute symbols, which are the assembler constants, and section and file symbols
+            if (syms[s].st_shndx == SHN_UNDEF || syms[s].st_shndx >= SHN_LORESERVE) continue;
+            if (type != STT_NOTYPE && type != STT_FUNC && type != STT_OBJECT) continue;
+            if (syms[s].st_name >= strings->sh_size || syms[s].st_value >= 64 * 1024) continue;
+            const char* name = (const char*)(data + strings->sh_offset + syms[s].st_name);
+            if (!name[0]) continue;
+            symbols[*count].address = syms[s].st_value;
+            symbols[*count].label = findOrAddLabel(profile, name);
+            (*count)++;
+        }
+    }
+    if (!symbols) printf("No symbol table in %s\n", elfPath);
+    free(data);
+    return symbols;
+}
+
+CoreProfile* profilerCreate(const char* coreName, const char* elfPath) {
+    CoreProfile* profile = calloc(1, sizeof(CoreProfile));
+    if (!profile) return NULL;
+    snprintf(profile->coreName, sizeof(profile->coreName), "%s", coreName);
+    findOrAddLabel(profile, "(unknown)");
+    unsigned count = 0;
+    SymbolAddress* symbols = loadSymbols(profile, elfPath, &count);
+    if (!symbols) {
+        free(profile);
+        return NULL;
+    }
+    // Every address belongs to the closest symbol at or below it
+    qsort(symbols, count, sizeof(SymbolAddress), compareSymbols);
+    unsigned next = 0;
+    unsigned current = PROFILER_UNKNOWN_LABEL;
+    for (unsigned addr = 0; addr < 64 * 1024; addr++) {
+        while (next < count && symbols[next].address == addr) {
+            current = symbols[next++].label;
+            profile->labelStart[addr] = true;
+        }
+        profile->pcToLabel[addr] = current;
+    }
+    free(symbols);
+    profile->minBusy = profile->minPass = ~0ULL;
+    printf("Profiling %s with %d labels from %s\n", coreName, profile->labelCount - 1, elfPath);
+    return profile;
+}
+
+void profilerDestroy(CoreProfile* profile) {
+    free(profile);
+}
+
+void profilerRecord(CoreProfile* profile, uint16_t pc, unsigned tstates, bool halted) {
+    if (halted) {
+        profile->frameIdle += tstates;
+        return;
+    }
+    ProfileLabel* label = &profile->labels[profile->pcToLabel[pc]];
+    label->frameCycles += tstates;
+    if (profile->labelStart[pc]) label->entries++;
+    profile->frameBusy += tstates;
+    profile->passBusy += tstates;
+}
+
+void profilerEndFrame(CoreProfile* profile) {
+    for (unsigned i = 0; i < profile->labelCount; i++) {
+        ProfileLabel* label = &profile->labels[i];
+        if (label->frameCycles < label->minCycles) label->minCycles = label->frameCycles;
+        if (label->frameCycles > label->maxCycles) label->maxCycles = label->frameCycles;
+        label->totalCycles += label->frameCycles;
+        label->frameCycles = 0;
+    }
+    if (profile->frameBusy < profile->minBusy) profile->minBusy = profile->frameBusy;
+    if (profile->frameBusy > profile->maxBusy) profile->maxBusy = profile->frameBusy;
+    profile->totalBusy += profile->frameBusy;
+    profile->totalIdle += profile->frameIdle;
+    profile->frameBusy = 0;
+    profile->frameIdle = 0;
+    profile->frames++;
+}
+
+void profilerEndPass(CoreProfile* profile, unsigned long long budget) {
+    unsigned long long cycles = profile->passBusy;
+    profile->passBusy = 0;
+    profile->passes++;
+    if (cycles < profile->minPass) profile->minPass = cycles;
+    if (cycles > profile->maxPass) profile->maxPass = cycles;
+    profile->totalPass += cycles;
+    unsigned bucket = budget ? cycles * 10 / budget : 0;
+    profile->passBuckets[bucket < PROFILER_PASS_BUCKETS ? bucket : PROFILER_PASS_BUCKETS - 1]++;
+    if (cycles > budget) {
+        profile->passesOverBudget++;
+        printf("warning: %s pass %d took %llu cycles, over the blanking budget of %llu by %llu\n", profile->coreName, profile->passes, cycles, budget, cycles - budget);
+    }
+}
+
+static int compareLabelTotals(const void* a, const void* b) {
+    const ProfileLabel* la = *(const ProfileLabel* const*)a;
+    const ProfileLabel* lb = *(const ProfileLabel* const*)b;
+    return (la->totalCycles < lb->totalCycles) - (la->totalCycles > lb->totalCycles);
+}
+
+void profilerReport(CoreProfile* profile, unsigned long long budget) {
+    if (profile->frames == 0) return;
+    unsigned frames = profile->frames;
+    printf("%s profile over %d frames, blanking budget %llu cycles per frame\n", profile->coreName, frames, budget);
+    printf("\tbusy cycles per frame: min %llu, avg %llu, max %llu (%llu%% of budget on average)\n", profile->minBusy,
+           profile->totalBusy / frames, profile->maxBusy, budget ? profile->totalBusy * 100 / frames / budget : 0);
+    printf("\tidle cycles per frame: avg %llu\n", profile->totalIdle / frames);
+
+    ProfileLabel* sorted[PROFILER_MAX_LABELS];
+    for (unsigned i = 0; i < profile->labelCount; i++) sorted[i] = &profile->labels[i];
+    qsort(sorted, profile->labelCount, sizeof(ProfileLabel*), compareLabelTotals);
+    printf("\t%-24s %12s %10s %10s %10s %6s\n", "label", "entries", "min", "avg", "max", "busy%");
+    for (unsigned i = 0; i < profile->labelCount; i++) {
+        ProfileLabel* label = sorted[i];
+        if (label->totalCycles == 0) continue;
+        printf("\t%-24s %12llu %10llu %10llu %10llu %5.1f%%\n", label->name, label->entries, label->minCycles, label->totalCycles / frames,
+               label->maxCycles, profile->totalBusy ? 100.0 * label->totalCycles / profile->totalBusy : 0.0);
+    }
+
+    if (profile->passes == 0) return;
+    printf("\trender passes: %d, min %llu, avg %llu, max %llu cycles, %d over budget\n", profile->passes, profile->minPass,
+           profile->totalPass / profile->passes, profile->maxPass, profile->passesOverBudget);
+    for (unsigned i = 0; i < PROFILER_PASS_BUCKETS; i++) {
+        if (!profile->passBuckets[i]) continue;
+        if (i == PROFILER_PASS_BUCKETS - 1) printf("\t\t>=%3d%% of budget: %d\n", i * 10, profile->passBuckets[i]);
+        else printf("\t\t%3d-%3d%% of budget: %d\n", i * 10, i * 10 + 9, profile->passBuckets[i]);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct CoreProfile CoreProfile;
+
+// Load the symbols of a core's ELF file and attribute T-states to the label each PC falls under. Returns NULL if the symbols
+// can't be read.
+CoreProfile* profilerCreate(const char* coreName, const char* elfPath);
+void profilerDestroy(CoreProfile* profile);
+// Attribute one executed instruction. Halted instructions only count as idle time.
+void profilerRecord(CoreProfile* profile, uint16_t pc, unsigned tstates, bool halted);
+// Close the current frame and fold each label's cycles into its min/avg/max
+void profilerEndFrame(CoreProfile* profile);
+// Close a render pass, i.e. the busy cycles between two completion points, and warn if it didn't fit in the budget
+void profilerEndPass(CoreProfile* profile, unsigned long long budget);
+void profilerReport(CoreProfile* profile, unsigned long long budget);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "C2SS"
+#define SNAPSHOT_FILE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t rawLen;
+    uint64_t encodedLen;
+} SnapshotFileHeader;
+
+bool snapshotWriteFile(const char* path, const uint8_t* state, size_t len) {
+    uint8_t* encoded = malloc(DELTA_BOUND(len));
+    if (!encoded) return false;
+    SnapshotFileHeader header = { .version = SNAPSHOT_FILE_VERSION, .rawLen = len };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.encodedLen = deltaEncode(NULL, state, len, encoded);
+
+    bool ok = false;
+    FILE* file = fopen(path, "wb");
+    if (file) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(encoded, 1, header.encodedLen, file) == header.encodedLen;
+        ok = fclose(file) == 0 && ok;
+    } else printf("Couldn't open %s\n", path);
+    free(encoded);
+    return ok;
+}
+
+uint8_t* snapshotReadFile(const char* path, size_t* len) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    SnapshotFileHeader header;
+    uint8_t* encoded = NULL;
+    uint8_t* state = NULL;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_FILE_VERSION) {
+        printf("%s isn't a snapshot file\n", path);
+        goto done;
+    }
+    encoded = malloc(header.encodedLen);
+    state = calloc(1, header.rawLen);
+    if (!encoded || !state || fread(encoded, 1, header.encodedLen, file) != header.encodedLen ||
+        !deltaApply(encoded, header.encodedLen, state, header.rawLen)) {
+        printf("%s is truncated or corrupt\n", path);
+        free(state);
+        state = NULL;
+        goto done;
+    }
+    *len = header.rawLen;
+done:
+    free(encoded);
+    fclose(file);
+    return state;
+}
+
+bool rewindInit(RewindBuffer* buffer, size_t stateSize, unsigned capacity, size_t maxBytes) {
+    memset(buffer, 0, sizeof(RewindBuffer));
+    buffer->stateSize = stateSize;
+    buffer->capacity = capacity;
+    buffer->maxBytes = maxBytes;
+    buffer->head = malloc(stateSize);
+    buffer->scratch = malloc(DELTA_BOUND(stateSize));
+    buffer->deltas = calloc(capacity, sizeof(struct RewindDelta));
+    if (!buffer->head || !buffer->scratch || !buffer->deltas) {
+        rewindFree(buffer);
+        return false;
+    }
+    return true;
+}
+
+void rewindFree(RewindBuffer* buffer) {
+    for (unsigned i = 0; buffer->deltas && i < buffer->count; i++) free(buffer->deltas[(buffer->start + i) % buffer->capacity].data);
+    free(buffer->deltas);
+    free(buffer->head);
+    free(buffer->scratch);
+    memset(buffer, 0, sizeof(RewindBuffer));
+}
+
+static void dropOldest(RewindBuffer* buffer) {
+    struct RewindDelta* oldest = &buffer->deltas[buffer->start];
+    buffer->bytesUsed -= oldest->len;
+    free(oldest->data);
+    oldest->data = NULL;
+    buffer->start = (buffer->start + 1) % buffer->capacity;
+    buffer->count--;
+}
+
+void rewindPush(RewindBuffer* buffer, const uint8_t* state) {
+    if (buffer->hasHead && buffer->capacity > 0) {
+        size_t len = deltaEncode(buffer->head, state, buffer->stateSize, buffer->scratch);
+        while (buffer->count > 0 && (buffer->count == buffer->capacity || buffer->bytesUsed + len > buffer->maxBytes)) dropOldest(buffer);
+        uint8_t* data = malloc(len);
+        if (data && len <= buffer->maxBytes) {
+            memcpy(data, buffer->scratch, len);
+            struct RewindDelta* delta = &buffer->deltas[(buffer->start + buffer->count) % buffer->capacity];
+            delta->data = data;
+            delta->len = len;
+            buffer->bytesUsed += len;
+            buffer->count++;
+        } else {
+            // The chain back from the new head is broken, so nothing older can be reached
+            free(data);
+            while (buffer->count > 0) dropOldest(buffer);
+        }
+    }
+    memcpy(buffer->head, state, buffer->stateSize);
+    buffer->hasHead = true;
+}
+
+unsigned rewindAvailable(RewindBuffer* buffer) {
+    return buffer->hasHead ? buffer->count + 1 : 0;
+}
+
+bool rewindTo(RewindBuffer* buffer, unsigned steps, uint8_t* state) {
+    if (steps == 0 || steps > rewindAvailable(buffer)) return false;
+    for (unsigned i = 1; i < steps; i++) {
+        struct RewindDelta* newest = &buffer->deltas[(buffer->start + buffer->count - 1) % buffer->capacity];
+        deltaApply(newest->data, newest->len, buffer->head, buffer->stateSize);
+        buffer->bytesUsed -= newest->len;
+        free(newest->data);
+        newest->data = NULL;
+        buffer->count--;
+    }
+    memcpy(state, buffer->head, buffer->stateSize);
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Write a machine state blob to a file, delta encoded against zeros since most of memory is usually empty
+bool snapshotWriteFile(const char* path, const uint8_t* state, size_t len);
+// Read a state blob written by snapshotWriteFile. Returns a malloced buffer or NULL.
+uint8_t* snapshotReadFile(const char* path, size_t* len);
+
+// Periodic in-memory snapshots for rewinding. The latest snapshot is kept in full and each older one is stored as a delta
+// against the one after it, so dropping the oldest never invalidates the others.
+typedef struct {
+    size_t stateSize;
+    uint8_t* head;
+    bool hasHead;
+    uint8_t* scratch;
+    struct RewindDelta {
+        uint8_t* data;
+        size_t len;
+    }* deltas;
+    unsigned capacity;
+    unsigned count;
+    // Index of the oldest delta
+    unsigned start;
+    size_t bytesUsed;
+    size_t maxBytes;
+} RewindBuffer;
+
+bool rewindInit(RewindBuffer* buffer, size_t stateSize, unsigned capacity, size_t maxBytes);
+void rewindFree(RewindBuffer* buffer);
+void rewindPush(RewindBuffer* buffer, const uint8_t* state);
+// Number of snapshots that can be rewound to
+unsigned rewindAvailable(RewindBuffer* buffer);
+// Go back to the nth most recent snapshot (1 being the latest) and copy it to state. Newer snapshots are discarded.
+bool rewindTo(RewindBuffer* buffer, unsigned steps, uint8_t* state);
+
+#endif
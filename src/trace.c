@@ -0,0 +1,54 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+Trace* traceCreate(size_t records) {
+    size_t capacity = 1;
+    while (capacity < records) capacity <<= 1;
+    Trace* trace = calloc(1, sizeof(Trace));
+    if (!trace) return NULL;
+    trace->records = aligned_alloc(64, capacity * sizeof(TraceRecord));
+    if (!trace->records) {
+        free(trace);
+        return NULL;
+    }
+    // Touch every page now so recording never faults them in
+    memset(trace->records, 0, capacity * sizeof(TraceRecord));
+    trace->mask = capacity - 1;
+    trace->current = &trace->records[0];
+    return trace;
+}
+
+void traceDestroy(Trace* trace) {
+    free(trace->records);
+    free(trace);
+}
+
+static bool writeAll(int fd, const void* data, size_t len) {
+    const char* bytes = data;
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written <= 0) return false;
+        bytes += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool traceDump(Trace* trace, const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t capacity = trace->mask + 1;
+    size_t count = trace->count < capacity ? trace->count : capacity;
+    // The oldest record is the next one to be overwritten once the ring has wrapped
+    size_t start = trace->count < capacity ? 0 : trace->count & trace->mask;
+    size_t firstPart = count < capacity - start ? count : capacity - start;
+    TraceFileHeader header = { .version = TRACE_FILE_VERSION, .recordSize = sizeof(TraceRecord), .recordCount = count, .totalRecords = trace->count };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    bool ok = writeAll(fd, &header, sizeof(header)) && writeAll(fd, &trace->records[start], firstPart * sizeof(TraceRecord)) &&
+              writeAll(fd, trace->records, (count - firstPart) * sizeof(TraceRecord));
+    return close(fd) == 0 && ok;
+}
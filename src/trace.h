@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "C2TR"
+#define TRACE_FILE_VERSION 1
+// Used when no record count is given, 16MB of records
+#define TRACE_DEFAULT_RECORDS (1u << 20)
+
+// Record flags
+#define TRACE_CPU 0x01
+#define TRACE_HALTED 0x02
+#define TRACE_MEM_WRITE 0x04
+#define TRACE_IO_WRITE 0x08
+
+// One executed instruction. Records are 16 bytes so four fit in a cache line and filling one is a few stores.
+typedef struct {
+    // Low 32 bits of the core's T-state count when the instruction started. Each core's count only goes up, so readers can
+    // restore the high bits by following wraparounds.
+    uint32_t cycles;
+    uint16_t pc;
+    // The last memory or I/O write the instruction made, if TRACE_MEM_WRITE or TRACE_IO_WRITE is set
+    uint16_t busAddress;
+    // The instruction's first four bytes, which covers every Z80 opcode and its prefixes
+    uint8_t opcode[4];
+    uint8_t busValue;
+    // Capped at 255 for instructions stalled by a long DMA copy
+    uint8_t tstates;
+    uint8_t flags;
+    uint8_t reserved;
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 16, "trace records must stay 16 bytes");
+
+// Trace files are this header followed by the records, oldest first
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t recordCount;
+    // Every record written since the trace was created, including those the ring has since overwritten
+    uint64_t totalRecords;
+} TraceFileHeader;
+
+// A ring of the most recent instructions of both cores. The capacity is a power of two so the next slot is a mask away.
+typedef struct {
+    TraceRecord* records;
+    size_t mask;
+    uint64_t count;
+    // The record of the instruction being executed, which the bus writes of that instruction go into
+    TraceRecord* current;
+} Trace;
+
+// Allocate a ring of at least the given number of records. Returns NULL if it can't be allocated.
+Trace* traceCreate(size_t records);
+void traceDestroy(Trace* trace);
+// Write the ring to a file, oldest record first. Only uses open and write, so it can be called from a signal handler.
+bool traceDump(Trace* trace, const char* path);
+
+#endif
@@ -0,0 +1,218 @@
+// Offline reader for frame captures written by --capture. Lists what a capture holds, prints the CRC of every frame in the
+// same form as --crc-log for comparing against golden logs, and extracts any frame, or a raw pixel map dump from
+// --dump-pixels or the debugger's dv command, to a PPM or PNG image.
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/capture.h"
+#include "../src/consts.h"
+#include "../src/palette.h"
+
+// PNG image data is stored in uncompressed deflate blocks, which hold at most this much each
+#define DEFLATE_STORED_MAX 65535
+
+static uint32_t crcTable[256];
+
+static void buildCRCTable(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (unsigned k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+static uint32_t crcUpdate(uint32_t crc, const uint8_t* data, size_t len) {
+    crc ^= 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static void putBE32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static bool writePNGChunk(FILE* file, const char* type, const uint8_t* data, size_t len) {
+    uint8_t header[8];
+    uint8_t crc[4];
+    putBE32(header, len);
+    memcpy(header + 4, type, 4);
+    putBE32(crc, crcUpdate(crcUpdate(0, header + 4, 4), data, len));
+    return fwrite(header, sizeof(header), 1, file) == 1 && (len == 0 || fwrite(data, len, 1, file) == 1) && fwrite(crc, sizeof(crc), 1, file) == 1;
+}
+
+// Write 8 bit RGB as a PNG. The image data is zlib framed but stored rather than compressed, which keeps this free of
+// dependencies, and the frames are small.
+static bool writePNG(FILE* file, const uint8_t* rgb, unsigned width, unsigned height) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    uint8_t ihdr[13] = { 0 };
+    putBE32(ihdr, width);
+    putBE32(ihdr + 4, height);
+    ihdr[8] = 8; // Bit depth
+    ihdr[9] = 2; // RGB
+
+    // Each row is preceded by filter type 0
+    size_t rowLen = (size_t)width * 3 + 1;
+    size_t rawLen = rowLen * height;
+    size_t blocks = rawLen / DEFLATE_STORED_MAX + 1;
+    uint8_t* raw = malloc(rawLen);
+    uint8_t* zlib = malloc(2 + rawLen + blocks * 5 + 4);
+    bool ok = raw && zlib;
+    if (ok) {
+        for (unsigned y = 0; y < height; y++) {
+            raw[y * rowLen] = 0;
+            memcpy(&raw[y * rowLen + 1], &rgb[(size_t)y * width * 3], (size_t)width * 3);
+        }
+        size_t n = 0;
+        zlib[n++] = 0x78;
+        zlib[n++] = 0x01;
+        uint32_t a = 1, b = 0;
+        for (size_t pos = 0; pos < rawLen || pos == 0;) {
+            size_t len = rawLen - pos < DEFLATE_STORED_MAX ? rawLen - pos : DEFLATE_STORED_MAX;
+            zlib[n++] = pos + len == rawLen;
+            zlib[n++] = len;
+            zlib[n++] = len >> 8;
+            zlib[n++] = ~len;
+            zlib[n++] = ~len >> 8;
+            memcpy(&zlib[n], &raw[pos], len);
+            n += len;
+            pos += len;
+            if (len == 0) break;
+        }
+        for (size_t i = 0; i < rawLen; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        putBE32(&zlib[n], (b << 16) | a);
+        n += 4;
+        ok = fwrite(signature, sizeof(signature), 1, file) == 1 && writePNGChunk(file, "IHDR", ihdr, sizeof(ihdr)) &&
+             writePNGChunk(file, "IDAT", zlib, n) && writePNGChunk(file, "IEND", NULL, 0);
+    }
+    free(raw);
+    free(zlib);
+    return ok;
+}
+
+static bool endsWith(const char* s, const char* suffix) {
+    size_t len = strlen(s);
+    size_t suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(s + len - suffixLen, suffix) == 0;
+}
+
+// Convert pixel map bytes through the palette and write them as a PPM, or a PNG if the path ends in .png
+static bool writeImage(const char* path, const uint8_t* pixels, unsigned width, unsigned height) {
+    uint32_t* argb = malloc((size_t)width * height * sizeof(uint32_t));
+    uint8_t* rgb = malloc((size_t)width * height * 3);
+    FILE* file = fopen(path, "wb");
+    bool ok = argb && rgb && file;
+    if (ok) {
+        for (unsigned y = 0; y < height; y++) convertRow(&pixels[(size_t)y * width], &argb[(size_t)y * width], width);
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            rgb[i * 3] = argb[i] >> 16;
+            rgb[i * 3 + 1] = argb[i] >> 8;
+            rgb[i * 3 + 2] = argb[i];
+        }
+        if (endsWith(path, ".png")) ok = writePNG(file, rgb, width, height);
+        else ok = fprintf(file, "P6\n%u %u\n255\n", width, height) > 0 && fwrite(rgb, (size_t)width * height * 3, 1, file) == 1;
+    } else if (!file) printf("Couldn't open %s\n", path);
+    if (file) ok = fclose(file) == 0 && ok;
+    free(argb);
+    free(rgb);
+    if (ok) printf("Wrote %ux%u image to %s\n", width, height, path);
+    return ok;
+}
+
+static int info(CaptureReader* reader) {
+    CaptureFileHeader* header = &reader->header;
+    unsigned long long keyframes = 0;
+    unsigned long long gaps = 0;
+    for (uint32_t i = 0; i < reader->entries; i++) {
+        if (reader->index[i].flags & CAPTURE_KEYFRAME) keyframes++;
+        if (i > 0 && reader->index[i].frame != reader->index[i - 1].frame + 1) gaps++;
+    }
+    printf("%ux%u frames, a keyframe every %u records%s\n", header->width, header->height, header->keyframeInterval,
+           reader->indexed ? "" : ", no index so the records were walked");
+    if (reader->entries == 0) {
+        printf("No frames captured\n");
+        return 0;
+    }
+    // Records are back to back, so every record but the last lies between the first and last records' offsets
+    uint64_t recordBytes = reader->index[reader->entries - 1].offset - reader->index[0].offset;
+    printf("%u frames from %u to %u, %llu keyframes, %llu gaps where frames were dropped or skipped\n", reader->entries,
+           reader->index[0].frame, reader->index[reader->entries - 1].frame, keyframes, gaps);
+    if (reader->entries > 1) {
+        double frameSize = (double)header->width * header->height;
+        double average = (double)recordBytes / (reader->entries - 1);
+        printf("%.0f bytes per frame on average, %.1f%% of the raw frames\n", average, 100.0 * average / frameSize);
+    }
+    return 0;
+}
+
+static int crcs(CaptureReader* reader) {
+    uint8_t* pixels = malloc((size_t)reader->header.width * reader->header.height);
+    if (!pixels) return 1;
+    int status = 0;
+    for (uint32_t i = 0; i < reader->entries && status == 0; i++) {
+        if (!captureReadFrame(reader, i, pixels)) status = 1;
+        else printf("%u %08x\n", reader->index[i].frame, crcUpdate(0, pixels, (size_t)reader->header.width * reader->header.height));
+    }
+    free(pixels);
+    return status;
+}
+
+static int extract(CaptureReader* reader, unsigned frame, const char* imagePath) {
+    uint32_t entry = 0;
+    while (entry < reader->entries && reader->index[entry].frame != frame) entry++;
+    if (entry == reader->entries) {
+        printf("Frame %u wasn't captured\n", frame);
+        return 1;
+    }
+    uint8_t* pixels = malloc((size_t)reader->header.width * reader->header.height);
+    bool ok = pixels && captureReadFrame(reader, entry, pixels) && writeImage(imagePath, pixels, reader->header.width, reader->header.height);
+    free(pixels);
+    return ok ? 0 : 1;
+}
+
+static int extractRaw(const char* dumpPath, const char* imagePath) {
+    FILE* file = fopen(dumpPath, "rb");
+    if (!file) {
+        printf("Couldn't open %s\n", dumpPath);
+        return 1;
+    }
+    static uint8_t pixels[DISPLAY_PIXELS_X * DISPLAY_PIXELS_Y + 1];
+    size_t len = fread(pixels, 1, sizeof(pixels), file);
+    fclose(file);
+    if (len != DISPLAY_PIXELS_X * DISPLAY_PIXELS_Y) {
+        printf("%s is %zu bytes, not a %dx%d pixel map\n", dumpPath, len, DISPLAY_PIXELS_X, DISPLAY_PIXELS_Y);
+        return 1;
+    }
+    return writeImage(imagePath, pixels, DISPLAY_PIXELS_X, DISPLAY_PIXELS_Y) ? 0 : 1;
+}
+
+static void usage(void) {
+    printf("usage: capture info <capture>\n");
+    printf("       capture crcs <capture>\n");
+    printf("       capture extract <capture> <frame> <image.ppm|image.png>\n");
+    printf("       capture raw <pixel map dump> <image.ppm|image.png>\n");
+}
+
+int main(int argc, char** argv) {
+    buildCRCTable();
+    paletteInit();
+    if (argc == 4 && strcmp(argv[1], "raw") == 0) return extractRaw(argv[2], argv[3]);
+    bool infoCmd = argc == 3 && strcmp(argv[1], "info") == 0;
+    bool crcsCmd = argc == 3 && strcmp(argv[1], "crcs") == 0;
+    bool extractCmd = argc == 5 && strcmp(argv[1], "extract") == 0;
+    if (!infoCmd && !crcsCmd && !extractCmd) {
+        usage();
+        return 1;
+    }
+    CaptureReader reader;
+    if (!captureReaderOpen(&reader, argv[2])) return 1;
+    int status = infoCmd ? info(&reader) : crcsCmd ? crcs(&reader) : extract(&reader, strtoul(argv[3], NULL, 10), argv[4]);
+    captureReaderClose(&reader);
+    return status;
+}
@@ -0,0 +1,171 @@
+// Offline reader for instruction traces written by --trace or the debugger's t command. Prints a summary and the hottest
+// PCs of each core, and optionally the last instructions with repeated loops folded into one copy of their body.
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/trace.h"
+
+#define DEFAULT_HOT_PCS 20
+// Longest loop body the listing folds
+#define MAX_LOOP_LEN 64
+
+typedef struct {
+    uint64_t cycles;
+    TraceRecord record;
+} Instruction;
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long tstates;
+} PCStats;
+
+static PCStats pcStats[2][64 * 1024];
+static unsigned pcOrder[64 * 1024];
+static unsigned sortCore;
+
+static int compareHotPCs(const void* a, const void* b) {
+    unsigned long long ta = pcStats[sortCore][*(const unsigned*)a].tstates;
+    unsigned long long tb = pcStats[sortCore][*(const unsigned*)b].tstates;
+    return (ta < tb) - (ta > tb);
+}
+
+static const char* coreName(unsigned core) {
+    return core ? "CPU" : "PPU";
+}
+
+static void printInstruction(Instruction* ins) {
+    TraceRecord* r = &ins->record;
+    printf("%14llu %s %04x  %02x %02x %02x %02x  %2uT", (unsigned long long)ins->cycles, coreName(r->flags & TRACE_CPU), r->pc,
+           r->opcode[0], r->opcode[1], r->opcode[2], r->opcode[3], r->tstates);
+    if (r->flags & TRACE_HALTED) printf("  halted");
+    if (r->flags & TRACE_MEM_WRITE) printf("  (%04x) <- %02x", r->busAddress, r->busValue);
+    if (r->flags & TRACE_IO_WRITE) printf("  port %02x <- %02x", r->busAddress & 0xFF, r->busValue);
+    printf("\n");
+}
+
+static bool sameBody(Instruction* ins, size_t a, size_t b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (ins[a + i].record.pc != ins[b + i].record.pc) return false;
+    }
+    return true;
+}
+
+// Print instructions, folding a body of up to MAX_LOOP_LEN instructions that repeats back to back into one copy of it
+static void printFolded(Instruction* ins, size_t start, size_t end) {
+    size_t i = start;
+    while (i < end) {
+        size_t bestLen = 0;
+        size_t bestReps = 1;
+        for (size_t len = 1; len <= MAX_LOOP_LEN && i + 2 * len <= end; len++) {
+            size_t reps = 1;
+            while (i + (reps + 1) * len <= end && sameBody(ins, i, i + reps * len, len)) reps++;
+            if (reps > 1 && reps * len > bestReps * bestLen) {
+                bestLen = len;
+                bestReps = reps;
+            }
+        }
+        if (bestReps == 1) {
+            printInstruction(&ins[i++]);
+            continue;
+        }
+        for (size_t j = 0; j < bestLen; j++) printInstruction(&ins[i + j]);
+        uint64_t cycles = ins[i + bestReps * bestLen - 1].cycles + ins[i + bestReps * bestLen - 1].record.tstates - ins[i].cycles;
+        printf("%14s ^ loop of %zu instructions run %zu times, %llu T-states\n", "", bestLen, bestReps, (unsigned long long)cycles);
+        i += bestReps * bestLen;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [--hot <n>] [--list <n>] [--core ppu|cpu]\n", argv[0]);
+        return 1;
+    }
+    unsigned hotPCs = DEFAULT_HOT_PCS;
+    size_t listCount = 0;
+    int onlyCore = -1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--hot") == 0 && i + 1 < argc) {
+            hotPCs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--list") == 0 && i + 1 < argc) {
+            listCount = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            i++;
+            onlyCore = strcmp(argv[i], "cpu") == 0 ? 1 : strcmp(argv[i], "ppu") == 0 ? 0 : -1;
+            if (onlyCore < 0) {
+                printf("Unknown core %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            printf("Unrecognised option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        printf("Couldn't open %s\n", argv[1]);
+        return 1;
+    }
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_FILE_VERSION || header.recordSize != sizeof(TraceRecord)) {
+        printf("%s isn't a version %d trace file\n", argv[1], TRACE_FILE_VERSION);
+        return 1;
+    }
+    Instruction* ins = malloc((header.recordCount ? header.recordCount : 1) * sizeof(Instruction));
+    if (!ins) {
+        printf("Couldn't allocate %u records\n", header.recordCount);
+        return 1;
+    }
+    // Restore the high bits of each core's T-state counts, which only go up
+    uint64_t lastCycles[2] = { 0, 0 };
+    bool seen[2] = { false, false };
+    size_t count = 0;
+    for (uint32_t i = 0; i < header.recordCount; i++) {
+        TraceRecord record;
+        if (fread(&record, sizeof(record), 1, file) != 1) {
+            printf("Trace ends after %u of %u records\n", i, header.recordCount);
+            break;
+        }
+        unsigned core = record.flags & TRACE_CPU;
+        uint64_t cycles = (lastCycles[core] & ~0xFFFFFFFFull) | record.cycles;
+        if (seen[core] && cycles < lastCycles[core]) cycles += 1ull << 32;
+        lastCycles[core] = cycles;
+        seen[core] = true;
+        pcStats[core][record.pc].count++;
+        pcStats[core][record.pc].tstates += record.tstates;
+        if (onlyCore < 0 || (int)core == onlyCore) ins[count++] = (Instruction){ .cycles = cycles, .record = record };
+    }
+    fclose(file);
+
+    printf("%s: %u of %llu recorded instructions\n", argv[1], header.recordCount, (unsigned long long)header.totalRecords);
+    for (unsigned core = 0; core < 2; core++) {
+        if (onlyCore >= 0 && (int)core != onlyCore) continue;
+        unsigned long long total = 0, tstates = 0;
+        unsigned pcs = 0;
+        for (unsigned pc = 0; pc < 64 * 1024; pc++) {
+            if (!pcStats[core][pc].count) continue;
+            total += pcStats[core][pc].count;
+            tstates += pcStats[core][pc].tstates;
+            pcOrder[pcs++] = pc;
+        }
+        if (total == 0) continue;
+        printf("%s: %llu instructions at %u PCs, %llu T-states\n", coreName(core), total, pcs, tstates);
+        sortCore = core;
+        qsort(pcOrder, pcs, sizeof(unsigned), compareHotPCs);
+        printf("\t%-6s %12s %12s %6s\n", "pc", "count", "T-states", "share");
+        for (unsigned i = 0; i < pcs && i < hotPCs; i++) {
+            PCStats* stats = &pcStats[core][pcOrder[i]];
+            printf("\t%04x   %12llu %12llu %5.1f%%\n", pcOrder[i], stats->count, stats->tstates, tstates ? 100.0 * stats->tstates / tstates : 0.0);
+        }
+    }
+
+    if (listCount > 0) {
+        size_t start = count > listCount ? count - listCount : 0;
+        printf("Last %zu instructions:\n", count - start);
+        printFolded(ins, start, count);
+    }
+    free(ins);
+    return 0;
+}